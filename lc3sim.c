@@ -21,16 +21,40 @@
  *   SOFTWARE.
  */
 
+/* pthread_setaffinity_np and CPU_SET for batch --pin-workers */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <strings.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
 
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
 
 #ifndef ARRAY_SIZE
-#define ARRAY_SIZE(x) sizeof(x)/sizeof(x[0])
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #endif
 
 #define FLAG_N (1 << 2)
@@ -41,6 +65,22 @@
 #define OS_KBDR 0xFE02
 #define OS_DSR 0xFE04
 #define OS_DDR 0xFE06
+/* optional DMA controller (--dma) */
+#define DMA_SRC 0xFE10
+#define DMA_DST 0xFE12
+#define DMA_LEN 0xFE14
+#define DMA_CR 0xFE16
+/* optional block device (--disk=FILE) */
+#define DSK_SEC 0xFE18
+#define DSK_BUF 0xFE1A
+#define DSK_CR 0xFE1C
+#define DSK_SIZE 0xFE1E
+/* performance counters, the value registers are readable from user mode */
+#define CNT_CR 0xFE20
+#define CNT_INSTLO 0xFE22
+#define CNT_INSTHI 0xFE24
+#define CNT_CYCLO 0xFE26
+#define CNT_CYCHI 0xFE28
 #define OS_PSR 0xFFFC
 #define OS_MCR 0xFFFE
 
@@ -86,6 +126,8 @@
 #define OUT_TRAP 0x24a
 #define BAD_INT 0x314
 #define OS_START 0x230
+/* word the OS start code loads the supervisor stack pointer from */
+#define OS_INITIAL_SSP 0x239
 #define USER_PC 0x23a
 #define GETC_TRAP 0x254
 #define IN_TRAP 0x25a
@@ -970,7 +1012,8 @@ static void dump_registers(uint16_t *registers, uint16_t psr, uint16_t pc, uint1
     printf("PSR=%#x PC=%#x IR=%#x\n\n", psr, pc, ir);
 }
 
-static void dump_instr(uint16_t instr)
+/* disassemble instr into out, returns 0 if instr is not a valid instruction */
+static int disasm_instr(uint16_t instr, char *out, size_t size)
 {
     const char* Rnames[8] = {
         "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7"
@@ -994,19 +1037,19 @@ static void dump_instr(uint16_t instr)
             switch(vec8)
             {
                 case 0x25: /* HALT */
-                    printf("instr: HALT\n");
+                    snprintf(out, size, "HALT");
                     break;
                 case 0x22: /* PUTS */
-                     printf("instr: PUTS\n");
+                     snprintf(out, size, "PUTS");
                      break;
                 case 0x20: /* GETC */
-                    printf("instr: GETC\n");
+                    snprintf(out, size, "GETC");
                     break;
                 default:
-                    printf("instr: TRAP %#x\n", vec8);
+                    snprintf(out, size, "TRAP %#x", vec8);
                     break;
             }
-            return;
+            return 1;
         }
         case 0b0001:
         {
@@ -1019,14 +1062,14 @@ static void dump_instr(uint16_t instr)
             {
                 /* imm5 */
                 sr2 = instr & 0b11111;
-                printf("instr: %s = %s + %d\n", Rnames[dr], Rnames[sr1], sext5(sr2));
+                snprintf(out, size, "%s = %s + %d", Rnames[dr], Rnames[sr1], sext5(sr2));
             } else {
                 /* SR2 */
                 sr2 = instr & 0b111;
-                printf("instr: %s = %s + %s\n", Rnames[dr], Rnames[sr1], Rnames[sr2]);
+                snprintf(out, size, "%s = %s + %s", Rnames[dr], Rnames[sr1], Rnames[sr2]);
             }
 
-            return;
+            return 1;
         }
         case 0b0101:
         {
@@ -1039,14 +1082,14 @@ static void dump_instr(uint16_t instr)
             {
                 /* imm5 */
                 sr2 = instr & 0b11111;
-                printf("instr: %s = %s & %d\n", Rnames[dr], Rnames[sr1], sext5(sr2));
+                snprintf(out, size, "%s = %s & %d", Rnames[dr], Rnames[sr1], sext5(sr2));
             } else {
                 /* SR2 */
                 sr2 = instr & 0b111;
-                printf("instr: %s = %s & %s\n", Rnames[dr], Rnames[sr1], Rnames[sr2]);
+                snprintf(out, size, "%s = %s & %s", Rnames[dr], Rnames[sr1], Rnames[sr2]);
             }
 
-            return;
+            return 1;
         }
         case 0b1001:
         {
@@ -1055,9 +1098,9 @@ static void dump_instr(uint16_t instr)
             dr = (instr & (0b111 << 9)) >> 9;
             sr1 = (instr & (0b111 << 6)) >> 6;
 
-            printf("instr: %s = ~%s\n", Rnames[dr], Rnames[sr1]);
+            snprintf(out, size, "%s = ~%s", Rnames[dr], Rnames[sr1]);
 
-            return;
+            return 1;
         }
         case 0b1110:
         {
@@ -1065,651 +1108,8934 @@ static void dump_instr(uint16_t instr)
 
             dr = (instr & (0b111 << 9)) >> 9;
 
-            printf("instr: %s = pc + %d\n", Rnames[dr], sext9(instr & 0b111111111));
+            snprintf(out, size, "%s = pc + %d", Rnames[dr], sext9(instr & 0b111111111));
 
-            return;
+            return 1;
         }
         case 0b0000:
         {
             uint8_t nzp = (instr & (0b111 << 9)) >> 9;
 
-            printf("instr: BR%s%s%s %d\n", nNames[nzp >> 2], zNames[(nzp >> 1) & 1],
+            snprintf(out, size, "BR%s%s%s %d", nNames[nzp >> 2], zNames[(nzp >> 1) & 1],
                    pNames[nzp & 1], sext9(instr & 0b111111111));
 
-            return;
+            return 1;
         }
         case 0b0010:
         {
-            printf("instr: %s = *(pc + (%d))\n", Rnames[(instr & (0b111 << 9)) >> 9], sext9(instr & 0b111111111));
-            return;
+            snprintf(out, size, "%s = *(pc + (%d))", Rnames[(instr & (0b111 << 9)) >> 9], sext9(instr & 0b111111111));
+            return 1;
         }
         case 0b0011:
         {
-            printf("instr: *(pc + (%d)) = %s\n", sext9(instr & 0b111111111), Rnames[(instr & (0b111 << 9)) >> 9]);
-            return;
+            snprintf(out, size, "*(pc + (%d)) = %s", sext9(instr & 0b111111111), Rnames[(instr & (0b111 << 9)) >> 9]);
+            return 1;
         }
         case 0b1010:
         {
-            printf("instr: %s = **(pc + (%d))\n", Rnames[(instr & (0b111 << 9)) >> 9], sext9(instr & 0b111111111));
-            return;
+            snprintf(out, size, "%s = **(pc + (%d))", Rnames[(instr & (0b111 << 9)) >> 9], sext9(instr & 0b111111111));
+            return 1;
         }
         case 0b1011:
         {
-            printf("instr: **(pc + (%d)) = %s\n", sext9(instr & 0b111111111), Rnames[(instr & (0b111 << 9)) >> 9]);
-            return;
+            snprintf(out, size, "**(pc + (%d)) = %s", sext9(instr & 0b111111111), Rnames[(instr & (0b111 << 9)) >> 9]);
+            return 1;
         }
         case 0b0110:
         {
-            printf("instr: %s = *(%s + (%d))\n", Rnames[(instr & (0b111 << 9)) >> 9],
+            snprintf(out, size, "%s = *(%s + (%d))", Rnames[(instr & (0b111 << 9)) >> 9],
                    Rnames[(instr & (0b111 << 6)) >> 6], sext6(instr & 0b111111));
-            return;
+            return 1;
         }
         case 0b0111:
         {
-            printf("instr: *(%s + (%d)) = %s\n", Rnames[(instr & (0b111 << 6)) >> 6], sext6(instr & 0b111111),
+            snprintf(out, size, "*(%s + (%d)) = %s", Rnames[(instr & (0b111 << 6)) >> 6], sext6(instr & 0b111111),
                                                  Rnames[(instr & (0b111 << 9)) >> 9]);
-            return;
+            return 1;
         }
         case 0b0100:
         {
             if (instr & (1 << 11))
             {
-                printf("instr: JSR %d\n", sext11(instr & 0b11111111111));
+                snprintf(out, size, "JSR %d", sext11(instr & 0b11111111111));
             } else {
-                printf("instr: JSRR %s\n", Rnames[(instr & (0b111 << 6)) >> 6]);
+                snprintf(out, size, "JSRR %s", Rnames[(instr & (0b111 << 6)) >> 6]);
             }
 
-            return;
+            return 1;
         }
         case 0b1100:
         {
-            printf("instr: JMP %s\n", Rnames[(instr & (0b111 << 6)) >> 6]);
+            snprintf(out, size, "JMP %s", Rnames[(instr & (0b111 << 6)) >> 6]);
 
-            return;
+            return 1;
         }
         case 0b1000:
         {
-            printf("instr: RTI\n");
+            snprintf(out, size, "RTI");
 
-            return;
+            return 1;
         }
         default:
         {
-            return;
+            return 0;
         }
     }
 }
 
+static void dump_instr(uint16_t instr)
+{
+    char text[0x40];
+
+    if (disasm_instr(instr, text, sizeof(text)))
+        printf("instr: %s\n", text);
+}
+
+/* the host byte order, known at compile time. -DLC3_HOST_BIG_ENDIAN=1 on a
+   little endian host builds the big endian code path for the tests, which
+   then feed it byte swapped files */
+#ifndef LC3_HOST_BIG_ENDIAN
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LC3_HOST_BIG_ENDIAN 1
+#else
+#define LC3_HOST_BIG_ENDIAN 0
+#endif
+#endif
+
+#if !LC3_HOST_BIG_ENDIAN
 static uint16_t swap16(uint16_t x)
 {
     return (x << 8) | (x >> 8);
 }
+#endif
+
+/* .obj files and disk images are big endian words, convert count of them
+   to host order in place (or back, the swap is its own inverse). big endian
+   hosts get an empty function and little endian ones a loop gcc turns into
+   byte shuffles */
+static void words_from_be(uint16_t *words, size_t count)
+{
+#if LC3_HOST_BIG_ENDIAN
+    (void)words;
+    (void)count;
+#else
+    for (size_t i = 0; i < count; i++)
+        words[i] = swap16(words[i]);
+#endif
+}
 
-static uint16_t *parse_program_from_bin(const char *path, uint16_t *memory)
+/* load an .obj file into memory, returns a pointer to its origin and stores the
+   number of words loaded in length (if not NULL) */
+static uint16_t *parse_program_from_bin(const char *path, uint16_t *memory, uint32_t *length)
 {
     uint16_t origin;
-    uint16_t *addr;
     uint16_t *base;
+    size_t count;
     FILE *file = fopen(path, "rb");
 
     if (!file) return NULL;
 
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
-
-    uint16_t max_read = 0x10000 - origin;
+    if (fread(&origin, sizeof(origin), 1, file) != 1)
+    {
+        fclose(file);
+        return NULL;
+    }
+    words_from_be(&origin, 1);
 
-    /* FIXME: work around for endianness ? */
+    /* an object at x0000 may fill all 0x10000 words */
     base = memory + origin;
-    addr = base;
+    count = fread(base, sizeof(*base), 0x10000 - origin, file);
+    if (length) *length = count;
 
-    /* reuse origin for another purpose */
-    origin = fread(addr, sizeof(*addr), max_read, file);
-
-    while (origin--)
-    {
-        *addr = swap16(*addr), addr++;
-    }
+    words_from_be(base, count);
 
     fclose(file);
 
     return base;
 }
 
-static void interrupt(uint16_t *memory, uint16_t *registers, uint16_t **pc, uint8_t code)
+/* 64-bit FNV-1a, continue a hash by passing the previous value */
+#define FNV_OFFSET 0xcbf29ce484222325ull
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
 {
-    /* update PC */
-    *pc = memory + memory[0x100 + code];
-    /* save USP if in user mode */
-    if (memory[OS_PSR] & (1u << 15))
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < size; i++)
     {
-        /* setup the supervisor stack */
-        memory[OS_USP] = registers[6];
-        registers[6] = memory[OS_SSP];
-        /* supervisor mode */
-        memory[OS_PSR] &= ~(1u << 15);
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
     }
+
+    return hash;
 }
 
-static int check_user_address(uint16_t psr, uint16_t address)
+/* map a whole file read only, NULL if it is missing or empty */
+static void *map_file(const char *path, size_t *size)
 {
-    /* check if in supervisor mode */
-    if (~psr & (1u << 15)) return 0;
+    struct stat st;
+    void *data;
+    int fd = open(path, O_RDONLY);
 
-    /* out of bounds for user mode */
-    return address < 0x3000 || address >= 0xfe00;
+    if (fd < 0) return NULL;
+
+    if (fstat(fd, &st) || !st.st_size)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    *size = st.st_size;
+    return data;
 }
 
-static void update_cond_code(int16_t value, uint16_t *memory)
+/* load an .obj through mmap, same result as parse_program_from_bin */
+static uint16_t *parse_program_from_map(const char *path, uint16_t *memory, uint32_t *length)
 {
-    /* regenerate condition codes */
-    memory[OS_PSR] &= ~0b111;
-    if (value < 0) memory[OS_PSR] |= FLAG_N;
-    if (value == 0) memory[OS_PSR] |= FLAG_Z;
-    if (value > 0) memory[OS_PSR] |= FLAG_P;
-}
+    size_t size;
+    const uint8_t *bytes = map_file(path, &size);
+    uint16_t origin;
+    size_t count;
 
-struct debugger_ctx {
-    int cont;
-    int next_bp;
-    char last[0x100];
-    uint16_t breakpoints[67];
-    int16_t breakpoint_size;
-};
+    if (!bytes) return NULL;
+    if (size < 2)
+    {
+        munmap((void *)bytes, size);
+        return NULL;
+    }
 
-static int debug_cmd(struct debugger_ctx *ctx, uint16_t *memory, uint16_t **pc,  uint16_t *registers)
-{
-    char string[0x100] = {0};
-    char *tok = NULL;
-    char *end = string;
-    uint16_t opcode = (**pc & 0xf000) >> 12;
+    memcpy(&origin, bytes, sizeof(origin));
+    words_from_be(&origin, 1);
+    count = MIN((size - 2) / 2, 0x10000u - origin);
+    memcpy(memory + origin, bytes + 2, count * sizeof(uint16_t));
+    words_from_be(memory + origin, count);
+    if (length) *length = count;
 
-    printf(">>> ");
+    munmap((void *)bytes, size);
+    return memory + origin;
+}
 
-    do
+/* .asm files are assembled with $LC3AS (lc3as by default) and the .obj and
+   .sym are kept in $LC3SIM_CACHE (~/.cache/lc3sim by default) under a hash
+   of the source and the assembler, so a submission is assembled once however
+   many runs load it. entries are renamed into place, which makes the cache
+   safe to share between concurrent runs */
+static void asm_cache_dir(char *out, size_t size)
+{
+    const char *dir = getenv("LC3SIM_CACHE");
+    const char *home = getenv("HOME");
+
+    if (dir && *dir)
+        snprintf(out, size, "%s", dir);
+    else
     {
-        char c = getchar();
-        if (c == '\n' || c == '\0') break;
-        if (end - string >= ARRAY_SIZE(string)) break;
-        *end++ = c;
-    } while (1);
+        snprintf(out, size, "%s/.cache", home ? home : "/tmp");
+        mkdir(out, 0755);
+        snprintf(out, size, "%s/.cache/lc3sim", home ? home : "/tmp");
+    }
 
-    /* do backwards trim */
-    if (end > string)
-        while (isspace(*(end-1))) *--end = '\0';
+    mkdir(out, 0755);
+}
 
-    if (strlen(ctx->last) > 0 && strlen(string) == 0)
+/* the assembler to run and a string that changes whenever it does */
+static int asm_identity(char *path, size_t size, char *version, size_t version_size)
+{
+    const char *name = getenv("LC3AS");
+    const char *dirs = getenv("PATH");
+    struct stat st;
+
+    if (!name || !*name) name = "lc3as";
+
+    if (strchr(name, '/'))
+        snprintf(path, size, "%s", name);
+    else
     {
-        memcpy(string, ctx->last, ARRAY_SIZE(string));
+        path[0] = 0;
+        while (dirs && *dirs)
+        {
+            const char *end = strchr(dirs, ':');
+            int len = end ? end - dirs : (int)strlen(dirs);
+
+            snprintf(path, size, "%.*s/%s", len, dirs, name);
+            if (!access(path, X_OK)) break;
+            path[0] = 0;
+            dirs = end ? end + 1 : NULL;
+        }
     }
 
-    tok = strtok(string, " ");
+    if (!path[0] || stat(path, &st)) return 0;
 
-    if (!tok)
+    snprintf(version, version_size, "%s:%lld:%lld", path, (long long)st.st_size, (long long)st.st_mtime);
+    return 1;
+}
+
+/* the cached .obj for an .asm file, assembling it on a miss */
+static int asm_cache_lookup(const char *source, char *obj, size_t size)
+{
+    char dir[0x300], assembler[0x300], version[0x400], tmp[0x400], file[0x500], sym[0x400];
+    size_t source_size;
+    void *text;
+    uint64_t key;
+    int status, fd, lock;
+    pid_t pid = -1;
+
+    if (!asm_identity(assembler, sizeof(assembler), version, sizeof(version)))
     {
-        printf("Invalid parameter!\n");
+        fprintf(stderr, "No assembler for %s, set LC3AS\n", source);
         return 0;
     }
 
-    if (!strcmp(tok, "s") || !strcmp(tok, "step"))
-    {
-        memcpy(ctx->last, string, ARRAY_SIZE(string));
-        return 1;
-    }
+    if (!(text = map_file(source, &source_size)))
+        return 0;
+    key = fnv1a(fnv1a(FNV_OFFSET, text, source_size), version, strlen(version) + 1);
 
-    if (!strcmp(tok, "c") || !strcmp(tok, "continue"))
+    asm_cache_dir(dir, sizeof(dir));
+    snprintf(obj, size, "%s/%016llx.obj", dir, (unsigned long long)key);
+    snprintf(sym, sizeof(sym), "%s/%016llx.sym", dir, (unsigned long long)key);
+
+    if (!access(obj, R_OK))
     {
-        memcpy(ctx->last, string, ARRAY_SIZE(string));
-        ctx->cont = 1;
+        munmap(text, source_size);
         return 1;
     }
 
-    if (!strcmp(tok, "n") || !strcmp(tok, "next"))
+    /* one run assembles, the others wait for it and then hit */
+    snprintf(file, sizeof(file), "%s/%016llx.lock", dir, (unsigned long long)key);
+    if ((lock = open(file, O_RDWR | O_CREAT, 0644)) >= 0)
+        flock(lock, LOCK_EX);
+
+    if (!access(obj, R_OK))
     {
-        memcpy(ctx->last, string, ARRAY_SIZE(string));
-        /* only store next bp for JSR, TRAP */
-        if (opcode == 0b0100 || opcode == 0b1111)
-            ctx->next_bp = *pc - memory + 1;
+        munmap(text, source_size);
+        if (lock >= 0) close(lock);
         return 1;
     }
 
-    if (!strcmp(tok, "q") || !strcmp(tok, "quit") || !strcmp(tok, "exit"))
+    /* assemble a copy in a private directory, the assembler writes next to its input */
+    snprintf(tmp, sizeof(tmp), "%s/tmp-XXXXXX", dir);
+    if (!mkdtemp(tmp))
     {
-        exit(0);
+        munmap(text, source_size);
+        if (lock >= 0) close(lock);
+        return 0;
     }
 
-    if (!strcmp(tok, "clear"))
-    {
-        printf("\e[1;1H\e[2J");
+    snprintf(file, sizeof(file), "%s/prog.asm", tmp);
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    status = fd >= 0 && write(fd, text, source_size) == (ssize_t)source_size;
+    if (fd >= 0) close(fd);
+    munmap(text, source_size);
 
-        return 0;
+    if (status && (pid = fork()) == 0)
+    {
+        /* keep the assembler's chatter off our stdout */
+        dup2(2, 1);
+        if (chdir(tmp)) _exit(127);
+        execl(assembler, assembler, "prog.asm", (char *)NULL);
+        _exit(127);
     }
 
-    if (!strcmp(tok, "2007/12/11") || !strcmp(tok, "0x7D7"))
-    {
-        printf("https://github.com/Etaash-mathamsetty/\n");
+    status = status && pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status);
+
+    /* the .obj is what readers look for, so it goes in last */
+    snprintf(file, sizeof(file), "%s/prog.sym", tmp);
+    if (status) rename(file, sym);
+    unlink(file);
+    snprintf(file, sizeof(file), "%s/prog.obj", tmp);
+    status = status && !rename(file, obj);
+    unlink(file);
+    snprintf(file, sizeof(file), "%s/prog.asm", tmp);
+    unlink(file);
+    rmdir(tmp);
+
+    /* the lock file stays, removing it could let two runs lock different files */
+    if (lock >= 0) close(lock);
+
+    if (!status)
+        fprintf(stderr, "Failed to assemble %s\n", source);
+    return status;
+}
 
-        return 0;
-    }
+static int is_asm_path(const char *path)
+{
+    size_t len = strlen(path);
 
-    if (!strcmp(tok, "ECE120"))
-    {
-        printf("Stay tuned for Behya announcement!\n");
+    return len > 4 && !strcasecmp(path + len - 4, ".asm");
+}
 
-        return 0;
-    }
+/* load an .obj, or an .asm through the assembler cache */
+static uint16_t *load_object(const char *path, uint16_t *memory, uint32_t *length)
+{
+    char obj[0x400];
 
+    if (!is_asm_path(path))
+        return parse_program_from_bin(path, memory, length);
 
-    if (!strcmp(tok, "h") || !strcmp(tok, "help"))
-    {
-        tok = strtok(NULL, " ");
+    if (!asm_cache_lookup(path, obj, sizeof(obj)))
+        return NULL;
+    return parse_program_from_map(obj, memory, length);
+}
 
-        if (tok && !strcmp(tok, "break"))
-        {
-            printf("Seems like you don't know how to use the break command :(\n");
-            printf("Here's some information on how to use it :D\n\n");
+/* one file loaded into memory, for the load map */
+struct load_segment {
+    const char *path;
+    uint16_t start;
+    uint32_t length;
+};
 
-            printf("Note: One breakpoint is automatically placed by the emulator at 0x3000!\n\n");
+/* the trap and interrupt vector tables and the OS code programs must not cover */
+#define OS_RESERVED_END 0x0300
 
-            printf("add <address>: Adds a breakpoint for some address\n");
-            printf("list: Lists all breakpoints\n");
-            printf("remove <address>: Removes a breakpoint for some address\n");
-            printf("pop: Removes the previously added breakpoint\n");
-            printf("clear: Removes all breakpoints\n");
-        } else if (tok && !strcmp(tok, "reg")) {
-            printf("Seems like you don't know how to use the reg command :(\n");
-            printf("Here's some information on how to use it :D\n\n");
+static int load_segment_cmp(const void *a, const void *b)
+{
+    const struct load_segment *x = a, *y = b;
 
-            printf("set R# <value>: Sets a register to a value\n");
-            printf("list: Lists all registers\n");
-        } else {
-            printf("Seems like you don't know how to use the debugger :(\n");
-            printf("Here's some information on how to use it :D\n\n");
+    if (x->start != y->start) return x->start - y->start;
+    return (int)x->length - (int)y->length;
+}
 
-            printf("help: Prints this menu\n");
-            printf("step: Steps forward one instruction\n");
-            printf("continue: Continues execution until breakpoint\n");
-            printf("next: Continues until a the return of a subroutine/trap\n");
-            printf("break ...: Family of breakpoint management commmands\n");
-            printf("reg ...: Family of register management commands\n");
-            printf("quit: Quits the emulator\n");
-            printf("read <address>: Read a memory address (or range of addresses)\n");
-            printf("write <address>: Write memory to an address\n");
-            printf("decode <address>: Translate data at an address into an instruction\n");
-            printf("decode-i <instr>: Translate parameter into an instruction\n");
-            printf("goto <address>: Set PC to some address\n \tNOTE: PSR and stack pointers will not be switched unless RTI is executed!\n");
-        }
+/* sort the segments and report every overlap, including with the OS area.
+   returns the number of overlaps */
+static int load_map_check(struct load_segment *segments, int count)
+{
+    int overlaps = 0, last = -1;
+    uint32_t end = OS_RESERVED_END;
 
-        return 0;
-    }
+    qsort(segments, count, sizeof(*segments), load_segment_cmp);
 
-    if (!strcmp(tok, "read"))
+    for (int i = 0; i < count; i++)
     {
-        tok = strtok(NULL, " ");
-        unsigned off;
+        const struct load_segment *s = &segments[i];
 
-        if (!tok)
+        if (!s->length) continue;
+
+        /* the segment reaching furthest so far is the one it runs into */
+        if (s->start < end)
         {
-            printf("Invalid parameter!\n");
-            return 0;
+            if (last < 0)
+                fprintf(stderr, "%s (x%04X-x%04X) overlaps the OS vectors and traps (x0000-x%04X)\n", s->path, s->start,
+                        s->start + s->length - 1, OS_RESERVED_END - 1);
+            else
+                fprintf(stderr, "%s (x%04X-x%04X) overlaps %s (x%04X-x%04X)\n", s->path, s->start, s->start + s->length - 1,
+                        segments[last].path, segments[last].start, segments[last].start + segments[last].length - 1);
+            overlaps++;
         }
 
-        sscanf(tok, "%x\n", &off);
+        if ((uint32_t)s->start + s->length > end)
+        {
+            end = (uint32_t)s->start + s->length;
+            last = i;
+        }
+    }
 
-        off &= 0xffff;
-        printf("memory[%#x]=%#x\n", off, memory[off]);
+    return overlaps;
+}
 
-        memcpy(ctx->last, string, ARRAY_SIZE(string));
-        return 0;
-    }
+static void load_map_print(const struct load_segment *segments, int count, const char *program)
+{
+    printf("load map:\n");
+    printf("  x0000-x%04X  OS vectors and traps\n", OS_RESERVED_END - 1);
 
-    if (!strcmp(tok, "goto"))
+    for (int i = 0; i < count; i++)
     {
-        tok = strtok(NULL, " ");
-        unsigned addr;
+        const struct load_segment *s = &segments[i];
 
-        if (!tok)
-        {
-            printf("Invalid parameter!\n");
-            return 0;
-        }
+        printf("  x%04X-x%04X  %s%s\n", s->start, s->start + MAX(s->length, 1) - 1, s->path,
+               s->path == program ? " (program)" : "");
+    }
+}
 
-        sscanf(tok, "%x", &addr);
+#define FRAME_JSR 0
+#define FRAME_TRAP 1
+#define FRAME_INT 2
 
-        *pc = memory + addr - 1;
-        memcpy(ctx->last, string, ARRAY_SIZE(string));
-        return 1;
-    }
+#define SHADOW_STACK_SIZE 0x100
 
-    if (!strcmp(tok, "decode"))
-    {
-        tok = strtok(NULL, " ");
-        unsigned off;
+/* one entry of the debugger's shadow call stack */
+struct shadow_frame {
+    uint16_t call_pc; /* address of the JSR/TRAP or interrupted instruction */
+    uint16_t ret_pc; /* where execution continues once the frame returns */
+    uint16_t target; /* subroutine/handler entry */
+    uint16_t r6; /* R6 and R7 on entry */
+    uint16_t r7;
+    uint8_t kind;
+};
 
-        if (!tok)
-        {
-            printf("Invalid parameter!\n");
-            return 0;
-        }
+/* microsequencer state, numbered like the Patt & Patel control FSM */
+#define UCODE_FETCH 18
+
+struct lc3_micro {
+    int state;
+    /* state executed last, -1 before the first one */
+    int last;
+    uint16_t mar;
+    uint16_t mdr;
+    uint16_t ir;
+    uint16_t bus;
+    int ben;
+    /* vector of the exception being entered, TRAP uses the vector table instead */
+    uint16_t vector;
+    int exception;
+    /* locations stored by the current instruction, for the cross-check */
+    uint16_t writes[2];
+    int write_count;
+    /* clock cycles, a memory state waits mem_latency cycles for R */
+    uint64_t cycles;
+    int mem_latency;
+};
 
-        if (!strcmp(tok, "PC"))
+/* register transfers and asserted control signals of each state */
+static const char *const ustate_names[64] = {
+    [0] = "[BEN] (no signals)",
+    [1] = "DR<-SR1+OP2, setCC (GateALU ALUK=ADD LD.REG LD.CC)",
+    [2] = "MAR<-PC+off9 (ADDR1MUX=PC ADDR2MUX=off9 MARMUX=ADDER GateMARMUX LD.MAR)",
+    [3] = "MAR<-PC+off9 (ADDR1MUX=PC ADDR2MUX=off9 MARMUX=ADDER GateMARMUX LD.MAR)",
+    [4] = "[IR[11]] (no signals)",
+    [5] = "DR<-SR1&OP2, setCC (GateALU ALUK=AND LD.REG LD.CC)",
+    [6] = "MAR<-B+off6 (ADDR1MUX=BaseR ADDR2MUX=off6 MARMUX=ADDER GateMARMUX LD.MAR)",
+    [7] = "MAR<-B+off6 (ADDR1MUX=BaseR ADDR2MUX=off6 MARMUX=ADDER GateMARMUX LD.MAR)",
+    [8] = "MAR<-R6, [PSR[15]] (SR1MUX=R6 GateSR1 LD.MAR)",
+    [9] = "DR<-NOT(SR), setCC (GateALU ALUK=NOT LD.REG LD.CC)",
+    [10] = "MAR<-PC+off9 (ADDR1MUX=PC ADDR2MUX=off9 MARMUX=ADDER GateMARMUX LD.MAR)",
+    [11] = "MAR<-PC+off9 (ADDR1MUX=PC ADDR2MUX=off9 MARMUX=ADDER GateMARMUX LD.MAR)",
+    [12] = "PC<-BaseR (ADDR1MUX=BaseR ADDR2MUX=0 PCMUX=ADDER LD.PC)",
+    [13] = "Vector<-x01 (illegal opcode)",
+    [14] = "DR<-PC+off9, setCC (MARMUX=ADDER GateMARMUX LD.REG LD.CC)",
+    [15] = "MDR<-PSR (GatePSR LD.MDR)",
+    [16] = "M[MAR]<-MDR (MIO.EN R.W=WR)",
+    [18] = "MAR<-PC, PC<-PC+1 (GatePC LD.MAR PCMUX=PC+1 LD.PC)",
+    [20] = "R7<-PC, PC<-BaseR (GatePC LD.REG DRMUX=R7 ADDR1MUX=BaseR PCMUX=ADDER LD.PC)",
+    [21] = "R7<-PC, PC<-PC+off11 (GatePC LD.REG DRMUX=R7 ADDR2MUX=off11 PCMUX=ADDER LD.PC)",
+    [22] = "PC<-PC+off9 (ADDR1MUX=PC ADDR2MUX=off9 PCMUX=ADDER LD.PC)",
+    [23] = "MDR<-SR (GateALU ALUK=PASSA LD.MDR)",
+    [24] = "MDR<-M[MAR] (MIO.EN R.W=RD LD.MDR)",
+    [25] = "MDR<-M[MAR] (MIO.EN R.W=RD LD.MDR)",
+    [26] = "MAR<-MDR (GateMDR LD.MAR)",
+    [27] = "DR<-MDR, setCC (GateMDR LD.REG LD.CC)",
+    [29] = "MDR<-M[MAR] (MIO.EN R.W=RD LD.MDR)",
+    [31] = "MAR<-MDR (GateMDR LD.MAR)",
+    [32] = "BEN<-IR[11]&N+IR[10]&Z+IR[9]&P, [IR[15:12]] (LD.BEN)",
+    [33] = "MDR<-M[MAR] (MIO.EN R.W=RD LD.MDR)",
+    [34] = "[PSR[15]] Saved_SSP<-R6, R6<-Saved_USP (LD.Saved.SSP LD.REG)",
+    [35] = "IR<-MDR (GateMDR LD.IR)",
+    [36] = "MDR<-M[MAR] (MIO.EN R.W=RD LD.MDR)",
+    [37] = "MAR, R6<-R6-1 (SR1MUX=R6 SP.MUX=SP-1 GateSP LD.MAR LD.REG)",
+    [38] = "PC<-MDR (GateMDR PCMUX=BUS LD.PC)",
+    [39] = "MAR, R6<-R6+1 (SR1MUX=R6 SP.MUX=SP+1 GateSP LD.MAR LD.REG)",
+    [40] = "MDR<-M[MAR] (MIO.EN R.W=RD LD.MDR)",
+    [41] = "M[MAR]<-MDR (MIO.EN R.W=WR)",
+    [42] = "PSR<-MDR, R6<-R6+1 (GateMDR LD.PSR SP.MUX=SP+1 LD.REG)",
+    [44] = "Vector<-x00 (privilege mode violation)",
+    [45] = "PSR[15]<-0, [PSR[15]] Saved_USP<-R6, R6<-Saved_SSP, MAR<-x0100+Vector (LD.Saved.USP GateVector LD.MAR)",
+    [46] = "MDR<-PC, MAR, R6<-R6-1 (GatePC LD.MDR SP.MUX=SP-1 GateSP LD.MAR LD.REG)",
+    [47] = "PSR[15]<-0, [PSR[15]] Saved_USP<-R6, R6<-Saved_SSP (LD.Saved.USP LD.REG)",
+    [52] = "M[MAR]<-MDR (MIO.EN R.W=WR)",
+    [53] = "MDR<-M[MAR] (MIO.EN R.W=RD LD.MDR)",
+    [54] = "MAR<-ZEXT(IR[7:0]) (MARMUX=ZEXT GateMARMUX LD.MAR)",
+    [55] = "PC<-MDR (GateMDR PCMUX=BUS LD.PC)",
+    [60] = "Vector<-x02 (access control violation)",
+};
+
+static void micro_dump(const struct lc3_micro *u)
+{
+    if (u->last < 0)
+        printf("no state executed yet\n");
+    else
+        printf("state %d: %s\n", u->last, ustate_names[u->last] ? ustate_names[u->last] : "?");
+    printf("MAR=%#x MDR=%#x IR=%#x BEN=%d BUS=%#x next=%d cycles=%llu\n", u->mar, u->mdr, u->ir, u->ben, u->bus,
+           u->state, (unsigned long long)u->cycles);
+}
+
+struct debugger_ctx {
+    int cont;
+    char last[0x100];
+    uint16_t breakpoints[67];
+    int16_t breakpoint_size;
+    /* memory/registers saved by `snap` for `diff` */
+    uint16_t *snapshot;
+    uint16_t snapshot_registers[8];
+    /* shadow call stack, depth keeps counting past SHADOW_STACK_SIZE */
+    struct shadow_frame frames[SHADOW_STACK_SIZE];
+    int depth;
+    int selected;
+    /* stop once depth drops to this (-1 when not finishing) */
+    int finish_depth;
+    /* run a single microsequencer state instead of an instruction */
+    int ustep;
+    struct lc3_micro *micro;
+};
+
+static void shadow_push(struct debugger_ctx *ctx, uint8_t kind, uint16_t call_pc, uint16_t ret_pc,
+                        uint16_t target, const uint16_t *registers)
+{
+    if (ctx->depth < SHADOW_STACK_SIZE)
+    {
+        struct shadow_frame *f = &ctx->frames[ctx->depth];
+        f->call_pc = call_pc;
+        f->ret_pc = ret_pc;
+        f->target = target;
+        f->r6 = registers[6];
+        f->r7 = registers[7];
+        f->kind = kind;
+    }
+
+    ctx->depth++;
+    ctx->selected = 0;
+}
+
+/* returning to ret_pc unwinds to the matching frame, or just the innermost
+   one if nothing matches (e.g. a subroutine that clobbered R7) */
+static void shadow_pop(struct debugger_ctx *ctx, uint16_t ret_pc)
+{
+    int top = MIN(ctx->depth, SHADOW_STACK_SIZE);
+
+    if (!ctx->depth) return;
+
+    for (int i = top - 1; i >= 0; i--)
+    {
+        if (ctx->frames[i].ret_pc == ret_pc)
         {
-            off = *pc - memory;
+            ctx->depth = i;
+            ctx->selected = 0;
+            return;
         }
+    }
+
+    ctx->depth--;
+    ctx->selected = 0;
+}
+
+static void interrupt(uint16_t *memory, uint16_t *registers, uint16_t **pc, uint8_t code, struct debugger_ctx *dbg)
+{
+    if (dbg)
+        shadow_push(dbg, FRAME_INT, *pc - memory - 1, *pc - memory, memory[0x100 + code], registers);
+
+    /* update PC */
+    *pc = memory + memory[0x100 + code];
+    /* save USP if in user mode */
+    if (memory[OS_PSR] & (1u << 15))
+    {
+        /* setup the supervisor stack */
+        memory[OS_USP] = registers[6];
+        registers[6] = memory[OS_SSP];
+        /* supervisor mode */
+        memory[OS_PSR] &= ~(1u << 15);
+    }
+}
+
+static int check_user_address(uint16_t psr, uint16_t address)
+{
+    /* check if in supervisor mode */
+    if (~psr & (1u << 15)) return 0;
+
+    /* the counters are the only device registers a user program may read */
+    if (address >= CNT_INSTLO && address <= CNT_CYCHI) return 0;
+
+    /* out of bounds for user mode */
+    return address < 0x3000 || address >= 0xfe00;
+}
+
+static void update_cond_code(int16_t value, uint16_t *memory)
+{
+    /* regenerate condition codes */
+    memory[OS_PSR] &= ~0b111;
+    if (value < 0) memory[OS_PSR] |= FLAG_N;
+    if (value == 0) memory[OS_PSR] |= FLAG_Z;
+    if (value > 0) memory[OS_PSR] |= FLAG_P;
+}
+
+
+/* growable text buffer, lets large dumps go out in a single write */
+struct text_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void tb_printf(struct text_buffer *tb, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (tb->size + len + 1 > tb->capacity)
+    {
+        tb->capacity = (tb->size + len + 1) * 2;
+        tb->data = realloc(tb->data, tb->capacity);
+    }
+
+    va_start(args, fmt);
+    vsnprintf(tb->data + tb->size, len + 1, fmt, args);
+    va_end(args);
+
+    tb->size += len;
+}
+
+static void tb_flush(struct text_buffer *tb, FILE *file)
+{
+    fwrite(tb->data, 1, tb->size, file);
+    fflush(file);
+    free(tb->data);
+    memset(tb, 0, sizeof(*tb));
+}
+
+/* s as a quoted json string */
+static void tb_json_string(struct text_buffer *tb, const char *s)
+{
+    tb_printf(tb, "\"");
+    for (const char *c = s; c && *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            tb_printf(tb, "\\%c", *c);
+        else if (*c == '\n')
+            tb_printf(tb, "\\n");
+        else if ((uint8_t)*c < 0x20 || (uint8_t)*c >= 0x7f)
+            tb_printf(tb, "\\u%04x", (uint8_t)*c);
         else
-            sscanf(tok, "%x", &off);
+            tb_printf(tb, "%c", *c);
+    }
+    tb_printf(tb, "\"");
+}
 
-        off &= 0xffff;
-        dump_instr(memory[off]);
+/* returns the first index in [start, end) where memory[i] == value or -1,
+   compares 4 words at a time using the "has zero halfword" trick */
+static long scan_word(const uint16_t *memory, long start, long end, uint16_t value)
+{
+    const uint64_t ones = 0x0001000100010001ull;
+    const uint64_t highs = 0x8000800080008000ull;
+    uint64_t pattern = value * ones;
+    long i = start;
 
-        memcpy(ctx->last, string, ARRAY_SIZE(string));
+    while (i < end && (i & 3))
+    {
+        if (memory[i] == value) return i;
+        i++;
+    }
+
+    for (; i + 4 <= end; i += 4)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, memory + i, sizeof(chunk));
+        chunk ^= pattern;
+        if ((chunk - ones) & ~chunk & highs) break;
+    }
+
+    for (; i < end; i++)
+    {
+        if (memory[i] == value) return i;
+    }
+
+    return -1;
+}
+
+/* returns the first index in [start, end) where a and b differ or -1 */
+static long scan_diff(const uint16_t *a, const uint16_t *b, long start, long end)
+{
+    long i = start;
+
+    while (i < end && (i & 3))
+    {
+        if (a[i] != b[i]) return i;
+        i++;
+    }
+
+    for (; i + 4 <= end; i += 4)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y) break;
+    }
+
+    for (; i < end; i++)
+    {
+        if (a[i] != b[i]) return i;
+    }
+
+    return -1;
+}
+
+/* parse "start-end" (inclusive, hex) into [start, end) */
+static int parse_range(const char *tok, long *start, long *end)
+{
+    unsigned s, e;
+
+    if (!tok)
+    {
+        *start = 0;
+        *end = 0x10000;
+        return 1;
+    }
+
+    if (sscanf(tok, "%x-%x", &s, &e) != 2 || s > e || e > 0xffff)
         return 0;
+
+    *start = s;
+    *end = e + 1;
+    return 1;
+}
+
+static void debug_examine(uint16_t *memory, unsigned addr, unsigned count, const char *fmt)
+{
+    struct text_buffer out = {0};
+    int per_line = 8;
+
+    if (!strcmp(fmt, "char")) per_line = 16;
+    if (!strcmp(fmt, "instr")) per_line = 1;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        uint16_t a = addr + i;
+        uint16_t v = memory[a];
+
+        if (i % per_line == 0)
+            tb_printf(&out, "%s%#06x:", i ? "\n" : "", a);
+
+        if (!strcmp(fmt, "dec"))
+            tb_printf(&out, " %6d", (int16_t)v);
+        else if (!strcmp(fmt, "char"))
+            tb_printf(&out, "%c", isprint(v & 0xff) && v < 0x100 ? v : '.');
+        else if (!strcmp(fmt, "instr"))
+        {
+            char text[0x40];
+            if (!disasm_instr(v, text, sizeof(text)))
+                snprintf(text, sizeof(text), ".FILL %#x", v);
+            tb_printf(&out, " %04x  %s", v, text);
+        }
+        else
+            tb_printf(&out, " %04x", v);
     }
 
-    /* decode immediate */
-    if (!strcmp(tok, "decode-i"))
+    tb_printf(&out, "\n");
+    tb_flush(&out, stdout);
+}
+
+/* find VALUE | "string" | pattern: pattern words are comma separated, ? matches anything */
+static void debug_find(uint16_t *memory, char *args)
+{
+    uint16_t pattern[0x100];
+    uint8_t wild[0x100] = {0};
+    int length = 0;
+    int anchor = -1;
+    char *range = NULL;
+    long start, end, hits = 0;
+    struct text_buffer out = {0};
+
+    while (isspace(*args)) args++;
+
+    if (*args == '"')
     {
-        tok = strtok(NULL, " ");
-        unsigned instr;
+        args++;
+        while (*args && *args != '"' && length < (int)ARRAY_SIZE(pattern))
+        {
+            char c = *args++;
+            if (c == '\\' && *args)
+            {
+                c = *args++;
+                if (c == 'n') c = '\n';
+                else if (c == 't') c = '\t';
+                else if (c == '0') c = '\0';
+            }
+            pattern[length++] = (uint8_t)c;
+        }
 
-        if (!tok)
+        if (*args != '"')
         {
             printf("Invalid parameter!\n");
-            return 0;
+            return;
+        }
+
+        range = strtok(args + 1, " ");
+    }
+    else
+    {
+        char *words = strtok(args, " ");
+        range = strtok(NULL, " ");
+
+        for (char *w = strtok(words, ","); w && length < (int)ARRAY_SIZE(pattern); w = strtok(NULL, ","))
+        {
+            unsigned v = 0;
+            if (w[0] == '?')
+                wild[length] = 1;
+            else if (sscanf(w, "%x", &v) != 1)
+            {
+                printf("Invalid parameter!\n");
+                return;
+            }
+            pattern[length++] = v;
+        }
+    }
+
+    for (int i = 0; i < length; i++)
+    {
+        if (!wild[i])
+        {
+            anchor = i;
+            break;
+        }
+    }
+
+    if (anchor < 0 || !parse_range(range, &start, &end))
+    {
+        printf("Invalid parameter!\n");
+        return;
+    }
+
+    for (long i = start + anchor; i < end; i++)
+    {
+        long base;
+        int j;
+
+        i = scan_word(memory, i, end, pattern[anchor]);
+        if (i < 0) break;
+
+        base = i - anchor;
+        if (base + length > end) break;
+
+        for (j = 0; j < length; j++)
+        {
+            if (!wild[j] && memory[base + j] != pattern[j]) break;
+        }
+
+        if (j == length)
+        {
+            if (hits < 0x100)
+                tb_printf(&out, "match at %#06lx\n", base);
+            hits++;
+        }
+    }
+
+    if (hits > 0x100)
+        tb_printf(&out, "... %ld more\n", hits - 0x100);
+    tb_printf(&out, "%ld match%s\n", hits, hits == 1 ? "" : "es");
+    tb_flush(&out, stdout);
+}
+
+static void debug_diff(struct debugger_ctx *ctx, uint16_t *memory, uint16_t *registers, const char *range)
+{
+    struct text_buffer out = {0};
+    long start, end, changes = 0;
+
+    if (!ctx->snapshot)
+    {
+        printf("no snapshot taken, use snap first!\n");
+        return;
+    }
+
+    if (!parse_range(range, &start, &end))
+    {
+        printf("Invalid parameter!\n");
+        return;
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        if (registers[i] != ctx->snapshot_registers[i])
+            tb_printf(&out, "R%d: %#x -> %#x\n", i, ctx->snapshot_registers[i], registers[i]);
+    }
+
+    for (long i = start; (i = scan_diff(ctx->snapshot, memory, i, end)) >= 0; i++)
+    {
+        tb_printf(&out, "memory[%#06lx]: %#x -> %#x\n", i, ctx->snapshot[i], memory[i]);
+        changes++;
+    }
+
+    tb_printf(&out, "%ld word%s changed\n", changes, changes == 1 ? "" : "s");
+    tb_flush(&out, stdout);
+}
+
+static const char *frame_kinds[] = { "JSR", "TRAP", "INT" };
+
+/* frame 0 is the innermost (currently executing) frame, frame depth is the
+   outermost. frames nested deeper than SHADOW_STACK_SIZE are only counted */
+static int frame_recorded(struct debugger_ctx *ctx, int n)
+{
+    int index = ctx->depth - n;
+    return n == 0 ? index <= SHADOW_STACK_SIZE : index < SHADOW_STACK_SIZE;
+}
+
+/* the PC of frame n is where the frame below it was called from */
+static uint16_t frame_pc(struct debugger_ctx *ctx, uint16_t pc, int n)
+{
+    return n > 0 ? ctx->frames[ctx->depth - n].call_pc : pc;
+}
+
+static void debug_frame(struct debugger_ctx *ctx, uint16_t *memory, uint16_t pc, int n)
+{
+    int index = ctx->depth - n;
+    struct shadow_frame *caller;
+
+    if (!frame_recorded(ctx, n))
+    {
+        printf("#%d <frame not recorded, call stack too deep>\n", n);
+        return;
+    }
+
+    pc = frame_pc(ctx, pc, n);
+
+    if (index == 0)
+    {
+        printf("#%d %#06x in main\n", n, pc);
+        dump_instr(memory[pc]);
+        return;
+    }
+
+    caller = &ctx->frames[index - 1];
+    printf("#%d %#06x in %#06x\n", n, pc, caller->target);
+    dump_instr(memory[pc]);
+    printf("entered by %s at %#06x, returns to %#06x, R6=%#x R7=%#x on entry\n",
+           frame_kinds[caller->kind], caller->call_pc, caller->ret_pc, caller->r6, caller->r7);
+
+    /* TRAP keeps PC and PSR on the supervisor stack */
+    if (caller->kind == FRAME_TRAP)
+        printf("saved PC=%#x PSR=%#x\n", memory[caller->r6], memory[(uint16_t)(caller->r6 + 1)]);
+}
+
+static void debug_backtrace(struct debugger_ctx *ctx, uint16_t pc)
+{
+    struct text_buffer out = {0};
+    int n = 0;
+
+    while (!frame_recorded(ctx, n)) n++;
+
+    if (n > 0)
+        tb_printf(&out, "   ... %d innermost frames not recorded ...\n", n);
+
+    for (; n <= ctx->depth; n++)
+    {
+        int index = ctx->depth - n;
+        const char *mark = n == ctx->selected ? "=>" : "  ";
+
+        if (index > 0)
+        {
+            struct shadow_frame *f = &ctx->frames[index - 1];
+            tb_printf(&out, "%s#%d %#06x in %#06x (%s from %#06x, R6=%#x R7=%#x)\n", mark,
+                      n, frame_pc(ctx, pc, n), f->target, frame_kinds[f->kind], f->call_pc, f->r6, f->r7);
+        }
+        else
+        {
+            tb_printf(&out, "%s#%d %#06x in main\n", mark, n, frame_pc(ctx, pc, n));
         }
+    }
+
+    tb_flush(&out, stdout);
+}
+
+static int debug_cmd(struct debugger_ctx *ctx, uint16_t *memory, uint16_t **pc,  uint16_t *registers)
+{
+    char string[0x100] = {0};
+    char *tok = NULL;
+    char *end = string;
+    uint16_t opcode = (**pc & 0xf000) >> 12;
+
+    printf(">>> ");
+
+    do
+    {
+        char c = getchar();
+        if (c == '\n' || c == '\0') break;
+        if (end - string >= ARRAY_SIZE(string)) break;
+        *end++ = c;
+    } while (1);
+
+    /* do backwards trim */
+    if (end > string)
+        while (isspace(*(end-1))) *--end = '\0';
+
+    if (strlen(ctx->last) > 0 && strlen(string) == 0)
+    {
+        memcpy(string, ctx->last, ARRAY_SIZE(string));
+    }
+
+    tok = strtok(string, " ");
+
+    if (!tok)
+    {
+        printf("Invalid parameter!\n");
+        return 0;
+    }
+
+    if (!strcmp(tok, "s") || !strcmp(tok, "step"))
+    {
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        return 1;
+    }
+
+    if (!strcmp(tok, "us") || !strcmp(tok, "ustep"))
+    {
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        ctx->ustep = 1;
+        return 1;
+    }
+
+    if (!strcmp(tok, "ustate"))
+    {
+        micro_dump(ctx->micro);
+        return 0;
+    }
+
+    if (!strcmp(tok, "c") || !strcmp(tok, "continue"))
+    {
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        ctx->cont = 1;
+        return 1;
+    }
+
+    if (!strcmp(tok, "n") || !strcmp(tok, "next"))
+    {
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        /* JSR, TRAP: run until the call's frame is popped again */
+        if (opcode == 0b0100 || opcode == 0b1111)
+            ctx->finish_depth = ctx->depth;
+        return 1;
+    }
+
+    if (!strcmp(tok, "finish"))
+    {
+        if (ctx->depth - ctx->selected <= 0)
+        {
+            printf("\"finish\" not meaningful in the outermost frame\n");
+            return 0;
+        }
+
+        /* breakpoints are not checked until the frame returns */
+        ctx->finish_depth = ctx->depth - ctx->selected - 1;
+        return 1;
+    }
+
+    if (!strcmp(tok, "bt") || !strcmp(tok, "backtrace"))
+    {
+        debug_backtrace(ctx, *pc - memory);
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        return 0;
+    }
+
+    if (!strcmp(tok, "frame") || !strcmp(tok, "up") || !strcmp(tok, "down"))
+    {
+        int n = ctx->selected;
+
+        if (!strcmp(tok, "up"))
+            n++;
+        else if (!strcmp(tok, "down"))
+            n--;
+        else if ((tok = strtok(NULL, " ")))
+            sscanf(tok, "%d", &n);
+
+        if (n < 0 || n > ctx->depth)
+        {
+            printf("No frame %d!\n", n);
+            return 0;
+        }
+
+        ctx->selected = n;
+        debug_frame(ctx, memory, *pc - memory, n);
+        return 0;
+    }
+
+    if (!strcmp(tok, "q") || !strcmp(tok, "quit") || !strcmp(tok, "exit"))
+    {
+        exit(0);
+    }
+
+    if (!strcmp(tok, "clear"))
+    {
+        printf("\e[1;1H\e[2J");
+
+        return 0;
+    }
+
+    if (!strcmp(tok, "2007/12/11") || !strcmp(tok, "0x7D7"))
+    {
+        printf("https://github.com/Etaash-mathamsetty/\n");
+
+        return 0;
+    }
+
+    if (!strcmp(tok, "ECE120"))
+    {
+        printf("Stay tuned for Behya announcement!\n");
+
+        return 0;
+    }
+
+
+    if (!strcmp(tok, "h") || !strcmp(tok, "help"))
+    {
+        tok = strtok(NULL, " ");
+
+        if (tok && !strcmp(tok, "break"))
+        {
+            printf("Seems like you don't know how to use the break command :(\n");
+            printf("Here's some information on how to use it :D\n\n");
+
+            printf("Note: One breakpoint is automatically placed by the emulator at 0x3000!\n\n");
+
+            printf("add <address>: Adds a breakpoint for some address\n");
+            printf("list: Lists all breakpoints\n");
+            printf("remove <address>: Removes a breakpoint for some address\n");
+            printf("pop: Removes the previously added breakpoint\n");
+            printf("clear: Removes all breakpoints\n");
+        } else if (tok && !strcmp(tok, "reg")) {
+            printf("Seems like you don't know how to use the reg command :(\n");
+            printf("Here's some information on how to use it :D\n\n");
+
+            printf("set R# <value>: Sets a register to a value\n");
+            printf("list: Lists all registers\n");
+        } else {
+            printf("Seems like you don't know how to use the debugger :(\n");
+            printf("Here's some information on how to use it :D\n\n");
+
+            printf("help: Prints this menu\n");
+            printf("step: Steps forward one instruction\n");
+            printf("ustep: Steps forward one state of the microsequencer\n");
+            printf("ustate: Shows MAR, MDR, IR, BEN, the bus and the last state's control signals\n");
+            printf("continue: Continues execution until breakpoint\n");
+            printf("next: Continues until a the return of a subroutine/trap\n");
+            printf("finish: Runs until the selected frame returns, ignoring breakpoints\n");
+            printf("bt: Shows the call stack\n");
+            printf("frame <n>, up, down: Select and show a frame of the call stack\n");
+            printf("break ...: Family of breakpoint management commmands\n");
+            printf("reg ...: Family of register management commands\n");
+            printf("quit: Quits the emulator\n");
+            printf("read <address>: Read a memory address (or range of addresses)\n");
+            printf("write <address>: Write memory to an address\n");
+            printf("decode <address>: Translate data at an address into an instruction\n");
+            printf("decode-i <instr>: Translate parameter into an instruction\n");
+            printf("goto <address>: Set PC to some address\n \tNOTE: PSR and stack pointers will not be switched unless RTI is executed!\n");
+            printf("x <address> [count] [hex|dec|char|instr]: Examine a block of memory\n");
+            printf("find <value>|\"string\"|<w1,?,w3> [start-end]: Search memory, ? matches any word\n");
+            printf("snap: Save memory and registers for diff\n");
+            printf("diff [start-end]: Show what changed since the last snap\n");
+        }
+
+        return 0;
+    }
+
+    if (!strcmp(tok, "read"))
+    {
+        tok = strtok(NULL, " ");
+        unsigned off;
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        sscanf(tok, "%x\n", &off);
+
+        off &= 0xffff;
+        printf("memory[%#x]=%#x\n", off, memory[off]);
+
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        return 0;
+    }
+
+    if (!strcmp(tok, "goto"))
+    {
+        tok = strtok(NULL, " ");
+        unsigned addr;
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        sscanf(tok, "%x", &addr);
+
+        *pc = memory + addr - 1;
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        return 1;
+    }
+
+    if (!strcmp(tok, "decode"))
+    {
+        tok = strtok(NULL, " ");
+        unsigned off;
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        if (!strcmp(tok, "PC"))
+        {
+            off = *pc - memory;
+        }
+        else
+            sscanf(tok, "%x", &off);
+
+        off &= 0xffff;
+        dump_instr(memory[off]);
+
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        return 0;
+    }
+
+    /* decode immediate */
+    if (!strcmp(tok, "decode-i"))
+    {
+        tok = strtok(NULL, " ");
+        unsigned instr;
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        sscanf(tok, "%x", &instr);
+
+        instr &= 0xffff;
+        dump_instr(instr);
+        return 0;
+    }
+
+    if (!strcmp(tok, "write"))
+    {
+        tok = strtok(NULL, " ");
+        unsigned addr, val;
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        sscanf(tok, "%x", &addr);
+
+        tok = strtok(NULL, " ");
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        sscanf(tok, "%x", &val);
+
+        addr &= 0xffff;
+        val &= 0xffff;
+
+        memory[addr] = val;
+        printf("memory[%#x]=%#x\n", addr, val);
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+
+        return 0;
+    }
+
+    if (!strcmp(tok, "reg"))
+    {
+        tok = strtok(NULL, " ");
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        if (!strcmp(tok, "list") || !strcmp(tok, "show"))
+        {
+            dump_registers(registers, memory[OS_PSR], *pc - memory, **pc);
+            memcpy(ctx->last, string, ARRAY_SIZE(string));
+            return 0;
+        }
+        else if (!strcmp(tok, "clear"))
+        {
+            memset(registers, 0, 8 * sizeof(uint16_t));
+            memcpy(ctx->last, string, ARRAY_SIZE(string));
+            return 0;
+        }
+        else if (!strcmp(tok, "set"))
+        {
+            tok = strtok(NULL, " ");
+            unsigned num;
+            unsigned value;
+
+            if (!tok)
+            {
+                printf("Invalid parameter!\n");
+                return 0;
+            }
+
+            sscanf(tok, "R%u", &num);
+
+            tok = strtok(NULL, " ");
+
+            if (!tok)
+            {
+                printf("Invalid parameter!\n");
+                return 0;
+            }
+
+            sscanf(tok, "%x", &value);
+
+            registers[num] = value;
+
+            memcpy(ctx->last, string, ARRAY_SIZE(string));
+            return 0;
+        }
+
+        printf("Invalid parameter!\n");
+        return 0;
+    }
+
+    if (!strcmp(tok, "x"))
+    {
+        unsigned addr, count = 8;
+        const char *fmt = "hex";
+
+        tok = strtok(NULL, " ");
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        if (!strcmp(tok, "PC"))
+            addr = *pc - memory;
+        else if (sscanf(tok, "%x", &addr) != 1)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        if ((tok = strtok(NULL, " ")))
+        {
+            if (sscanf(tok, "%u", &count) != 1)
+            {
+                printf("Invalid parameter!\n");
+                return 0;
+            }
+            if ((tok = strtok(NULL, " ")))
+                fmt = tok;
+        }
+
+        if (strcmp(fmt, "hex") && strcmp(fmt, "dec") && strcmp(fmt, "char") && strcmp(fmt, "instr"))
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        addr &= 0xffff;
+        count = MIN(count, 0x10000);
+        debug_examine(memory, addr, count, fmt);
+
+        /* pressing enter again continues where this dump stopped */
+        snprintf(ctx->last, ARRAY_SIZE(ctx->last), "x %x %u %s", (addr + count) & 0xffff, count, fmt);
+        return 0;
+    }
+
+    if (!strcmp(tok, "find"))
+    {
+        tok = strtok(NULL, "");
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        debug_find(memory, tok);
+        return 0;
+    }
+
+    if (!strcmp(tok, "snap"))
+    {
+        if (!ctx->snapshot)
+            ctx->snapshot = malloc(0x10000 * sizeof(uint16_t));
+
+        memcpy(ctx->snapshot, memory, 0x10000 * sizeof(uint16_t));
+        memcpy(ctx->snapshot_registers, registers, sizeof(ctx->snapshot_registers));
+        printf("snapshot saved\n");
+        return 0;
+    }
+
+    if (!strcmp(tok, "diff"))
+    {
+        debug_diff(ctx, memory, registers, strtok(NULL, " "));
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        return 0;
+    }
+
+    if (!strcmp(tok, "break"))
+    {
+        tok = strtok(NULL, " ");
+        unsigned addr;
+
+        if (!tok)
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        if (!strcmp(tok, "add") || !strcmp(tok, "push"))
+        {
+            tok = strtok(NULL, " ");
+
+            if (!tok)
+            {
+                printf("Invalid parameter!\n");
+                return 0;
+            }
+
+            sscanf(tok, "%x\n", &addr);
+
+            addr &= 0xffff;
+
+            for (int i = 0; i < ctx->breakpoint_size; i++)
+            {
+                if (addr == ctx->breakpoints[i])
+                {
+                    printf("breakpoint already set at %#x\n", addr);
+                    memcpy(ctx->last, string, ARRAY_SIZE(string));
+                    return 0;
+                }
+            }
+
+            ctx->breakpoints[ctx->breakpoint_size++] = addr;
+
+            printf("breakpoint set at %#x\n", addr);
+        }
+        else if (!strcmp(tok, "rm") || !strcmp(tok, "remove"))
+        {
+            tok = strtok(NULL, " ");
+            unsigned addr;
+
+            sscanf(tok, "%x\n", &addr);
+
+            addr &= 0xffff;
+
+            for (int i = 0; i < ctx->breakpoint_size; i++)
+            {
+                if (addr == ctx->breakpoints[i])
+                {
+                    memmove(ctx->breakpoints + i, ctx->breakpoints + i + 1, (ctx->breakpoint_size - i - 1) * sizeof(uint16_t));
+                    ctx->breakpoint_size--;
+                    printf("breakpoint removed at %#x\n", addr);
+                    memcpy(ctx->last, string, ARRAY_SIZE(string));
+                    return 0;
+                }
+            }
+
+            printf("breakpoint not found!\n");
+        }
+        else if (!strcmp(tok, "pop"))
+        {
+            unsigned addr;
+
+            if (ctx->breakpoint_size > 0)
+            {
+                addr = ctx->breakpoints[--ctx->breakpoint_size];
+                printf("breakpoint removed at %#x\n", addr);
+            } else {
+                printf("no breakpoints available to remove!\n");
+            }
+        }
+        else if (!strcmp(tok, "list") || !strcmp(tok, "show"))
+        {
+            for (int i = 0; i < ctx->breakpoint_size; i++)
+            {
+                printf("breakpoint[%d] = %#x\n", i, ctx->breakpoints[i]);
+            }
+        }
+        else if (!strcmp(tok, "clear"))
+        {
+            ctx->breakpoint_size = 0;
+        }
+        else
+        {
+            printf("Invalid parameter!\n");
+            return 0;
+        }
+
+        memcpy(ctx->last, string, ARRAY_SIZE(string));
+
+        return 0;
+    }
+
+    printf("invalid command: %s\n", string);
+    return 0;
+}
+
+//#define LC3_EXTENDED
+
+#ifdef LC3_EXTENDED
+
+/* LC-3e: parse 2 word extended instructions */
+static void parse_extended(uint16_t instr1, uint16_t instr2, uint16_t *memory, uint16_t *registers)
+{
+    uint16_t op = ((instr1 & 0x3) << 4) | (instr2 & (0xf << 12)) >> 12;
+    uint16_t dst = (instr2 & (0b111 << 9)) >> 9;
+    uint16_t sr1 = (instr2 & (0b111 << 6)) >> 6;
+    uint16_t sr2 = instr2 & 0b111;
+    int16_t imm5 = sext5(instr2 & 0b11111);
+
+    switch (op)
+    {
+        case 0b000000: /* MUL (signed) */
+        {
+            if (instr2 & (1 << 5))
+            {
+                registers[dst] = registers[sr1] * imm5;
+            } else {
+                registers[dst] = (int16_t)registers[sr1] * (int16_t)registers[sr2];
+            }
+
+            break;
+        }
+        case 0b000001: /* DIV (signed) */
+        {
+            /* divide by 0 -> divide by 1 to avoid creating new exceptions */
+            if (instr2 & (1 << 5))
+            {
+                if (imm5 == 0) imm5 = 1;
+                registers[dst] = registers[sr1] / imm5;
+            } else {
+                int16_t v = registers[sr2];
+                if (v == 0) v = 1;
+                registers[dst] = (int16_t)registers[sr1] / v;
+            }
+
+            break;
+        }
+        case 0b000010: /* RSHIFT +/- imm6 */
+        {
+            break;
+        }
+        case 0b000100: /* XCHG (exchange) */
+        {
+
+            break;
+        }
+        case 0b0010000: /* OR */
+        {
+
+            break;
+        }
+        case 0b0010001: /* XOR */
+        {
+
+            break;
+        }
+        default:
+        {
+            /* TODO: throw invalid instruction exception */
+            break;
+        }
+    }
+}
+
+#endif
+
+/* run options shared by the command line and test manifests */
+struct run_options {
+    uint16_t dump_addr[0x100];
+    int dump_size;
+    uint16_t memory_set[2][0x100];
+    int memory_size;
+    uint8_t input_buffer[0x100];
+    int input_size;
+    int silent;
+    int randomize;
+    int debug;
+    /* maximum number of instructions to execute, 0 for no limit */
+    uint64_t limit;
+    /* --limit=auto: set limit from the static worst case once the program is loaded */
+    int limit_auto;
+    const char *shm_name;
+    int dma;
+    const char *disk_path;
+    /* TIMING_* model and cycles per memory access, MEM_LATENCY_DEFAULT unless has_mem_latency */
+    int timing;
+    int mem_latency;
+    int has_mem_latency;
+    int stats;
+    /* run on the microsequencer, checked against the ISA engine */
+    int micro;
+    const char *vcd_path;
+    const char *cache_spec;
+    const char *pipeline_spec;
+    int branch_stats;
+    int lint;
+    int advise;
+    /* print the loaded files, refuse to run when they overlap */
+    int load_map;
+    int strict_load;
+    /* --randomize draws from this seed instead of the time */
+    unsigned seed;
+    int has_seed;
+    /* print the result as json, reuse stored results from memo_dir */
+    int json;
+    const char *memo_dir;
+    uint64_t memo_size;
+    double memo_verify;
+};
+
+/* timing models for --timing */
+#define TIMING_NONE 0
+#define TIMING_FSM 1
+
+/* wait cycles of a memory state, the bound keeps the FSM state costs in 16 bits */
+#define MEM_LATENCY_DEFAULT 5
+#define MEM_LATENCY_MAX 1000
+
+static int run_mem_latency(const struct run_options *opts)
+{
+    return opts->has_mem_latency ? opts->mem_latency : MEM_LATENCY_DEFAULT;
+}
+
+/* the first option in opts that only a plain run honours, NULL if none.
+   runners that start many machines reject these instead of dropping them */
+static const char *run_option_unsupported(const struct run_options *opts, int batch)
+{
+    if (opts->disk_path) return "--disk";
+    if (opts->shm_name) return "--shm";
+    if (opts->debug) return "--debug";
+    if (opts->micro) return "--micro";
+    if (opts->vcd_path) return "--vcd";
+    if (opts->cache_spec) return "--cache";
+    if (opts->pipeline_spec) return "--pipeline";
+    if (opts->branch_stats) return "--branch-stats";
+    if (opts->stats) return "--stats";
+    if (opts->lint) return "--lint";
+    /* batch attaches the advice to each job's result */
+    if (opts->advise && !batch) return "--advise";
+    if (opts->load_map || opts->strict_load) return "--load-map";
+    if (opts->memo_dir) return "--memo";
+    if (opts->json) return "--json";
+    return NULL;
+}
+
+/* parse a run option (without the leading --), returns 0 if arg is not one */
+static int parse_run_option(struct run_options *opts, char *arg)
+{
+    if (strstr(arg, "dump=") == arg)
+    {
+        char *tok;
+        unsigned addr;
+        arg += 5;
+        tok = strtok(arg, ",");
+
+        do
+        {
+            sscanf(tok, "%x", &addr);
+
+            opts->dump_addr[opts->dump_size] = addr & 0xffff;
+            opts->dump_size++;
+            opts->dump_size %= ARRAY_SIZE(opts->dump_addr);
+
+        } while ((tok = strtok(NULL, ",")));
+    }
+    else if (!strcmp(arg, "debug"))
+    {
+        opts->debug = 1;
+    }
+    else if (!strcmp(arg, "randomize"))
+    {
+        opts->randomize = 1;
+    }
+    else if (!strcmp(arg, "silent"))
+    {
+        opts->silent = 1;
+    }
+    else if (!strcmp(arg, "dma"))
+    {
+        opts->dma = 1;
+    }
+    else if (!strcmp(arg, "stats"))
+    {
+        opts->stats = 1;
+    }
+    else if (!strcmp(arg, "micro"))
+    {
+        opts->micro = 1;
+    }
+    else if (strstr(arg, "vcd=") == arg)
+    {
+        opts->vcd_path = arg + 4;
+    }
+    else if (strstr(arg, "cache=") == arg)
+    {
+        opts->cache_spec = arg + 6;
+    }
+    else if (!strcmp(arg, "lint"))
+    {
+        opts->lint = 1;
+    }
+    else if (!strcmp(arg, "advise"))
+    {
+        opts->advise = 1;
+    }
+    else if (!strcmp(arg, "load-map"))
+    {
+        opts->load_map = 1;
+    }
+    else if (!strcmp(arg, "strict-load"))
+    {
+        opts->strict_load = 1;
+    }
+    else if (!strcmp(arg, "branch-stats"))
+    {
+        opts->branch_stats = 1;
+    }
+    else if (strstr(arg, "seed=") == arg)
+    {
+        opts->seed = strtoul(arg + 5, NULL, 0);
+        opts->has_seed = 1;
+    }
+    else if (!strcmp(arg, "json"))
+    {
+        opts->json = 1;
+    }
+    else if (!strcmp(arg, "memo") || strstr(arg, "memo=") == arg)
+    {
+        opts->memo_dir = arg[4] ? arg + 5 : "";
+        opts->json = 1;
+    }
+    else if (strstr(arg, "memo-size=") == arg)
+    {
+        opts->memo_size = strtoull(arg + 10, NULL, 0) << 20;
+    }
+    else if (strstr(arg, "memo-verify=") == arg)
+    {
+        opts->memo_verify = atof(arg + 12);
+    }
+    else if (!strcmp(arg, "pipeline") || strstr(arg, "pipeline=") == arg)
+    {
+        opts->pipeline_spec = arg[8] ? arg + 9 : "";
+    }
+    else if (strstr(arg, "timing=") == arg)
+    {
+        char *tok = strtok(arg + 7, ",");
+
+        do
+        {
+            if (!strcmp(tok, "fsm"))
+                opts->timing = TIMING_FSM;
+            else if (!strcmp(tok, "none"))
+                opts->timing = TIMING_NONE;
+            else if (strstr(tok, "mem=") == tok)
+            {
+                int mem = atoi(tok + 4);
+
+                if (mem < 0 || mem > MEM_LATENCY_MAX)
+                {
+                    fprintf(stderr, "--timing mem=%d is outside 0-%d\n", mem, MEM_LATENCY_MAX);
+                    return 0;
+                }
+                opts->mem_latency = mem;
+                opts->has_mem_latency = 1;
+            }
+            else
+                return 0;
+        } while ((tok = strtok(NULL, ",")));
+    }
+    else if (strstr(arg, "shm=") == arg)
+    {
+        opts->shm_name = arg + 4;
+    }
+    else if (strstr(arg, "disk=") == arg)
+    {
+        opts->disk_path = arg + 5;
+    }
+    else if (strstr(arg, "limit=") == arg)
+    {
+        if (!strcmp(arg + 6, "auto"))
+            opts->limit_auto = 1;
+        else
+            opts->limit = strtoull(arg + 6, NULL, 0);
+    }
+    else if (strstr(arg, "input=") == arg)
+    {
+        arg += 6;
+        int size = strlen(arg);
+        opts->input_size = MIN(size * sizeof(uint8_t), sizeof(opts->input_buffer))+1;
+        memcpy(opts->input_buffer, arg, opts->input_size);
+        opts->input_size /= sizeof(uint8_t); /* convert to length in characters */
+    }
+    else if (strstr(arg, "memory=") == arg)
+    {
+        char *tok;
+        unsigned addr;
+        unsigned i = 0;
+        arg += 7;
+        tok = strtok(arg, ",");
+
+        do
+        {
+            sscanf(tok, "%x", &addr);
+
+            opts->memory_set[i][opts->memory_size] = addr & 0xffff;
+            if (i)
+            {
+                opts->memory_size++;
+                opts->memory_size %= ARRAY_SIZE(opts->memory_set[0]);
+            }
+            i = (i + 1) % 2;
+
+        } while ((tok = strtok(NULL, ",")));
+    }
+    else
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* LC-3 can only address [0, 0xffff] but we have extra few values for ssp, usp */
+#define LC3_MEMORY_WORDS (0x10000 + 2)
+
+/* what the traced engine saw while executing one instruction */
+struct lc3_trace {
+    uint16_t pc;
+    uint16_t instr;
+    /* data accesses, at most TRAP's two pushes and vector read */
+    uint16_t addr[3];
+    uint8_t write[3];
+    uint8_t count;
+    /* BR, JMP, JSR or TRAP changed the PC */
+    uint8_t taken;
+};
+
+/* devices that can schedule events and raise interrupts */
+#define DEV_DMA 0
+#define DEV_DISK 1
+#define LC3_DEVICES 2
+
+struct lc3_machine {
+    uint16_t *memory;
+    uint16_t registers[8];
+    uint16_t *pc;
+    /* everything written to DDR, always NUL terminated */
+    char *output;
+    int output_size;
+    int output_len;
+    const uint8_t *input;
+    int input_size;
+    int input_index;
+    /* retired instructions */
+    uint64_t instret;
+    /* modeled cycles, cost[opcode] is added for every instruction */
+    uint64_t cycles;
+    uint16_t cost[16];
+    /* extra cycles for a taken branch and for entering an interrupt */
+    uint16_t cost_taken;
+    uint16_t cost_int;
+    int silent;
+    struct debugger_ctx *dbg;
+    /* device event queue, one slot per device, UINT64_MAX when idle */
+    uint64_t events[LC3_DEVICES];
+    /* earliest pending event or interrupt, checked before every fetch */
+    uint64_t next_event;
+    /* devices with an interrupt waiting for the priority to drop */
+    unsigned irq_pending;
+    int dma;
+    /* transfer latched when DMA_CR was started */
+    uint16_t dma_src;
+    uint16_t dma_dst;
+    uint16_t dma_len;
+    /* host file mapped by lc3_attach_disk, big endian words. a writable
+       file stays open so a write to a short last sector can extend it */
+    uint8_t *disk;
+    size_t disk_size;
+    int disk_writable;
+    int disk_fd;
+    /* command latched when DSK_CR was written */
+    uint16_t disk_sector;
+    uint16_t disk_buf;
+    uint16_t disk_cmd;
+    /* counter values at the last CNT_CR reset */
+    uint64_t cnt_instret_base;
+    uint64_t cnt_cycles_base;
+    /* what the four counter registers return, refreshed when a low half is read */
+    uint16_t cnt_latch[4];
+    int cnt_frozen;
+    /* filled by lc3_step_traced only */
+    struct lc3_trace trace;
+};
+
+static void lc3_init(struct lc3_machine *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->memory = calloc(LC3_MEMORY_WORDS, sizeof(uint16_t));
+    m->output_size = 0x100;
+    m->output = calloc(m->output_size, sizeof(char));
+    m->pc = m->memory;
+    for (int i = 0; i < LC3_DEVICES; i++)
+        m->events[i] = UINT64_MAX;
+    m->next_event = UINT64_MAX;
+    for (int i = 0; i < 16; i++)
+        m->cost[i] = 1;
+}
+
+static void lc3_free(struct lc3_machine *m)
+{
+    free(m->memory);
+    free(m->output);
+    if (m->disk)
+        munmap(m->disk, m->disk_size);
+    if (m->disk && m->disk_writable)
+        close(m->disk_fd);
+}
+
+/* map a host file as the block device, returns 0 on failure */
+static int lc3_attach_disk(struct lc3_machine *m, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDWR);
+
+    m->disk_writable = fd >= 0;
+    if (fd < 0 && (fd = open(path, O_RDONLY)) < 0)
+        return 0;
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    /* the file is left as it is until a write needs the rest of its last sector */
+    m->disk_size = st.st_size;
+    m->disk = mmap(NULL, m->disk_size, PROT_READ | (m->disk_writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+
+    if (m->disk_writable)
+        m->disk_fd = fd;
+    else
+        close(fd);
+
+    if (m->disk == MAP_FAILED)
+    {
+        if (m->disk_writable) close(fd);
+        m->disk = NULL;
+        return 0;
+    }
+
+    m->memory[DSK_SIZE] = MIN((m->disk_size + 511) / 512, 0xffff);
+    return 1;
+}
+
+/* restore a machine to a saved memory image, with fresh registers and console */
+static void lc3_reset(struct lc3_machine *m, const uint16_t *image, uint16_t pc)
+{
+    memcpy(m->memory, image, LC3_MEMORY_WORDS * sizeof(uint16_t));
+    memset(m->registers, 0, sizeof(m->registers));
+    m->pc = m->memory + pc;
+    m->output_len = 0;
+    m->output[0] = 0;
+    m->input_index = 0;
+    m->instret = 0;
+    m->cycles = 0;
+    for (int i = 0; i < LC3_DEVICES; i++)
+        m->events[i] = UINT64_MAX;
+    m->next_event = UINT64_MAX;
+    m->irq_pending = 0;
+    m->cnt_instret_base = 0;
+    m->cnt_cycles_base = 0;
+    m->cnt_frozen = 0;
+}
+
+/* fill the per-opcode cycle table, one cycle per instruction without a model */
+static void lc3_set_timing(struct lc3_machine *m, int model, int mem)
+{
+    /* states of the Patt & Patel control FSM, every memory state waits mem cycles for R */
+    const uint16_t fetch = 3 + mem; /* 18, 33, 35 */
+    const uint16_t fsm[16] = {
+        [0b0000] = fetch + 1, /* BR: 0 (+22 when taken) */
+        [0b0001] = fetch + 1, /* ADD: 1 */
+        [0b0010] = fetch + 2 + mem, /* LD: 2, 25, 27 */
+        [0b0011] = fetch + 2 + mem, /* ST: 3, 23, 16 */
+        [0b0100] = fetch + 2, /* JSR: 4, 21 or 20 */
+        [0b0101] = fetch + 1, /* AND: 5 */
+        [0b0110] = fetch + 2 + mem, /* LDR: 6, 25, 27 */
+        [0b0111] = fetch + 2 + mem, /* STR: 7, 23, 16 */
+        [0b1000] = fetch + 5 + 2 * mem, /* RTI: 8, 36, 38, 39, 40, 42, 34 */
+        [0b1001] = fetch + 1, /* NOT: 9 */
+        [0b1010] = fetch + 3 + 2 * mem, /* LDI: 10, 24, 26, 25, 27 */
+        [0b1011] = fetch + 3 + 2 * mem, /* STI: 11, 29, 31, 23, 16 */
+        [0b1100] = fetch + 1, /* JMP: 12 */
+        [0b1101] = fetch + 3 + mem, /* reserved: 13, 45, 53, 55 */
+        [0b1110] = fetch + 1, /* LEA: 14 */
+        [0b1111] = fetch + 6 + 3 * mem, /* TRAP: 15, 47, 37, 41, 46, 52, 54, 53, 55 */
+    };
+
+    for (int i = 0; i < 16; i++)
+        m->cost[i] = model == TIMING_FSM ? fsm[i] : 1;
+    m->cost_taken = model == TIMING_FSM;
+    /* 49 and the same push sequence as TRAP */
+    m->cost_int = model == TIMING_FSM ? 7 + 3 * mem : 0;
+}
+
+/* point the OS at the user program and set up devices, leaves PC at OS_START */
+static void lc3_boot(struct lc3_machine *m, uint16_t user_pc, const struct run_options *opts)
+{
+    uint16_t *memory = m->memory;
+
+    /* overwrite the OS memory to use the start address of the given program */
+    /* FIXME: is this correct? */
+    memory[USER_PC] = user_pc;
+    m->pc = memory + OS_START;
+
+    /* enable the clock */
+    memory[OS_MCR] |= (1u << 15);
+    /* we are ready for some data */
+    memory[OS_DSR] |= (1u << 15);
+    /* reset ddr */
+    memory[OS_DDR] = 0;
+
+    /* initialize specified memory locations */
+    for (int i = 0; i < opts->memory_size; i++)
+    {
+        memory[opts->memory_set[0][i]] = opts->memory_set[1][i];
+    }
+
+    m->input = opts->input_buffer;
+    m->input_size = opts->input_size;
+    m->silent = opts->silent;
+    m->dma = opts->dma;
+    lc3_set_timing(m, opts->timing, run_mem_latency(opts));
+}
+
+static void lc3_putc(struct lc3_machine *m, char c)
+{
+    if (m->output_len >= m->output_size - 1)
+    {
+        m->output_size += 0x100;
+        m->output = realloc(m->output, m->output_size);
+    }
+
+    m->output[m->output_len++] = c;
+    m->output[m->output_len] = 0;
+}
+
+static inline int lc3_running(const struct lc3_machine *m)
+{
+    return m->memory[OS_MCR] & (1u << 15);
+}
+
+/* DMA_CR bits, START reads back as busy */
+#define DMA_START (1u << 0)
+#define DMA_ERROR (1u << 13)
+#define DMA_IE (1u << 14)
+#define DMA_DONE (1u << 15)
+/* modeled transfer time in instructions: setup plus 4 words per instruction */
+#define DMA_SETUP 16
+#define DMA_WORDS_PER_INSTR 4
+
+static inline uint64_t lc3_cycles(const struct lc3_machine *m)
+{
+    return m->cycles;
+}
+
+/* CNT_CR bits */
+#define CNT_RESET (1u << 0)
+#define CNT_FREEZE (1u << 1)
+
+/* DSK_CR bits, the command field reads back as busy */
+#define DSK_READ 1u
+#define DSK_WRITE 2u
+#define DSK_CMD 0b11u
+#define DSK_ERROR (1u << 13)
+#define DSK_IE (1u << 14)
+#define DSK_DONE (1u << 15)
+/* modeled access time in instructions per sector */
+#define DSK_LATENCY 200
+
+/* interrupt vector and priority of each device */
+static const uint8_t device_vector[LC3_DEVICES] = { 0x81, 0x82 };
+static const uint8_t device_priority[LC3_DEVICES] = { 4, 4 };
+
+static void lc3_schedule(struct lc3_machine *m, int device, uint64_t when)
+{
+    m->events[device] = when;
+    if (when < m->next_event) m->next_event = when;
+}
+
+static void lc3_raise(struct lc3_machine *m, int device)
+{
+    m->irq_pending |= 1u << device;
+    m->next_event = m->instret;
+}
+
+/* a device interrupt is still asserted while its ready and enable bits are set */
+static int device_asserted(const struct lc3_machine *m, int device)
+{
+    switch (device)
+    {
+        case DEV_DMA:
+            return (m->memory[DMA_CR] & (DMA_DONE | DMA_IE)) == (DMA_DONE | DMA_IE);
+        case DEV_DISK:
+            return (m->memory[DSK_CR] & (DSK_DONE | DSK_IE)) == (DSK_DONE | DSK_IE);
+    }
+    return 0;
+}
+
+/* enter an interrupt service routine, same stack frame as TRAP so RTI returns */
+static void lc3_take_interrupt(struct lc3_machine *m, int device)
+{
+    uint16_t *memory = m->memory;
+    uint16_t *registers = m->registers;
+    uint16_t psr = memory[OS_PSR];
+    uint16_t handler = memory[0x100 + device_vector[device]];
+
+    if (psr & (1u << 15))
+    {
+        memory[OS_USP] = registers[6];
+        registers[6] = memory[OS_SSP];
+    }
+
+    registers[6]--; /* push */
+    memory[registers[6]] = psr;
+    registers[6]--; /* push */
+    memory[registers[6]] = m->pc - memory;
+
+    if (m->dbg)
+        shadow_push(m->dbg, FRAME_INT, m->pc - memory, m->pc - memory, handler, registers);
+
+    /* supervisor mode at the device priority */
+    memory[OS_PSR] = (psr & ~((1u << 15) | (0b111 << 8))) | (device_priority[device] << 8);
+    m->pc = memory + handler;
+    m->cycles += m->cost_int;
+}
+
+static int device_range_ok(uint16_t start, uint16_t len, int user)
+{
+    /* never into device registers, and user transfers stay in user memory */
+    if ((uint32_t)start + len > 0xfe00) return 0;
+    return !user || start >= 0x3000;
+}
+
+/* a write to DMA_CR, starts a transfer when START is set and the channel is idle */
+static void dma_control(struct lc3_machine *m)
+{
+    uint16_t *memory = m->memory;
+    uint16_t cr = memory[DMA_CR];
+    int user = memory[OS_PSR] >> 15;
+
+    if (m->events[DEV_DMA] != UINT64_MAX)
+    {
+        /* busy, only the interrupt enable can change */
+        memory[DMA_CR] = (cr & DMA_IE) | DMA_START;
+        return;
+    }
+
+    if (!(cr & DMA_START)) return;
+
+    m->dma_src = memory[DMA_SRC];
+    m->dma_dst = memory[DMA_DST];
+    m->dma_len = memory[DMA_LEN];
+
+    if (!device_range_ok(m->dma_src, m->dma_len, user) || !device_range_ok(m->dma_dst, m->dma_len, user))
+    {
+        memory[DMA_CR] = (cr & DMA_IE) | DMA_DONE | DMA_ERROR;
+        if (cr & DMA_IE) lc3_raise(m, DEV_DMA);
+        return;
+    }
+
+    memory[DMA_CR] = (cr & DMA_IE) | DMA_START;
+    lc3_schedule(m, DEV_DMA, m->instret + DMA_SETUP + m->dma_len / DMA_WORDS_PER_INSTR);
+}
+
+static void dma_complete(struct lc3_machine *m)
+{
+    uint16_t *memory = m->memory;
+
+    memmove(memory + m->dma_dst, memory + m->dma_src, m->dma_len * sizeof(uint16_t));
+    memory[DMA_CR] = (memory[DMA_CR] & DMA_IE) | DMA_DONE;
+    if (memory[DMA_CR] & DMA_IE) lc3_raise(m, DEV_DMA);
+}
+
+/* a write to DSK_CR, queues a sector transfer when the device is idle */
+static void disk_control(struct lc3_machine *m)
+{
+    uint16_t *memory = m->memory;
+    uint16_t cr = memory[DSK_CR];
+    uint16_t cmd = cr & DSK_CMD;
+    int user = memory[OS_PSR] >> 15;
+
+    if (m->events[DEV_DISK] != UINT64_MAX)
+    {
+        memory[DSK_CR] = (cr & DSK_IE) | m->disk_cmd;
+        return;
+    }
+
+    if (!cmd) return;
+
+    m->disk_sector = memory[DSK_SEC];
+    m->disk_buf = memory[DSK_BUF];
+    m->disk_cmd = cmd;
+
+    if (cmd == DSK_CMD || (size_t)m->disk_sector * 512 >= m->disk_size ||
+        (cmd == DSK_WRITE && !m->disk_writable) || !device_range_ok(m->disk_buf, 256, user))
+    {
+        memory[DSK_CR] = (cr & DSK_IE) | DSK_DONE | DSK_ERROR;
+        if (cr & DSK_IE) lc3_raise(m, DEV_DISK);
+        return;
+    }
+
+    memory[DSK_CR] = (cr & DSK_IE) | cmd;
+    lc3_schedule(m, DEV_DISK, m->instret + DSK_LATENCY);
+}
+
+/* extend a writable image to size bytes and map it again, 0 on failure */
+static int disk_grow(struct lc3_machine *m, size_t size)
+{
+    uint8_t *disk;
+
+    if (ftruncate(m->disk_fd, size) < 0)
+        return 0;
+
+    disk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->disk_fd, 0);
+    if (disk == MAP_FAILED)
+        return 0;
+
+    munmap(m->disk, m->disk_size);
+    m->disk = disk;
+    m->disk_size = size;
+    return 1;
+}
+
+/* move one 256 word sector with one copy, the words are swapped in place
+   on little endian hosts. a short last sector reads as zeros, writing it
+   first extends the file to a whole sector */
+static void disk_complete(struct lc3_machine *m)
+{
+    uint16_t *memory = m->memory;
+    uint16_t *buf = memory + m->disk_buf;
+    size_t offset = (size_t)m->disk_sector * 512;
+    size_t words = MIN(m->disk_size - offset, 512) / 2;
+    uint16_t status = DSK_DONE;
+
+    if (m->disk_cmd == DSK_READ)
+    {
+        memcpy(buf, m->disk + offset, words * sizeof(uint16_t));
+        words_from_be(buf, words);
+        memset(buf + words, 0, (256 - words) * sizeof(uint16_t));
+    }
+    else if (m->disk_size - offset >= 512 || disk_grow(m, offset + 512))
+    {
+        /* the mapping is page aligned, so every sector is word aligned */
+        uint16_t *sector = (uint16_t *)(m->disk + offset);
+
+        memcpy(sector, buf, 256 * sizeof(uint16_t));
+        words_from_be(sector, 256);
+    }
+    else
+    {
+        status |= DSK_ERROR;
+    }
+
+    memory[DSK_CR] = (memory[DSK_CR] & DSK_IE) | status;
+    if (memory[DSK_CR] & DSK_IE) lc3_raise(m, DEV_DISK);
+}
+
+/* fire due events and deliver pending interrupts, recomputes next_event */
+static void lc3_events(struct lc3_machine *m)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < LC3_DEVICES; i++)
+    {
+        if (m->events[i] <= m->instret)
+        {
+            m->events[i] = UINT64_MAX;
+            switch (i)
+            {
+                case DEV_DMA: dma_complete(m); break;
+                case DEV_DISK: disk_complete(m); break;
+            }
+        }
+    }
+
+    for (int i = 0; i < LC3_DEVICES; i++)
+    {
+        if (m->events[i] < next) next = m->events[i];
+    }
+
+    if (m->irq_pending)
+    {
+        int best = -1;
+        int level = (m->memory[OS_PSR] >> 8) & 0b111;
+
+        for (int i = 0; i < LC3_DEVICES; i++)
+        {
+            if (!(m->irq_pending & (1u << i))) continue;
+            if (!device_asserted(m, i))
+                m->irq_pending &= ~(1u << i);
+            else if (device_priority[i] > level && (best < 0 || device_priority[i] > device_priority[best]))
+                best = i;
+        }
+
+        if (best >= 0)
+        {
+            m->irq_pending &= ~(1u << best);
+            lc3_take_interrupt(m, best);
+        }
+
+        /* keep polling until the priority drops */
+        if (m->irq_pending) next = m->instret;
+    }
+
+    m->next_event = next;
+}
+
+/* latch the current counts, the low half is read first so both halves agree */
+static void counters_sample(struct lc3_machine *m)
+{
+    uint32_t inst = m->instret - m->cnt_instret_base;
+    uint32_t cycles = lc3_cycles(m) - m->cnt_cycles_base;
+
+    m->cnt_latch[0] = inst;
+    m->cnt_latch[1] = inst >> 16;
+    m->cnt_latch[2] = cycles;
+    m->cnt_latch[3] = cycles >> 16;
+}
+
+static void counters_control(struct lc3_machine *m)
+{
+    uint16_t cr = m->memory[CNT_CR];
+
+    if (cr & CNT_RESET)
+    {
+        m->cnt_instret_base = m->instret;
+        m->cnt_cycles_base = lc3_cycles(m);
+        m->memory[CNT_CR] &= ~CNT_RESET;
+    }
+
+    /* freezing takes a snapshot of both counters at once */
+    if ((cr & CNT_FREEZE) && !m->cnt_frozen)
+        counters_sample(m);
+    m->cnt_frozen = !!(cr & CNT_FREEZE);
+}
+
+/* side effects of storing to a device register */
+static void device_write(struct lc3_machine *m, uint16_t address)
+{
+    switch (address)
+    {
+        case OS_DDR:
+            if (m->memory[OS_DDR]) lc3_putc(m, m->memory[OS_DDR]);
+            break;
+        case DMA_CR:
+            if (m->dma) dma_control(m);
+            break;
+        case DSK_CR:
+            if (m->disk) disk_control(m);
+            break;
+        case CNT_CR:
+            counters_control(m);
+            break;
+        case CNT_INSTLO:
+        case CNT_INSTHI:
+        case CNT_CYCLO:
+        case CNT_CYCHI:
+            /* read only */
+            m->memory[address] = m->cnt_latch[(address - CNT_INSTLO) / 2];
+            break;
+    }
+}
+
+/* side effects of loading from a device register */
+static void device_read(struct lc3_machine *m, uint16_t address)
+{
+    switch (address)
+    {
+        case OS_KBDR:
+            m->input_index++;
+            break;
+        case CNT_INSTLO:
+        case CNT_CYCLO:
+            if (!m->cnt_frozen) counters_sample(m);
+            /* fall through */
+        case CNT_INSTHI:
+        case CNT_CYCHI:
+            m->memory[address] = m->cnt_latch[(address - CNT_INSTLO) / 2];
+            break;
+    }
+}
+
+static inline void trace_access(struct lc3_trace *t, uint16_t addr, int write)
+{
+    t->addr[t->count] = addr;
+    t->write[t->count++] = write;
+}
+
+/* execute one instruction, returns -1 if the instruction could not be executed.
+   trace is a constant, lc3_step passes 0 so the recording compiles out of the plain loop */
+static inline __attribute__((always_inline)) int lc3_exec(struct lc3_machine *m, const int trace)
+{
+    uint16_t *memory = m->memory;
+    uint16_t *registers = m->registers;
+    struct debugger_ctx *dbg = m->dbg;
+    struct lc3_trace *t = &m->trace;
+    uint16_t *pc = m->pc;
+    uint16_t instr = *pc;
+    if (trace)
+    {
+        t->pc = pc - memory;
+        t->instr = instr;
+        t->count = 0;
+        t->taken = 0;
+    }
+    pc++;
+    m->instret++;
+    m->cycles += m->cost[instr >> 12];
+
+    memory[OS_KBSR] = (m->input_index < m->input_size) << 15;
+    if (memory[OS_KBSR]) memory[OS_KBDR] = m->input[m->input_index];
+
+    switch ((instr & 0xf000) >> 12)
+    {
+        case 0b0001: /* ADD */
+        {
+            uint16_t sr2;
+            if (instr & (1 << 5))
+            {
+                /* imm5 */
+                sr2 = sext5(instr & 0b11111);
+            } else {
+                /* SR2 */
+                sr2 = registers[instr & 0b111];
+            }
+
+            registers[(instr & (0b111 << 9)) >> 9] = registers[(instr & (0b111 << 6)) >> 6] + sr2;
+
+            update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+
+            break;
+        }
+        case 0b0101: /* AND */
+        {
+            uint16_t sr2;
+            if (instr & (1 << 5))
+            {
+                /* imm5 */
+                sr2 = sext5(instr & 0b11111);
+            } else {
+                /* SR2 */
+                sr2 = registers[instr & 0b111];
+            }
+
+            registers[(instr & (0b111 << 9)) >> 9] = registers[(instr & (0b111 << 6)) >> 6] & sr2;
+
+            update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+
+            break;
+        }
+        case 0b1001: /* NOT */
+        {
+            registers[(instr & (0b111 << 9)) >> 9] = ~registers[(instr & (0b111 << 6)) >> 6];
+
+            update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+
+            break;
+        }
+        case 0b1111: /* TRAP */
+        {
+            uint16_t temp = memory[OS_PSR];
+            /* check user mode */
+            if (memory[OS_PSR] & (1u << 15))
+            {
+                memory[OS_USP] = registers[6];
+                registers[6] = memory[OS_SSP];
+                memory[OS_PSR] &= ~(1u << 15);
+            }
+
+            /* push old PSR and PC */
+
+            registers[6]--; /* push */
+            memory[registers[6]] = temp;
+            if (trace) trace_access(t, registers[6], 1);
+            registers[6]--; /* push */
+            memory[registers[6]] = pc - memory;
+            if (trace)
+            {
+                trace_access(t, registers[6], 1);
+                trace_access(t, instr & 0xff, 0);
+                t->taken = 1;
+            }
+
+            if (dbg)
+                shadow_push(dbg, FRAME_TRAP, pc - memory - 1, pc - memory, memory[instr & 0xff], registers);
+
+            pc = memory + memory[instr & 0xff];
+
+            break;
+        }
+        case 0b1110: /* LEA */
+        {
+            registers[(instr & (0b111 << 9)) >> 9] = (pc - memory) + sext9(instr & 0b111111111);
+            update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+            break;
+        }
+        case 0b1100: /* JMP */
+        {
+            pc = memory + registers[(instr & (0b111 << 6)) >> 6];
+            if (trace) t->taken = 1;
+            /* RET */
+            if (dbg && (instr & (0b111 << 6)) == (7 << 6))
+                shadow_pop(dbg, pc - memory);
+            break;
+        }
+        case 0b0000: /* BR */
+        {
+            if (((instr & (0b111 << 9)) >> 9) & (memory[OS_PSR] & 0b111))
+            {
+                pc += sext9(instr & 0b111111111);
+                m->cycles += m->cost_taken;
+                if (trace) t->taken = 1;
+            }
+            break;
+        }
+        case 0b0100: /* JSR(R) */
+        {
+            /* read BaseR first, JSRR R7 jumps to the old R7 */
+            uint16_t base = registers[(instr & (0b111 << 6)) >> 6];
+
+            registers[7] = pc - memory;
+            if (instr & (1 << 11))
+            {
+                /* imm11 */
+                pc += sext11(instr & 0b11111111111);
+            } else {
+                /* R */
+                pc = memory + base;
+            }
+            if (trace) t->taken = 1;
+
+            if (dbg)
+                shadow_push(dbg, FRAME_JSR, registers[7] - 1, registers[7], pc - memory, registers);
+            break;
+        }
+        case 0b0011: /* ST */
+        {
+            uint16_t *a = &pc[sext9(instr & 0b111111111)];
+            if (check_user_address(memory[OS_PSR], a - memory))
+                interrupt(memory, registers, &pc, 0x2, dbg);
+            else
+            {
+                *a = registers[(instr & (0b111 << 9)) >> 9];
+                if (a - memory >= 0xfe00) device_write(m, a - memory);
+                if (trace) trace_access(t, a - memory, 1);
+            }
+            break;
+        }
+        case 0b1011: /* STI */
+        {
+            uint16_t *a = &pc[sext9(instr & 0b111111111)];
+            uint16_t address = *a;
+            if (check_user_address(memory[OS_PSR], a - memory))
+                interrupt(memory, registers, &pc, 0x2, dbg);
+            else if (check_user_address(memory[OS_PSR], address))
+                interrupt(memory, registers, &pc, 0x2, dbg);
+            else
+            {
+                memory[address] = registers[(instr & (0b111 << 9)) >> 9];
+                if (address >= 0xfe00) device_write(m, address);
+                if (trace)
+                {
+                    trace_access(t, a - memory, 0);
+                    trace_access(t, address, 1);
+                }
+            }
+
+            break;
+        }
+        case 0b0111: /* STR */
+        {
+            uint16_t address = registers[(instr & (0b111 << 6)) >> 6] + sext6(instr & 0b111111);
+            if (check_user_address(memory[OS_PSR], address))
+                interrupt(memory, registers, &pc, 0x2, dbg);
+            else
+            {
+                memory[address] = registers[(instr & (0b111 << 9)) >> 9];
+                if (address >= 0xfe00) device_write(m, address);
+                if (trace) trace_access(t, address, 1);
+            }
+            break;
+        }
+        case 0b0010: /* LD */
+        {
+            uint16_t *a = &pc[sext9(instr & 0b111111111)];
+            if (check_user_address(memory[OS_PSR], a - memory))
+                interrupt(memory, registers, &pc, 0x2, dbg);
+            else
+            {
+                if (a - memory >= 0xfe00) device_read(m, a - memory);
+                registers[(instr & (0b111 << 9)) >> 9] = *a;
+                if (trace) trace_access(t, a - memory, 0);
+                update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+            }
+            break;
+        }
+        case 0b1010: /* LDI */
+        {
+            uint16_t *a = &pc[sext9(instr & 0b111111111)];
+            uint16_t address = *a;
+            if (check_user_address(memory[OS_PSR], a - memory))
+                interrupt(memory, registers, &pc, 0x2, dbg);
+            else if (check_user_address(memory[OS_PSR], address))
+                interrupt(memory, registers, &pc, 0x2, dbg);
+            else
+            {
+                if (address >= 0xfe00) device_read(m, address);
+                registers[(instr & (0b111 << 9)) >> 9] = memory[address];
+                update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+                if (trace)
+                {
+                    trace_access(t, a - memory, 0);
+                    trace_access(t, address, 0);
+                }
+            }
+            break;
+        }
+        case 0b0110: /* LDR */
+        {
+            uint16_t address = registers[(instr & (0b111 << 6)) >> 6] + sext6(instr & 0b111111);
+            if (check_user_address(memory[OS_PSR], address))
+                interrupt(memory, registers, &pc, 0x2, dbg);
+            else
+            {
+                if (address >= 0xfe00) device_read(m, address);
+                registers[(instr & (0b111 << 9)) >> 9] = memory[address];
+                update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+                if (trace) trace_access(t, address, 0);
+            }
+            break;
+        }
+        case 0b1000: /* RTI */
+        {
+            if (~memory[OS_PSR] & (1 << 15))
+            {
+                pc = memory + memory[registers[6]];
+                if (trace) trace_access(t, registers[6], 0);
+                registers[6]++; /* pop */
+                memory[OS_PSR] = memory[registers[6]];
+                if (trace)
+                {
+                    trace_access(t, registers[6], 0);
+                    t->taken = 1;
+                }
+                registers[6]++; /* pop */
+
+                if (dbg)
+                    shadow_pop(dbg, pc - memory);
+
+                if (memory[OS_PSR] & (1 << 15))
+                {
+                    /* setup user stack */
+                    memory[OS_SSP] = registers[6];
+                    registers[6] = memory[OS_USP];
+
+                    /* dump buffer on user return */
+                    if (!m->silent && dbg)
+                    {
+                        printf(" --- buffer begin ---\n%s\n --- buffer end --- \n\n", m->output);
+                        printf("\n\n");
+                    }
+                }
+            } else {
+                /* throw exception */
+                interrupt(memory, registers, &pc, 0x0, dbg);
+            }
+            break;
+        }
+        case 0b1101:
+        {
+#ifndef LC3_EXTENDED
+            /* illegal instruction exception */
+            interrupt(memory, registers, &pc, 0x1, dbg);
+#else
+            parse_extended(instr, *pc, memory, registers);
+            pc++;
+#endif
+            break;
+        }
+        default:
+        {
+            fprintf(stderr, "unimplemented instruction %x\n", instr & 0xf000 >> 12);
+            return -1;
+        }
+    }
+
+    m->pc = pc;
+    /* device events and interrupts land between instructions */
+    if (m->instret >= m->next_event) lc3_events(m);
+    return 0;
+}
+
+static inline int lc3_step(struct lc3_machine *m)
+{
+    return lc3_exec(m, 0);
+}
+
+/* lc3_step that also fills m->trace, for the cache, pipeline and predictor models */
+static int lc3_step_traced(struct lc3_machine *m)
+{
+    return lc3_exec(m, 1);
+}
+
+/* run until the clock is turned off or limit instructions have retired,
+   returns 1 if the machine halted */
+static int lc3_run(struct lc3_machine *m, uint64_t limit)
+{
+    while (lc3_running(m) && m->instret < limit)
+    {
+        if (lc3_step(m) < 0) break;
+    }
+
+    return !lc3_running(m);
+}
+
+/* execute one state of the control FSM on the machine, returns 1 when the instruction is complete.
+   device interrupts are taken by lc3_events at the boundary, like the ISA engine does */
+static int micro_state(struct lc3_machine *m, struct lc3_micro *u)
+{
+    uint16_t *memory = m->memory;
+    uint16_t *registers = m->registers;
+    struct debugger_ctx *dbg = m->dbg;
+    uint16_t ir = u->ir;
+    int dr = (ir >> 9) & 0b111;
+    int sr1 = (ir >> 6) & 0b111;
+    int next = UCODE_FETCH;
+    int mem = 0;
+
+    u->last = u->state;
+
+    switch (u->state)
+    {
+        case 18:
+            u->write_count = 0;
+            u->exception = 0;
+            u->mar = u->bus = m->pc - memory;
+            m->pc++;
+            m->instret++;
+            memory[OS_KBSR] = (m->input_index < m->input_size) << 15;
+            if (memory[OS_KBSR]) memory[OS_KBDR] = m->input[m->input_index];
+            next = 33;
+            break;
+        case 33:
+            u->mdr = memory[u->mar];
+            mem = 1;
+            next = 35;
+            break;
+        case 35:
+            u->ir = u->bus = u->mdr;
+            m->cycles += m->cost[u->ir >> 12];
+            next = 32;
+            break;
+        case 32:
+            u->ben = ((ir >> 9) & 0b111 & memory[OS_PSR]) != 0;
+            next = ir >> 12;
+            break;
+        case 0: /* BR */
+            next = u->ben ? 22 : UCODE_FETCH;
+            break;
+        case 22:
+            m->pc += sext9(ir & 0b111111111);
+            m->cycles += m->cost_taken;
+            u->bus = m->pc - memory;
+            break;
+        case 1: /* ADD */
+        case 5: /* AND */
+        {
+            uint16_t op2 = ir & (1 << 5) ? sext5(ir & 0b11111) : registers[ir & 0b111];
+            u->bus = u->state == 1 ? registers[sr1] + op2 : registers[sr1] & op2;
+            registers[dr] = u->bus;
+            update_cond_code(registers[dr], memory);
+            break;
+        }
+        case 9: /* NOT */
+            u->bus = registers[dr] = ~registers[sr1];
+            update_cond_code(registers[dr], memory);
+            break;
+        case 14: /* LEA, sets CC like the ISA engine */
+            u->bus = registers[dr] = (m->pc - memory) + sext9(ir & 0b111111111);
+            update_cond_code(registers[dr], memory);
+            break;
+        case 2: /* LD */
+        case 3: /* ST */
+        case 10: /* LDI */
+        case 11: /* STI */
+        case 6: /* LDR */
+        case 7: /* STR */
+        {
+            static const uint8_t after[16] = { [2] = 25, [3] = 23, [10] = 24, [11] = 29, [6] = 25, [7] = 23 };
+
+            if (u->state == 6 || u->state == 7)
+                u->mar = registers[sr1] + sext6(ir & 0b111111);
+            else
+                u->mar = (m->pc - memory) + sext9(ir & 0b111111111);
+            u->bus = u->mar;
+            next = check_user_address(memory[OS_PSR], u->mar) ? 60 : after[u->state];
+            break;
+        }
+        case 24:
+        case 29:
+            u->mdr = memory[u->mar];
+            mem = 1;
+            next = u->state == 24 ? 26 : 31;
+            break;
+        case 26:
+        case 31:
+            u->mar = u->bus = u->mdr;
+            if (check_user_address(memory[OS_PSR], u->mar))
+                next = 60;
+            else
+                next = u->state == 26 ? 25 : 23;
+            break;
+        case 25:
+            if (u->mar >= 0xfe00) device_read(m, u->mar);
+            u->mdr = memory[u->mar];
+            mem = 1;
+            next = 27;
+            break;
+        case 27:
+            u->bus = registers[dr] = u->mdr;
+            update_cond_code(registers[dr], memory);
+            break;
+        case 23:
+            u->mdr = u->bus = registers[dr];
+            next = 16;
+            break;
+        case 16:
+        case 41:
+        case 52:
+            memory[u->mar] = u->mdr;
+            if (u->write_count < (int)ARRAY_SIZE(u->writes))
+                u->writes[u->write_count++] = u->mar;
+            if (u->state == 16 && u->mar >= 0xfe00) device_write(m, u->mar);
+            mem = 1;
+            next = u->state == 41 ? 46 : u->state == 52 ? 54 : UCODE_FETCH;
+            break;
+        case 4: /* JSR(R) */
+            next = ir & (1 << 11) ? 21 : 20;
+            break;
+        case 20:
+        case 21:
+        {
+            /* read BaseR before R7 is written */
+            uint16_t base = registers[sr1];
+
+            registers[7] = m->pc - memory;
+            if (u->state == 21)
+                m->pc += sext11(ir & 0b11111111111);
+            else
+                m->pc = memory + base;
+            u->bus = m->pc - memory;
+
+            if (dbg)
+                shadow_push(dbg, FRAME_JSR, registers[7] - 1, registers[7], m->pc - memory, registers);
+            break;
+        }
+        case 12: /* JMP */
+            m->pc = memory + registers[sr1];
+            u->bus = m->pc - memory;
+            if (dbg && sr1 == 7)
+                shadow_pop(dbg, m->pc - memory);
+            break;
+        case 15: /* TRAP */
+            u->mdr = u->bus = memory[OS_PSR];
+            next = 47;
+            break;
+        case 47:
+            if (memory[OS_PSR] & (1u << 15))
+            {
+                memory[OS_USP] = registers[6];
+                registers[6] = memory[OS_SSP];
+                memory[OS_PSR] &= ~(1u << 15);
+            }
+            next = 37;
+            break;
+        case 37:
+            u->mar = u->bus = --registers[6];
+            next = 41;
+            break;
+        case 46:
+            u->mdr = m->pc - memory;
+            u->mar = u->bus = --registers[6];
+            next = 52;
+            break;
+        case 54:
+            u->mar = u->bus = ir & 0xff;
+            next = 53;
+            break;
+        case 53:
+            u->mdr = memory[u->mar];
+            mem = 1;
+            next = 55;
+            break;
+        case 55:
+            if (dbg && !u->exception)
+                shadow_push(dbg, FRAME_TRAP, m->pc - memory - 1, m->pc - memory, u->mdr, registers);
+            m->pc = memory + u->mdr;
+            u->bus = u->mdr;
+            break;
+        case 8: /* RTI */
+            u->mar = u->bus = registers[6];
+            next = memory[OS_PSR] & (1u << 15) ? 44 : 36;
+            break;
+        case 36:
+        case 40:
+            u->mdr = memory[u->mar];
+            mem = 1;
+            next = u->state == 36 ? 38 : 42;
+            break;
+        case 38:
+            m->pc = memory + u->mdr;
+            u->bus = u->mdr;
+            registers[6]++;
+            next = 39;
+            break;
+        case 39:
+            u->mar = u->bus = registers[6];
+            next = 40;
+            break;
+        case 42:
+            memory[OS_PSR] = u->bus = u->mdr;
+            registers[6]++;
+            next = 34;
+            break;
+        case 34:
+            if (dbg)
+                shadow_pop(dbg, m->pc - memory);
+
+            if (memory[OS_PSR] & (1u << 15))
+            {
+                memory[OS_SSP] = registers[6];
+                registers[6] = memory[OS_USP];
+
+                if (!m->silent && dbg)
+                {
+                    printf(" --- buffer begin ---\n%s\n --- buffer end --- \n\n", m->output);
+                    printf("\n\n");
+                }
+            }
+            break;
+        case 13:
+#ifndef LC3_EXTENDED
+            u->vector = 0x1;
+            next = 45;
+#else
+            parse_extended(ir, *m->pc, memory, registers);
+            m->pc++;
+#endif
+            break;
+        case 44:
+        case 60:
+            u->vector = u->state == 44 ? 0x0 : 0x2;
+            next = 45;
+            break;
+        case 45:
+            u->exception = 1;
+            if (dbg)
+                shadow_push(dbg, FRAME_INT, m->pc - memory - 1, m->pc - memory, memory[0x100 + u->vector], registers);
+            if (memory[OS_PSR] & (1u << 15))
+            {
+                memory[OS_USP] = registers[6];
+                registers[6] = memory[OS_SSP];
+                memory[OS_PSR] &= ~(1u << 15);
+            }
+            u->mar = u->bus = 0x100 + u->vector;
+            next = 53;
+            break;
+    }
+
+    u->cycles += mem ? u->mem_latency : 1;
+    u->state = next;
+
+    if (next != UCODE_FETCH)
+        return 0;
+
+    if (m->instret >= m->next_event) lc3_events(m);
+    return 1;
+}
+
+/* a private copy of a machine for the ISA side of the cross-check, shares the disk mapping */
+static void micro_shadow(struct lc3_machine *isa, const struct lc3_machine *m)
+{
+    uint16_t *memory = isa->memory;
+    char *output = isa->output;
+
+    *isa = *m;
+    isa->memory = memory ? memory : malloc(LC3_MEMORY_WORDS * sizeof(uint16_t));
+    isa->output = realloc(output, m->output_size);
+    memcpy(isa->memory, m->memory, LC3_MEMORY_WORDS * sizeof(uint16_t));
+    memcpy(isa->output, m->output, m->output_size);
+    isa->pc = isa->memory + (m->pc - m->memory);
+    isa->dbg = NULL;
+}
+
+/* compare the microsequencer with the ISA engine at an instruction boundary */
+static int micro_check(const struct lc3_machine *m, const struct lc3_machine *isa, const struct lc3_micro *u)
+{
+    if (memcmp(m->registers, isa->registers, sizeof(m->registers)) ||
+        m->pc - m->memory != isa->pc - isa->memory ||
+        m->memory[OS_PSR] != isa->memory[OS_PSR] ||
+        m->memory[OS_SSP] != isa->memory[OS_SSP] ||
+        m->memory[OS_USP] != isa->memory[OS_USP] ||
+        m->output_len != isa->output_len)
+        return 0;
+
+    for (int i = 0; i < u->write_count; i++)
+    {
+        if (m->memory[u->writes[i]] != isa->memory[u->writes[i]])
+            return 0;
+    }
+
+    return 1;
+}
+
+/* value change dump for waveform viewers, signals are sampled after every instruction
+   (or every state on the microsequencer) and only changes are written */
+#define VCD_MAX_SIGNALS 32
+#define VCD_BUFFER_SIZE (1 << 16)
+
+struct vcd_writer {
+    FILE *file;
+    int count;
+    int started;
+    uint64_t time;
+    uint16_t last[VCD_MAX_SIGNALS];
+    size_t len;
+    char buffer[VCD_BUFFER_SIZE];
+};
+
+static const struct {
+    const char *name;
+    int width;
+} vcd_signals[] = {
+    { "PC", 16 }, { "IR", 16 }, { "PSR", 16 },
+    { "R0", 16 }, { "R1", 16 }, { "R2", 16 }, { "R3", 16 },
+    { "R4", 16 }, { "R5", 16 }, { "R6", 16 }, { "R7", 16 },
+    { "KBSR", 16 }, { "KBDR", 16 }, { "DSR", 16 }, { "DDR", 16 },
+    { "DMASRC", 16 }, { "DMADST", 16 }, { "DMALEN", 16 }, { "DMACR", 16 },
+    { "DSKSEC", 16 }, { "DSKBUF", 16 }, { "DSKCR", 16 },
+    /* microsequencer only */
+    { "MAR", 16 }, { "MDR", 16 }, { "BUS", 16 }, { "STATE", 6 }, { "BEN", 1 },
+};
+
+/* signals before this index are present in every dump */
+#define VCD_ISA_SIGNALS 22
+
+static const uint16_t vcd_devices[] = {
+    OS_KBSR, OS_KBDR, OS_DSR, OS_DDR, DMA_SRC, DMA_DST, DMA_LEN, DMA_CR, DSK_SEC, DSK_BUF, DSK_CR,
+};
+
+static void vcd_flush(struct vcd_writer *v)
+{
+    fwrite(v->buffer, 1, v->len, v->file);
+    v->len = 0;
+}
+
+static struct vcd_writer *vcd_open(const char *path, int micro)
+{
+    struct vcd_writer *v = calloc(1, sizeof(*v));
+
+    if (!(v->file = fopen(path, "w")))
+    {
+        free(v);
+        return NULL;
+    }
+
+    v->count = micro ? ARRAY_SIZE(vcd_signals) : VCD_ISA_SIGNALS;
+
+    fprintf(v->file, "$version lc3sim $end\n");
+    /* one time unit is one modeled cycle */
+    fprintf(v->file, "$timescale 1ns $end\n");
+    fprintf(v->file, "$scope module lc3 $end\n");
+    for (int i = 0; i < v->count; i++)
+        fprintf(v->file, "$var wire %d %c %s $end\n", vcd_signals[i].width, '!' + i, vcd_signals[i].name);
+    fprintf(v->file, "$upscope $end\n$enddefinitions $end\n");
+
+    return v;
+}
+
+static void vcd_close(struct vcd_writer *v)
+{
+    vcd_flush(v);
+    fclose(v->file);
+    free(v);
+}
+
+static void vcd_sample(struct vcd_writer *v, const struct lc3_machine *m, const struct lc3_micro *u, uint16_t ir, uint64_t time)
+{
+    uint16_t now[VCD_MAX_SIGNALS];
+    int n = 0;
+    int stamped = 0;
+
+    now[n++] = m->pc - m->memory;
+    now[n++] = ir;
+    now[n++] = m->memory[OS_PSR];
+    for (int i = 0; i < 8; i++)
+        now[n++] = m->registers[i];
+    for (size_t i = 0; i < ARRAY_SIZE(vcd_devices); i++)
+        now[n++] = m->memory[vcd_devices[i]];
+    if (v->count > VCD_ISA_SIGNALS)
+    {
+        now[n++] = u->mar;
+        now[n++] = u->mdr;
+        now[n++] = u->bus;
+        now[n++] = u->state;
+        now[n++] = u->ben;
+    }
+
+    for (int i = 0; i < v->count; i++)
+    {
+        if (v->started && now[i] == v->last[i])
+            continue;
+
+        /* room for a timestamp and one value */
+        if (v->len > VCD_BUFFER_SIZE - 64)
+            vcd_flush(v);
+
+        if (!stamped && (!v->started || time != v->time))
+            v->len += sprintf(v->buffer + v->len, "#%llu\n", (unsigned long long)time);
+        stamped = 1;
+
+        /* binary without leading zeros */
+        char *out = v->buffer + v->len;
+        int bit = 15;
+        *out++ = 'b';
+        while (bit > 0 && !(now[i] >> bit)) bit--;
+        for (; bit >= 0; bit--)
+            *out++ = '0' + ((now[i] >> bit) & 1);
+        *out++ = ' ';
+        *out++ = '!' + i;
+        *out++ = '\n';
+        v->len = out - v->buffer;
+
+        v->last[i] = now[i];
+    }
+
+    v->started = 1;
+    v->time = time;
+}
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/* set associative caches fed from the trace, sizes are in words */
+#define CACHE_LRU 0
+#define CACHE_FIFO 1
+#define CACHE_RANDOM 2
+#define CACHE_MAX_LEVELS 4
+
+struct cache {
+    char name[8];
+    int size;
+    int assoc;
+    int line;
+    int policy;
+    int write_back;
+    int latency;
+    int sets;
+    int line_shift;
+    /* sets * assoc ways */
+    uint32_t *tags;
+    uint8_t *valid;
+    uint8_t *dirty;
+    /* last use (LRU) or fill (FIFO) time */
+    uint64_t *stamp;
+    uint64_t clock;
+    uint64_t rng;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+    struct cache *next;
+};
+
+struct cache_system {
+    struct cache *levels[CACHE_MAX_LEVELS + 1];
+    struct cache *l1i;
+    struct cache *l1d;
+    struct cache *icache;
+    struct cache *dcache;
+    int mem_latency;
+    uint64_t stall;
+    /* per PC statistics */
+    uint64_t *pc_stall;
+    uint32_t *pc_accesses;
+    uint32_t *pc_misses;
+};
+
+static const char *cache_policy_names[] = { "lru", "fifo", "random" };
+
+static int cache_access(struct cache_system *cs, struct cache *c, uint16_t addr, int write, int *missed);
+
+/* returns the way holding line, or -1 */
+static int cache_lookup(struct cache *c, uint32_t line)
+{
+    int set = line & (c->sets - 1);
+    uint32_t tag = line >> __builtin_ctz(c->sets);
+
+    for (int w = 0; w < c->assoc; w++)
+    {
+        int i = set * c->assoc + w;
+        if (c->valid[i] && c->tags[i] == tag)
+            return i;
+    }
+
+    return -1;
+}
+
+static int cache_victim(struct cache *c, int set)
+{
+    int base = set * c->assoc;
+    int best = base;
+
+    for (int w = 0; w < c->assoc; w++)
+    {
+        if (!c->valid[base + w])
+            return base + w;
+    }
+
+    if (c->policy == CACHE_RANDOM)
+        return base + splitmix64(&c->rng) % c->assoc;
+
+    /* LRU and FIFO both evict the oldest stamp, they differ in when it is set */
+    for (int w = 1; w < c->assoc; w++)
+    {
+        if (c->stamp[base + w] < c->stamp[best])
+            best = base + w;
+    }
+
+    return best;
+}
+
+/* latency of one access at this level and below, writes are buffered and cost no latency below L1 */
+static int cache_access(struct cache_system *cs, struct cache *c, uint16_t addr, int write, int *missed)
+{
+    if (!c)
+        return cs->mem_latency;
+
+    uint32_t line = addr >> c->line_shift;
+    int i = cache_lookup(c, line);
+    int latency = c->latency;
+
+    c->clock++;
+
+    if (i >= 0)
+    {
+        c->hits++;
+        if (c->policy == CACHE_LRU)
+            c->stamp[i] = c->clock;
+    }
+    else
+    {
+        int set = line & (c->sets - 1);
+
+        c->misses++;
+        if (missed) (*missed)++;
+
+        i = cache_victim(c, set);
+        if (c->valid[i] && c->dirty[i])
+        {
+            uint32_t old = (c->tags[i] << __builtin_ctz(c->sets)) | set;
+            c->writebacks++;
+            cache_access(cs, c->next, old << c->line_shift, 1, NULL);
+        }
+
+        /* write allocate, fetch the line from below */
+        latency += cache_access(cs, c->next, addr, 0, NULL);
+        c->tags[i] = line >> __builtin_ctz(c->sets);
+        c->valid[i] = 1;
+        c->dirty[i] = 0;
+        c->stamp[i] = c->clock;
+    }
+
+    if (write)
+    {
+        if (c->write_back)
+            c->dirty[i] = 1;
+        else
+            cache_access(cs, c->next, addr, 1, NULL);
+    }
+
+    return latency;
+}
+
+static int is_pow2(int x)
+{
+    return x > 0 && !(x & (x - 1));
+}
+
+/* parse L1:size,assoc,line[,lru|fifo|random][,wb|wt][,lat=N] levels and mem=N,
+   L1 may be split into L1I and L1D */
+static struct cache_system *cache_create(const char *spec)
+{
+    struct cache_system *cs = calloc(1, sizeof(*cs));
+    char *copy = strdup(spec);
+    char *save = NULL;
+    struct cache *c = NULL;
+    int field = 0;
+
+    cs->mem_latency = 20;
+
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        char *colon = strchr(tok, ':');
+
+        if (colon)
+        {
+            int level;
+            char side = 0;
+
+            *colon = 0;
+            if (sscanf(tok, "L%d%c", &level, &side) < 1 || level < 1 || level > CACHE_MAX_LEVELS ||
+                (side && (level != 1 || (side != 'I' && side != 'D'))))
+                goto invalid;
+
+            c = calloc(1, sizeof(*c));
+            snprintf(c->name, sizeof(c->name), "%s", tok);
+            c->latency = level == 1 ? 1 : level == 2 ? 10 : 30;
+            c->write_back = 1;
+            c->rng = 0x5eed + level;
+
+            struct cache **slot = side == 'I' ? &cs->l1i : side == 'D' ? &cs->l1d : &cs->levels[level];
+            if (*slot)
+            {
+                free(c);
+                goto invalid;
+            }
+            *slot = c;
+
+            tok = colon + 1;
+            field = 0;
+        }
+
+        if (isdigit(*tok) && c && field < 3)
+        {
+            int value = strtol(tok, NULL, 0);
+            if (field == 0) c->size = value;
+            if (field == 1) c->assoc = value;
+            if (field == 2) c->line = value;
+            field++;
+        }
+        else if (c && !strcmp(tok, "lru")) c->policy = CACHE_LRU;
+        else if (c && !strcmp(tok, "fifo")) c->policy = CACHE_FIFO;
+        else if (c && !strcmp(tok, "random")) c->policy = CACHE_RANDOM;
+        else if (c && !strcmp(tok, "wb")) c->write_back = 1;
+        else if (c && !strcmp(tok, "wt")) c->write_back = 0;
+        else if (c && strstr(tok, "lat=") == tok) c->latency = atoi(tok + 4);
+        else if (strstr(tok, "mem=") == tok) cs->mem_latency = atoi(tok + 4);
+        else goto invalid;
+    }
+
+    if (cs->levels[1] && (cs->l1i || cs->l1d))
+        goto invalid;
+
+    /* size = sets * assoc * line, all powers of two */
+    for (int i = 0; i < CACHE_MAX_LEVELS + 2; i++)
+    {
+        c = i < CACHE_MAX_LEVELS ? cs->levels[i + 1] : i == CACHE_MAX_LEVELS ? cs->l1i : cs->l1d;
+        if (!c) continue;
+
+        if (!is_pow2(c->line) || c->assoc < 1 || c->size % (c->assoc * c->line) ||
+            !is_pow2(c->sets = c->size / (c->assoc * c->line)))
+            goto invalid;
+
+        c->line_shift = __builtin_ctz(c->line);
+        c->tags = calloc(c->sets * c->assoc, sizeof(uint32_t));
+        c->valid = calloc(c->sets * c->assoc, 1);
+        c->dirty = calloc(c->sets * c->assoc, 1);
+        c->stamp = calloc(c->sets * c->assoc, sizeof(uint64_t));
+    }
+
+    /* chain every cache to the next level that exists */
+    for (int i = CACHE_MAX_LEVELS; i >= 1; i--)
+    {
+        struct cache *below = NULL;
+        for (int j = i + 1; j <= CACHE_MAX_LEVELS && !below; j++)
+            below = cs->levels[j];
+        if (cs->levels[i]) cs->levels[i]->next = below;
+        if (i == 1)
+        {
+            if (cs->l1i) cs->l1i->next = below;
+            if (cs->l1d) cs->l1d->next = below;
+        }
+    }
+
+    for (int i = 1; i <= CACHE_MAX_LEVELS && !(cs->icache && cs->dcache); i++)
+    {
+        if (!cs->icache) cs->icache = i == 1 && cs->l1i ? cs->l1i : cs->levels[i];
+        if (!cs->dcache) cs->dcache = i == 1 && cs->l1d ? cs->l1d : cs->levels[i];
+    }
+
+    cs->pc_stall = calloc(0x10000, sizeof(uint64_t));
+    cs->pc_accesses = calloc(0x10000, sizeof(uint32_t));
+    cs->pc_misses = calloc(0x10000, sizeof(uint32_t));
+    free(copy);
+    return cs;
+
+invalid:
+    /* leaks the partial hierarchy, the caller exits */
+    free(copy);
+    return NULL;
+}
+
+/* run one traced instruction through the caches, returns its stall cycles */
+static int cache_trace(struct cache_system *cs, const struct lc3_trace *t)
+{
+    int stall = 0;
+    int missed = 0;
+
+    /* every access costs at least one cycle, the rest is stall */
+    stall += cache_access(cs, cs->icache, t->pc, 0, &missed) - 1;
+    for (int i = 0; i < t->count; i++)
+        stall += cache_access(cs, cs->dcache, t->addr[i], t->write[i], &missed) - 1;
+
+    cs->stall += stall;
+    cs->pc_stall[t->pc] += stall;
+    cs->pc_accesses[t->pc] += 1 + t->count;
+    cs->pc_misses[t->pc] += missed;
+
+    return stall;
+}
+
+static void cache_report(const struct cache_system *cs, const uint16_t *memory)
+{
+    const struct cache *all[] = { cs->l1i, cs->l1d, cs->levels[1], cs->levels[2], cs->levels[3], cs->levels[4] };
+    uint16_t top[10] = {0};
+    int top_size = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(all); i++)
+    {
+        const struct cache *c = all[i];
+        uint64_t total;
+
+        if (!c) continue;
+
+        total = c->hits + c->misses;
+        printf("%s: %d words, %d-way, %d-word lines, %s, %s, %d cycles\n", c->name, c->size, c->assoc, c->line,
+               cache_policy_names[c->policy], c->write_back ? "write-back" : "write-through", c->latency);
+        printf("  accesses: %llu hits: %llu (%.2f%%) misses: %llu writebacks: %llu\n", (unsigned long long)total,
+               (unsigned long long)c->hits, total ? 100.0 * c->hits / total : 0.0,
+               (unsigned long long)c->misses, (unsigned long long)c->writebacks);
+    }
+
+    printf("memory: %d cycles\n", cs->mem_latency);
+    printf("stall cycles: %llu\n", (unsigned long long)cs->stall);
+
+    /* the PCs with the most stall cycles */
+    for (uint32_t pc = 0; pc < 0x10000; pc++)
+    {
+        int i;
+
+        if (!cs->pc_stall[pc]) continue;
+
+        for (i = top_size; i > 0 && cs->pc_stall[top[i - 1]] < cs->pc_stall[pc]; i--)
+        {
+            if (i < (int)ARRAY_SIZE(top)) top[i] = top[i - 1];
+        }
+
+        if (i < (int)ARRAY_SIZE(top))
+        {
+            top[i] = pc;
+            if (top_size < (int)ARRAY_SIZE(top)) top_size++;
+        }
+    }
+
+    if (top_size)
+        printf("most stalled instructions:\n");
+    for (int i = 0; i < top_size; i++)
+    {
+        char text[64];
+
+        if (!disasm_instr(memory[top[i]], text, sizeof(text)))
+            snprintf(text, sizeof(text), ".FILL %#x", memory[top[i]]);
+        printf("  %#06x: %-24s %llu stall cycles, %u misses in %u accesses\n", top[i], text,
+               (unsigned long long)cs->pc_stall[top[i]], cs->pc_misses[top[i]], cs->pc_accesses[top[i]]);
+    }
+}
+
+/* trace driven 5 stage pipeline (IF ID EX MEM WB) fed through a ring buffer by the core,
+   branches resolve in EX, TRAP and RTI get their target in MEM */
+#define PIPE_RING_SIZE (1 << 16)
+#define PIPE_PUBLISH 256
+#define PIPE_PREDICTOR_SIZE 1024
+#define PREDICT_STATIC 0
+#define PREDICT_1BIT 1
+#define PREDICT_2BIT 2
+/* condition codes are tracked as a ninth register */
+#define PIPE_CC 8
+
+struct pipe_record {
+    uint16_t pc;
+    uint16_t instr;
+    uint8_t taken;
+};
+
+struct pipe_model {
+    int forward;
+    int predict;
+    int load_use;
+    /* earliest cycle the next instruction can enter ID */
+    uint64_t next;
+    uint64_t last_issue;
+    /* cycle a register's value can be used by an instruction in ID */
+    uint64_t avail[9];
+    uint8_t from_load[9];
+    uint8_t predictor[PIPE_PREDICTOR_SIZE];
+    uint64_t instructions;
+    uint64_t load_use_stalls;
+    uint64_t raw_stalls;
+    uint64_t mispredict_stalls;
+    uint64_t jump_stalls;
+    uint64_t memory_stalls;
+    uint64_t branches;
+    uint64_t mispredicts;
+    uint32_t *branch_count;
+    uint32_t *branch_misses;
+};
+
+struct pipe_ring {
+    /* written by the core */
+    _Atomic uint64_t head;
+    char pad1[56];
+    /* written by the model */
+    _Atomic uint64_t tail;
+    char pad2[56];
+    _Atomic int done;
+    /* producer side only */
+    uint64_t local_head;
+    uint64_t cached_tail;
+    struct pipe_model model;
+    pthread_t thread;
+    struct pipe_record records[PIPE_RING_SIZE];
+};
+
+static const char *predict_names[] = { "static (backward taken)", "1-bit", "2-bit" };
+
+/* registers (bit 8 is the condition codes) an instruction reads and writes */
+static void pipe_decode(uint16_t instr, unsigned *reads, unsigned *writes, int *load)
+{
+    unsigned dr = (instr >> 9) & 0b111;
+    unsigned sr1 = (instr >> 6) & 0b111;
+
+    *reads = *writes = 0;
+    *load = 0;
+
+    switch (instr >> 12)
+    {
+        case 0b0001: /* ADD */
+        case 0b0101: /* AND */
+            *reads = 1u << sr1 | (instr & (1 << 5) ? 0 : 1u << (instr & 0b111));
+            *writes = 1u << dr | 1u << PIPE_CC;
+            break;
+        case 0b1001: /* NOT */
+            *reads = 1u << sr1;
+            *writes = 1u << dr | 1u << PIPE_CC;
+            break;
+        case 0b1110: /* LEA */
+            *writes = 1u << dr | 1u << PIPE_CC;
+            break;
+        case 0b0110: /* LDR */
+            *reads = 1u << sr1;
+            /* fall through */
+        case 0b0010: /* LD */
+        case 0b1010: /* LDI */
+            *writes = 1u << dr | 1u << PIPE_CC;
+            *load = 1;
+            break;
+        case 0b0111: /* STR */
+            *reads = 1u << sr1;
+            /* fall through */
+        case 0b0011: /* ST */
+        case 0b1011: /* STI */
+            *reads |= 1u << dr;
+            break;
+        case 0b0000: /* BR */
+            *reads = 1u << PIPE_CC;
+            break;
+        case 0b1100: /* JMP */
+            *reads = 1u << sr1;
+            break;
+        case 0b0100: /* JSR(R) */
+            *reads = instr & (1 << 11) ? 0 : 1u << sr1;
+            *writes = 1u << 7;
+            break;
+        case 0b1111: /* TRAP */
+        case 0b1000: /* RTI */
+            *reads = 1u << 6;
+            *writes = 1u << 6 | 1u << PIPE_CC;
+            *load = 1;
+            break;
+    }
+}
+
+static int pipe_predict(struct pipe_model *p, uint16_t pc, uint16_t instr)
+{
+    uint8_t *entry = &p->predictor[pc % PIPE_PREDICTOR_SIZE];
+
+    /* BRnzp is always taken and BR with no condition never is */
+    if ((instr & 0x0e00) == 0x0e00) return 1;
+    if (!(instr & 0x0e00)) return 0;
+
+    switch (p->predict)
+    {
+        case PREDICT_1BIT: return *entry;
+        case PREDICT_2BIT: return *entry >= 2;
+        default: return sext9(instr & 0b111111111) < 0;
+    }
+}
+
+static void pipe_train(struct pipe_model *p, uint16_t pc, int taken)
+{
+    uint8_t *entry = &p->predictor[pc % PIPE_PREDICTOR_SIZE];
+
+    if (p->predict == PREDICT_1BIT)
+        *entry = taken;
+    else if (p->predict == PREDICT_2BIT)
+        *entry = taken ? MIN(*entry + 1, 3) : (*entry ? *entry - 1 : 0);
+}
+
+static void pipe_retire(struct pipe_model *p, const struct pipe_record *r)
+{
+    unsigned reads, writes;
+    int load;
+    uint64_t issue = p->next;
+    int limiting = -1;
+    int penalty = 0;
+
+    pipe_decode(r->instr, &reads, &writes, &load);
+
+    for (unsigned set = reads; set; set &= set - 1)
+    {
+        int i = __builtin_ctz(set);
+        if (p->avail[i] > issue)
+        {
+            issue = p->avail[i];
+            limiting = i;
+        }
+    }
+
+    if (limiting >= 0)
+    {
+        if (p->forward && p->from_load[limiting])
+            p->load_use_stalls += issue - p->next;
+        else
+            p->raw_stalls += issue - p->next;
+    }
+
+    for (unsigned set = writes; set; set &= set - 1)
+    {
+        int i = __builtin_ctz(set);
+        /* forwarded from EX (or MEM for loads), otherwise written back in WB and read in the same cycle */
+        p->avail[i] = p->forward ? issue + 1 + (load ? p->load_use : 0) : issue + 3;
+        p->from_load[i] = load;
+    }
+
+    switch (r->instr >> 12)
+    {
+        case 0b0000: /* BR */
+        {
+            int predicted = pipe_predict(p, r->pc, r->instr);
+
+            p->branches++;
+            p->branch_count[r->pc]++;
+            if (predicted != r->taken)
+            {
+                p->mispredicts++;
+                p->branch_misses[r->pc]++;
+                p->mispredict_stalls += 2;
+                penalty += 2;
+            }
+            pipe_train(p, r->pc, r->taken);
+            break;
+        }
+        case 0b0100: /* JSR(R) */
+            penalty += r->instr & (1 << 11) ? 1 : 2;
+            p->jump_stalls += r->instr & (1 << 11) ? 1 : 2;
+            break;
+        case 0b1100: /* JMP */
+            penalty += 2;
+            p->jump_stalls += 2;
+            break;
+        case 0b1111: /* TRAP: two pushes and the vector read share MEM */
+            penalty += 3 + 2;
+            p->jump_stalls += 3;
+            p->memory_stalls += 2;
+            break;
+        case 0b1000: /* RTI: two pops */
+            penalty += 3 + 1;
+            p->jump_stalls += 3;
+            p->memory_stalls += 1;
+            break;
+        case 0b1010: /* LDI */
+        case 0b1011: /* STI */
+            penalty += 1;
+            p->memory_stalls += 1;
+            break;
+    }
+
+    p->instructions++;
+    p->last_issue = issue;
+    p->next = issue + 1 + penalty;
+}
+
+static void *pipe_worker(void *arg)
+{
+    struct pipe_ring *ring = arg;
+    uint64_t tail = 0;
+
+    for (;;)
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        if (tail == head)
+        {
+            if (atomic_load_explicit(&ring->done, memory_order_acquire) &&
+                tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+                break;
+            sched_yield();
+            continue;
+        }
+
+        for (; tail < head; tail++)
+            pipe_retire(&ring->model, &ring->records[tail % PIPE_RING_SIZE]);
+
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    return NULL;
+}
+
+/* parse [forward|noforward][,static|1bit|2bit][,loaduse=N] and start the model thread */
+static struct pipe_ring *pipe_create(const char *spec)
+{
+    struct pipe_ring *ring = calloc(1, sizeof(*ring));
+    struct pipe_model *p = &ring->model;
+    char *copy = strdup(spec);
+    char *save = NULL;
+
+    p->forward = 1;
+    p->predict = PREDICT_2BIT;
+    p->load_use = 1;
+    p->next = 1;
+    /* 2-bit counters start weakly not taken */
+    memset(p->predictor, 1, sizeof(p->predictor));
+
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        if (!strcmp(tok, "forward")) p->forward = 1;
+        else if (!strcmp(tok, "noforward")) p->forward = 0;
+        else if (!strcmp(tok, "static")) p->predict = PREDICT_STATIC;
+        else if (!strcmp(tok, "1bit")) p->predict = PREDICT_1BIT;
+        else if (!strcmp(tok, "2bit")) p->predict = PREDICT_2BIT;
+        else if (strstr(tok, "loaduse=") == tok) p->load_use = atoi(tok + 8);
+        else
+        {
+            free(copy);
+            free(ring);
+            return NULL;
+        }
+    }
+
+    free(copy);
+    if (p->predict == PREDICT_1BIT)
+        memset(p->predictor, 0, sizeof(p->predictor));
+
+    p->branch_count = calloc(0x10000, sizeof(uint32_t));
+    p->branch_misses = calloc(0x10000, sizeof(uint32_t));
+
+    if (pthread_create(&ring->thread, NULL, pipe_worker, ring))
+    {
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+/* hand one retired instruction to the model, waits only when the ring is full */
+static inline void pipe_push(struct pipe_ring *ring, const struct lc3_trace *t)
+{
+    struct pipe_record *r;
+
+    while (ring->local_head - ring->cached_tail >= PIPE_RING_SIZE)
+    {
+        atomic_store_explicit(&ring->head, ring->local_head, memory_order_release);
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (ring->local_head - ring->cached_tail >= PIPE_RING_SIZE)
+            sched_yield();
+    }
+
+    r = &ring->records[ring->local_head % PIPE_RING_SIZE];
+    r->pc = t->pc;
+    r->instr = t->instr;
+    r->taken = t->taken;
+
+    if (!(++ring->local_head % PIPE_PUBLISH))
+        atomic_store_explicit(&ring->head, ring->local_head, memory_order_release);
+}
+
+static void pipe_finish(struct pipe_ring *ring)
+{
+    atomic_store_explicit(&ring->head, ring->local_head, memory_order_release);
+    atomic_store_explicit(&ring->done, 1, memory_order_release);
+    pthread_join(ring->thread, NULL);
+}
+
+static void pipe_report(const struct pipe_ring *ring, const uint16_t *memory)
+{
+    const struct pipe_model *p = &ring->model;
+    uint64_t cycles = p->instructions ? p->last_issue + 4 : 0;
+    uint16_t top[10];
+    int top_size = 0;
+
+    printf("pipeline: %s, %s prediction, load-use %d\n", p->forward ? "forwarding" : "no forwarding",
+           predict_names[p->predict], p->load_use);
+    printf("  instructions: %llu cycles: %llu CPI: %.2f\n", (unsigned long long)p->instructions,
+           (unsigned long long)cycles, p->instructions ? (double)cycles / p->instructions : 0.0);
+    printf("  stalls: load-use %llu, data %llu, mispredicted branches %llu, jumps %llu, memory %llu\n",
+           (unsigned long long)p->load_use_stalls, (unsigned long long)p->raw_stalls,
+           (unsigned long long)p->mispredict_stalls, (unsigned long long)p->jump_stalls,
+           (unsigned long long)p->memory_stalls);
+    printf("  branches: %llu mispredicted: %llu (%.2f%%)\n", (unsigned long long)p->branches,
+           (unsigned long long)p->mispredicts, p->branches ? 100.0 * p->mispredicts / p->branches : 0.0);
+
+    for (uint32_t pc = 0; pc < 0x10000; pc++)
+    {
+        int i;
+
+        if (!p->branch_misses[pc]) continue;
+
+        for (i = top_size; i > 0 && p->branch_misses[top[i - 1]] < p->branch_misses[pc]; i--)
+        {
+            if (i < (int)ARRAY_SIZE(top)) top[i] = top[i - 1];
+        }
+
+        if (i < (int)ARRAY_SIZE(top))
+        {
+            top[i] = pc;
+            if (top_size < (int)ARRAY_SIZE(top)) top_size++;
+        }
+    }
+
+    if (top_size)
+        printf("most mispredicted branches:\n");
+    for (int i = 0; i < top_size; i++)
+    {
+        char text[64];
+
+        disasm_instr(memory[top[i]], text, sizeof(text));
+        printf("  %#06x: %-24s %u of %u\n", top[i], text, p->branch_misses[top[i]], p->branch_count[top[i]]);
+    }
+}
+
+/* per site branch profile with bimodal, gshare and local history predictors run side by side */
+#define BP_BITS 10
+#define BP_SIZE (1 << BP_BITS)
+#define BP_PREDICTORS 3
+
+struct branch_site {
+    uint16_t pc;
+    uint8_t last;
+    uint32_t taken;
+    uint32_t not_taken;
+    /* outcome differs from the previous execution */
+    uint32_t transitions;
+    uint32_t misses[BP_PREDICTORS];
+};
+
+struct branch_stats {
+    /* site index + 1 for every PC, 0 when the PC has no conditional branch */
+    uint16_t *index;
+    struct branch_site *sites;
+    int size;
+    int capacity;
+    uint8_t bimodal[BP_SIZE];
+    uint8_t gshare[BP_SIZE];
+    uint16_t history;
+    uint16_t local_history[BP_SIZE];
+    uint8_t local[BP_SIZE];
+    uint64_t branches;
+    uint64_t misses[BP_PREDICTORS];
+};
+
+static const char *bp_names[BP_PREDICTORS] = { "bimodal", "gshare", "local" };
+
+static struct branch_stats *branch_stats_create(void)
+{
+    struct branch_stats *bs = calloc(1, sizeof(*bs));
+
+    bs->index = calloc(0x10000, sizeof(uint16_t));
+    /* 2-bit counters start weakly not taken */
+    memset(bs->bimodal, 1, sizeof(bs->bimodal));
+    memset(bs->gshare, 1, sizeof(bs->gshare));
+    memset(bs->local, 1, sizeof(bs->local));
+    return bs;
+}
+
+static inline int bp_update(uint8_t *counter, int taken)
+{
+    int predicted = *counter >= 2;
+
+    if (taken && *counter < 3) (*counter)++;
+    if (!taken && *counter > 0) (*counter)--;
+    return predicted != taken;
+}
+
+static void branch_record(struct branch_stats *bs, uint16_t pc, uint16_t instr, int taken)
+{
+    struct branch_site *site;
+    int miss[BP_PREDICTORS];
+
+    /* only conditional branches */
+    if (!(instr & 0x0e00) || (instr & 0x0e00) == 0x0e00)
+        return;
+
+    if (!bs->index[pc])
+    {
+        if (bs->size == bs->capacity)
+        {
+            bs->capacity = bs->capacity ? bs->capacity * 2 : 64;
+            bs->sites = realloc(bs->sites, bs->capacity * sizeof(*bs->sites));
+        }
+        site = &bs->sites[bs->size++];
+        memset(site, 0, sizeof(*site));
+        site->pc = pc;
+        site->last = taken;
+        bs->index[pc] = bs->size;
+    }
+
+    site = &bs->sites[bs->index[pc] - 1];
+
+    miss[0] = bp_update(&bs->bimodal[pc % BP_SIZE], taken);
+    miss[1] = bp_update(&bs->gshare[(pc ^ bs->history) % BP_SIZE], taken);
+    miss[2] = bp_update(&bs->local[bs->local_history[pc % BP_SIZE] % BP_SIZE], taken);
+
+    bs->history = ((bs->history << 1) | taken) & (BP_SIZE - 1);
+    bs->local_history[pc % BP_SIZE] = ((bs->local_history[pc % BP_SIZE] << 1) | taken) & (BP_SIZE - 1);
+
+    if (site->taken + site->not_taken && site->last != taken)
+        site->transitions++;
+    site->last = taken;
+    if (taken) site->taken++;
+    else site->not_taken++;
+
+    bs->branches++;
+    for (int i = 0; i < BP_PREDICTORS; i++)
+    {
+        site->misses[i] += miss[i];
+        bs->misses[i] += miss[i];
+    }
+}
+
+/* hardest first: the most misses of the best predictor for the site */
+static uint32_t branch_difficulty(const struct branch_site *site)
+{
+    uint32_t best = site->misses[0];
+
+    for (int i = 1; i < BP_PREDICTORS; i++)
+        best = MIN(best, site->misses[i]);
+    return best;
+}
+
+static int branch_site_cmp(const void *a, const void *b)
+{
+    uint32_t da = branch_difficulty(a);
+    uint32_t db = branch_difficulty(b);
+
+    if (da != db) return da < db ? 1 : -1;
+    return ((const struct branch_site *)a)->pc - ((const struct branch_site *)b)->pc;
+}
+
+static void branch_report(struct branch_stats *bs, const uint16_t *memory)
+{
+    printf("conditional branches: %llu at %d sites\n", (unsigned long long)bs->branches, bs->size);
+    for (int i = 0; i < BP_PREDICTORS; i++)
+    {
+        printf("  %-8s accuracy: %.2f%% (%llu mispredicted)\n", bp_names[i],
+               bs->branches ? 100.0 * (bs->branches - bs->misses[i]) / bs->branches : 0.0,
+               (unsigned long long)bs->misses[i]);
+    }
+
+    if (!bs->size)
+        return;
+
+    qsort(bs->sites, bs->size, sizeof(*bs->sites), branch_site_cmp);
+
+    printf("hardest to predict:\n");
+    printf("  %-6s  %-22s %9s %7s %11s %8s %8s %8s\n", "pc", "instruction", "executed", "taken", "transitions",
+           bp_names[0], bp_names[1], bp_names[2]);
+    for (int i = 0; i < MIN(bs->size, 15); i++)
+    {
+        const struct branch_site *site = &bs->sites[i];
+        uint32_t total = site->taken + site->not_taken;
+        char text[64];
+
+        disasm_instr(memory[site->pc], text, sizeof(text));
+        printf("  %#06x  %-22s %9u %6.1f%% %11u", site->pc, text, total, 100.0 * site->taken / total,
+               site->transitions);
+        for (int j = 0; j < BP_PREDICTORS; j++)
+            printf(" %7.1f%%", 100.0 * (total - site->misses[j]) / total);
+        printf("\n");
+    }
+
+    /* the sites were reordered */
+    for (int i = 0; i < bs->size; i++)
+        bs->index[bs->sites[i].pc] = i + 1;
+}
+
+static int default_jobs(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/* a CPU the batch workers can be pinned to and the NUMA node it is on */
+struct cpu_slot {
+    int cpu;
+    int node;
+};
+
+static int read_sys_int(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    int value = -1;
+
+    if (!file) return -1;
+    if (fscanf(file, "%d", &value) != 1) value = -1;
+    fclose(file);
+    return value;
+}
+
+/* sysfs links cpuN to its node as cpuN/nodeM */
+static int cpu_node(int cpu)
+{
+    char path[0x40];
+    struct dirent *ent;
+    DIR *d;
+    int node = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if (!(d = opendir(path))) return 0;
+
+    while ((ent = readdir(d)))
+    {
+        if (strstr(ent->d_name, "node") == ent->d_name && isdigit(ent->d_name[4]))
+        {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(d);
+    return node;
+}
+
+/* the CPUs this process may run on, one per physical core first and the SMT
+   siblings after them. returns the number of physical cores, 0 if unknown */
+static int cpu_slots(struct cpu_slot *slots, int *count)
+{
+    int core[CPU_SETSIZE], package[CPU_SETSIZE], primary[CPU_SETSIZE];
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int n = 0, physical = 0;
+    char path[0x60];
+
+    *count = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        core[n] = read_sys_int(path);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        package[n] = read_sys_int(path);
+
+        /* the first allowed thread of each core */
+        primary[n] = 1;
+        for (int i = 0; i < n && core[n] >= 0; i++)
+        {
+            if (primary[i] && core[i] == core[n] && package[i] == package[n])
+                primary[n] = 0;
+        }
+
+        cpus[n++] = cpu;
+    }
+
+    for (int pass = 1; pass >= 0; pass--)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (primary[i] != pass) continue;
+            slots[*count].cpu = cpus[i];
+            slots[*count].node = cpu_node(cpus[i]);
+            (*count)++;
+            physical += pass;
+        }
+    }
+
+    return physical;
+}
+
+static int pin_thread(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* run worker(arg) on jobs threads (including the calling one) and wait for all of them */
+static void run_workers(int jobs, void *(*worker)(void *), void *arg)
+{
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    int started = 0;
+
+    for (int i = 1; i < jobs; i++)
+    {
+        if (pthread_create(&threads[started], NULL, worker, arg)) break;
+        started++;
+    }
+
+    worker(arg);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+/* Live machine state published over POSIX shared memory for `lc3sim inspect`.
+   The emulator only copies its state into the region when an inspector bumps
+   `request`, so an unattached region costs one compare every SHM_POLL_MASK+1
+   instructions. Readers use `seq` as a seqlock: it is odd while a snapshot is
+   being written. */
+
+#define LC3_SHM_MAGIC 0x4c335348 /* "L3SH" */
+#define LC3_SHM_VERSION 1
+#define SHM_POLL_MASK 0xffff
+
+struct lc3_shm_state {
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint32_t request;
+    _Atomic uint32_t served;
+    _Atomic uint32_t seq;
+    uint32_t halted;
+    uint64_t instret;
+    uint64_t timestamp_ns;
+    uint16_t registers[8];
+    uint16_t pc;
+    uint16_t psr;
+    uint16_t memory[0x10000];
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* shm_open wants names of the form "/name" */
+static void shm_fix_name(const char *name, char *out, size_t size)
+{
+    snprintf(out, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+static struct lc3_shm_state *shm_create(const char *name)
+{
+    char path[0x100];
+    struct lc3_shm_state *shm;
+    int fd;
+
+    shm_fix_name(name, path, sizeof(path));
+
+    fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+
+    if (ftruncate(fd, sizeof(*shm)))
+    {
+        close(fd);
+        shm_unlink(path);
+        return NULL;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm == MAP_FAILED)
+    {
+        shm_unlink(path);
+        return NULL;
+    }
+
+    shm->version = LC3_SHM_VERSION;
+    atomic_store(&shm->seq, 0);
+    atomic_store(&shm->request, 0);
+    atomic_store(&shm->served, 0);
+    /* publish the magic last so inspectors never see a half initialized region */
+    atomic_thread_fence(memory_order_release);
+    shm->magic = LC3_SHM_MAGIC;
+
+    return shm;
+}
+
+static void shm_publish(struct lc3_shm_state *shm, const uint16_t *memory, const uint16_t *registers,
+                        uint16_t pc, uint64_t instret, int halted)
+{
+    uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+    uint32_t request = atomic_load_explicit(&shm->request, memory_order_acquire);
+
+    atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(shm->memory, memory, sizeof(shm->memory));
+    memcpy(shm->registers, registers, sizeof(shm->registers));
+    shm->pc = pc;
+    shm->psr = memory[OS_PSR];
+    shm->instret = instret;
+    shm->timestamp_ns = monotonic_ns();
+    shm->halted = halted;
+
+    atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&shm->served, request, memory_order_release);
+}
+
+static void shm_destroy(struct lc3_shm_state *shm, const char *name)
+{
+    char path[0x100];
+
+    shm_fix_name(name, path, sizeof(path));
+    munmap(shm, sizeof(*shm));
+    shm_unlink(path);
+}
+
+/* `lc3sim inspect NAME`: attach to a running emulator and show what it is doing */
+static int inspect_main(int argc, char **argv)
+{
+    const char *name = NULL;
+    unsigned interval = 500;
+    int once = 0;
+    char path[0x100];
+    struct lc3_shm_state *shm;
+    uint64_t last_instret = 0, last_ns = 0;
+    int fd;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strstr(argv[i], "--interval=") == argv[i])
+            sscanf(argv[i] + 11, "%u", &interval);
+        else if (!strcmp(argv[i], "--once"))
+            once = 1;
+        else
+            name = argv[i];
+    }
+
+    if (!name)
+    {
+        fprintf(stderr, "usage: lc3sim inspect NAME [--interval=ms] [--once]\n");
+        return 1;
+    }
+
+    shm_fix_name(name, path, sizeof(path));
+
+    /* the state is mapped read-only, only the request counter is ever written */
+    fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to attach to %s\n", path);
+        return 1;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    _Atomic uint32_t *request = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm == MAP_FAILED || request == MAP_FAILED || shm->magic != LC3_SHM_MAGIC || shm->version != LC3_SHM_VERSION)
+    {
+        fprintf(stderr, "%s is not an lc3sim state region\n", path);
+        return 1;
+    }
+
+    request = (_Atomic uint32_t *)((char *)request + offsetof(struct lc3_shm_state, request));
+
+    while (1)
+    {
+        uint16_t registers[8], window[16];
+        uint16_t pc, psr, start;
+        uint64_t instret, ns;
+        uint32_t halted, seq;
+        uint32_t want = atomic_fetch_add(request, 1) + 1;
+
+        /* give the emulator up to a second to notice the request */
+        for (int i = 0; i < 1000 && atomic_load_explicit(&shm->served, memory_order_acquire) != want; i++)
+        {
+            if (shm->halted) break;
+            usleep(1000);
+        }
+
+        do
+        {
+            while ((seq = atomic_load_explicit(&shm->seq, memory_order_acquire)) & 1);
+
+            memcpy(registers, shm->registers, sizeof(registers));
+            pc = shm->pc;
+            psr = shm->psr;
+            instret = shm->instret;
+            ns = shm->timestamp_ns;
+            halted = shm->halted;
+            start = pc - 4;
+            for (size_t i = 0; i < ARRAY_SIZE(window); i++)
+                window[i] = shm->memory[(uint16_t)(start + i)];
+
+            atomic_thread_fence(memory_order_acquire);
+        } while (atomic_load_explicit(&shm->seq, memory_order_relaxed) != seq);
+
+        if (!once)
+            printf("\e[1;1H\e[2J");
+
+        if (!ns)
+        {
+            printf("%s: waiting for the emulator...\n", path);
+        }
+        else
+        {
+            printf("%s%s\n", path, halted ? " (halted)" : "");
+            printf("instructions: %llu", (unsigned long long)instret);
+            if (last_ns && ns > last_ns)
+                printf(" (%.2f MIPS)", (instret - last_instret) * 1e3 / (ns - last_ns));
+            printf("\n");
+            dump_registers(registers, psr, pc, window[4]);
+
+            for (int i = 0; i < 12; i++)
+            {
+                char text[0x40];
+                if (!disasm_instr(window[i], text, sizeof(text)))
+                    snprintf(text, sizeof(text), ".FILL %#x", window[i]);
+                printf("%s %#06x: %s\n", (uint16_t)(start + i) == pc ? "=>" : "  ", (uint16_t)(start + i), text);
+            }
+
+            last_instret = instret;
+            last_ns = ns;
+        }
+
+        fflush(stdout);
+
+        if (once || halted) break;
+        usleep(interval * 1000);
+    }
+
+    return 0;
+}
+
+
+/* static analysis of a loaded image: control flow graphs of the program's
+   subroutines and the OS routines it calls, natural loops with simple
+   induction variable bounds and worst case instruction counts. used by
+   `lc3sim analyze` and --limit=auto */
+
+#define WCET_UNBOUNDED UINT64_MAX
+#define CFG_MAX_NODES 0x4000
+/* registers known to hold a constant at a point in the program */
+struct reg_context {
+    uint8_t known;
+    uint16_t value[8];
+};
+
+/* registers known after a node, dep marks the ones whose value (or lack of
+   one) comes from the registers at the call */
+struct const_state {
+    uint8_t known;
+    uint8_t dep;
+    uint16_t value[8];
+};
+
+struct cfg_loop {
+    int header;
+    /* innermost enclosing loop, -1 at the top level */
+    int parent;
+    /* membership of every node */
+    uint8_t *body;
+    uint16_t first;
+    uint16_t last;
+    uint64_t bound;
+    char reason[0x40];
+};
+
+/* one subroutine or trap handler */
+struct cfg {
+    uint16_t entry;
+    /* nodes in address order, the entry is node root */
+    uint16_t *addr;
+    int count;
+    int root;
+    int (*succ)[2];
+    int *pred_start;
+    int *preds;
+    /* reverse postorder from the entry */
+    int *order;
+    int *idom;
+    /* innermost loop of every node, -1 for none */
+    int *owner;
+    struct cfg_loop *loops;
+    int loop_count;
+    /* registers written by the routine or anything it calls, minus the ones it saves and restores */
+    uint8_t clobbers;
+    uint8_t summarizing;
+    /* the cost depends on the registers at the call */
+    uint8_t uses_args;
+    uint8_t busy;
+    uint8_t has_cost;
+    uint64_t cost;
+    /* constants after every node for consts_ctx, see const_pass */
+    struct const_state *consts;
+    struct reg_context consts_ctx;
+    uint8_t has_consts;
+    /* dataflow summary, see flow_summarize */
+    uint16_t reads;
+    uint16_t defines;
+    uint8_t has_flow;
+    uint8_t flowing;
+    /* why the routine has no bound whatever its arguments */
+    const char *problem;
+    uint16_t problem_addr;
+};
+
+struct analysis {
+    const uint16_t *memory;
+    /* routines by entry address */
+    struct cfg **routines;
+};
+
+static inline uint64_t sat_add(uint64_t a, uint64_t b)
+{
+    return a > WCET_UNBOUNDED - b ? WCET_UNBOUNDED : a + b;
+}
+
+static inline uint64_t sat_mul(uint64_t a, uint64_t b)
+{
+    return a && b > WCET_UNBOUNDED / a ? WCET_UNBOUNDED : a * b;
+}
+
+/* STI through the MCR pointer: the clock stops and execution ends */
+static int stops_clock(const uint16_t *memory, uint16_t addr)
+{
+    uint16_t instr = memory[addr];
+
+    return instr >> 12 == 0b1011 && memory[(uint16_t)(addr + 1 + sext9(instr & 0x1ff))] == OS_MCR;
+}
+
+/* the routine a JSR or TRAP at addr calls, -1 for JSRR and anything else */
+static int32_t call_target(const uint16_t *memory, uint16_t addr)
+{
+    uint16_t instr = memory[addr];
+
+    if (instr >> 12 == 0b0100 && (instr & (1 << 11)))
+        return (uint16_t)(addr + 1 + sext11(instr & 0x7ff));
+    if (instr >> 12 == 0b1111)
+        return memory[instr & 0xff];
+    return -1;
+}
+
+/* control flow successors within the routine, returns how many */
+static int instr_successors(const uint16_t *memory, uint16_t addr, uint16_t *succ)
+{
+    uint16_t instr = memory[addr];
+    uint16_t next = addr + 1;
+
+    if (stops_clock(memory, addr))
+        return 0;
+
+    switch (instr >> 12)
+    {
+        case 0b0000: /* BR */
+        {
+            uint16_t nzp = (instr >> 9) & 0b111;
+
+            succ[0] = next;
+            succ[1] = next + sext9(instr & 0x1ff);
+            if (nzp == 0b111) succ[0] = succ[1];
+            return nzp && nzp != 0b111 ? 2 : 1;
+        }
+        case 0b1100: /* JMP/RET */
+        case 0b1000: /* RTI */
+        case 0b1101: /* reserved */
+            return 0;
+        case 0b1111: /* TRAP */
+            if ((instr & 0xff) == 0x25) return 0;
+            /* fall through */
+        default:
+            succ[0] = next;
+            return 1;
+    }
+}
+
+/* registers written by the instruction itself */
+static uint8_t instr_writes(uint16_t instr)
+{
+    switch (instr >> 12)
+    {
+        case 0b0001: /* ADD */
+        case 0b0101: /* AND */
+        case 0b1001: /* NOT */
+        case 0b0010: /* LD */
+        case 0b0110: /* LDR */
+        case 0b1010: /* LDI */
+        case 0b1110: /* LEA */
+            return 1 << ((instr >> 9) & 0b111);
+        case 0b0100: /* JSR */
+        case 0b1111: /* TRAP */
+            return 1 << 7;
+        default:
+            return 0;
+    }
+}
+
+static int cfg_find(const struct cfg *g, uint16_t addr)
+{
+    int lo = 0, hi = g->count - 1;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (g->addr[mid] == addr) return mid;
+        if (g->addr[mid] < addr) lo = mid + 1;
+        else hi = mid - 1;
+    }
+
+    return -1;
+}
+
+static int cfg_dominates(const struct cfg *g, int a, int b)
+{
+    while (b != a && b != g->root)
+        b = g->idom[b];
+    return b == a;
+}
+
+static struct cfg *cfg_get(struct analysis *an, uint16_t entry);
+
+/* registers a call at addr may change */
+static uint8_t call_clobbers(struct analysis *an, uint16_t addr)
+{
+    int32_t target = call_target(an->memory, addr);
+    struct cfg *callee;
+
+    if (target < 0) return 0xff;
+    callee = cfg_get(an, target);
+    /* recursion, assume the worst */
+    if (callee->summarizing) return 0xff;
+    return callee->clobbers;
+}
+
+static void cfg_loops(struct cfg *g)
+{
+    /* never negative, unsigned keeps gcc from assuming a huge allocation */
+    unsigned nodes = g->count;
+    int *order = g->order = malloc(nodes * sizeof(int));
+    int *rank = malloc(nodes * sizeof(int));
+    int *stack = malloc(nodes * sizeof(int));
+    int *next = calloc(nodes, sizeof(int));
+    int *work = malloc(nodes * sizeof(int));
+    int n = g->count, sp = 0, changed = 1;
+
+    /* reverse postorder from the entry */
+    for (int i = 0; i < g->count; i++) rank[i] = -1;
+    stack[sp++] = g->root;
+    rank[g->root] = 0;
+    while (sp)
+    {
+        int v = stack[sp - 1];
+
+        if (next[v] < 2 && g->succ[v][next[v]] >= 0)
+        {
+            int s = g->succ[v][next[v]++];
+
+            if (rank[s] < 0)
+            {
+                rank[s] = 0;
+                stack[sp++] = s;
+            }
+            continue;
+        }
+
+        order[--n] = v;
+        sp--;
+    }
+
+    for (int i = 0; i < g->count; i++) rank[order[i]] = i;
+
+    /* dominators, Cooper, Harvey and Kennedy */
+    g->idom = malloc(g->count * sizeof(int));
+    for (int i = 0; i < g->count; i++) g->idom[i] = -1;
+    g->idom[g->root] = g->root;
+
+    while (changed)
+    {
+        changed = 0;
+        for (int i = 1; i < g->count; i++)
+        {
+            int v = order[i], idom = -1;
+
+            for (int j = g->pred_start[v]; j < g->pred_start[v + 1]; j++)
+            {
+                int p = g->preds[j];
+
+                if (g->idom[p] < 0) continue;
+                if (idom < 0)
+                {
+                    idom = p;
+                    continue;
+                }
+
+                while (idom != p)
+                {
+                    while (rank[idom] > rank[p]) idom = g->idom[idom];
+                    while (rank[p] > rank[idom]) p = g->idom[p];
+                }
+            }
+
+            if (g->idom[v] != idom)
+            {
+                g->idom[v] = idom;
+                changed = 1;
+            }
+        }
+    }
+
+    /* natural loops, one per header */
+    g->owner = malloc(g->count * sizeof(int));
+    for (int v = 0; v < g->count; v++)
+    {
+        g->owner[v] = -1;
+        for (int k = 0; k < 2; k++)
+        {
+            int h = g->succ[v][k], li, top = 0;
+            struct cfg_loop *l;
+
+            if (h < 0 || rank[h] > rank[v]) continue;
+
+            if (!cfg_dominates(g, h, v))
+            {
+                g->problem = "irreducible control flow";
+                g->problem_addr = g->addr[v];
+                continue;
+            }
+
+            for (li = 0; li < g->loop_count && g->loops[li].header != h; li++);
+            if (li == g->loop_count)
+            {
+                g->loops = realloc(g->loops, ++g->loop_count * sizeof(*g->loops));
+                l = &g->loops[li];
+                memset(l, 0, sizeof(*l));
+                l->header = h;
+                l->body = calloc(g->count, 1);
+                l->body[h] = 1;
+            }
+            l = &g->loops[li];
+
+            if (!l->body[v])
+            {
+                l->body[v] = 1;
+                work[top++] = v;
+            }
+            while (top)
+            {
+                int x = work[--top];
+
+                for (int j = g->pred_start[x]; j < g->pred_start[x + 1]; j++)
+                {
+                    if (l->body[g->preds[j]]) continue;
+                    l->body[g->preds[j]] = 1;
+                    work[top++] = g->preds[j];
+                }
+            }
+        }
+    }
+
+    /* nesting: the smallest loop around each node and each header */
+    for (int li = 0; li < g->loop_count; li++)
+    {
+        struct cfg_loop *l = &g->loops[li];
+        int size = 0;
+
+        l->first = 0xffff;
+        for (int v = 0; v < g->count; v++)
+        {
+            if (!l->body[v]) continue;
+            size++;
+            l->first = MIN(l->first, g->addr[v]);
+            l->last = MAX(l->last, g->addr[v]);
+        }
+        /* reuse bound for the size until the bounds are computed */
+        l->bound = size;
+    }
+
+    for (int li = 0; li < g->loop_count; li++)
+    {
+        struct cfg_loop *l = &g->loops[li];
+
+        l->parent = -1;
+        for (int o = 0; o < g->loop_count; o++)
+        {
+            if (o == li || !g->loops[o].body[l->header]) continue;
+            if (l->parent < 0 || g->loops[o].bound < g->loops[l->parent].bound)
+                l->parent = o;
+        }
+    }
+
+    for (int v = 0; v < g->count; v++)
+    {
+        for (int li = 0; li < g->loop_count; li++)
+        {
+            if (g->loops[li].body[v] && (g->owner[v] < 0 || g->loops[li].bound < g->loops[g->owner[v]].bound))
+                g->owner[v] = li;
+        }
+    }
+
+    free(rank);
+    free(stack);
+    free(next);
+    free(work);
+}
+
+static struct cfg *cfg_get(struct analysis *an, uint16_t entry)
+{
+    const uint16_t *memory = an->memory;
+    struct cfg *g = an->routines[entry];
+    uint8_t *seen;
+    uint16_t *stack;
+    int sp = 0;
+    uint8_t stored = 0, loaded = 0;
+
+    if (g) return g;
+
+    g = an->routines[entry] = calloc(1, sizeof(*g));
+    g->entry = entry;
+
+    /* everything reachable from the entry without following calls */
+    seen = calloc(0x10000, 1);
+    stack = malloc(CFG_MAX_NODES * sizeof(uint16_t));
+    seen[entry] = 1;
+    stack[sp++] = entry;
+    g->count = 1;
+    while (sp)
+    {
+        uint16_t addr = stack[--sp], succ[2];
+        int count = instr_successors(memory, addr, succ);
+
+        if (addr >= 0xfe00)
+        {
+            g->problem = "runs into device memory";
+            g->problem_addr = addr;
+            continue;
+        }
+
+        if (memory[addr] >> 12 == 0b1100 && ((memory[addr] >> 6) & 0b111) != 7)
+        {
+            g->problem = "indirect jump";
+            g->problem_addr = addr;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            if (seen[succ[i]]) continue;
+            if (g->count == CFG_MAX_NODES)
+            {
+                g->problem = "too large to analyze";
+                g->problem_addr = entry;
+                break;
+            }
+            seen[succ[i]] = 1;
+            stack[sp++] = succ[i];
+            g->count++;
+        }
+    }
+
+    g->addr = malloc(g->count * sizeof(uint16_t));
+    g->count = 0;
+    for (int addr = 0; addr < 0x10000; addr++)
+    {
+        if (seen[addr]) g->addr[g->count++] = addr;
+    }
+    free(seen);
+    free(stack);
+
+    g->root = cfg_find(g, entry);
+    g->succ = malloc(g->count * sizeof(*g->succ));
+    g->pred_start = calloc(g->count + 1, sizeof(int));
+    for (int v = 0; v < g->count; v++)
+    {
+        uint16_t succ[2];
+        int count = g->addr[v] >= 0xfe00 ? 0 : instr_successors(memory, g->addr[v], succ);
+
+        g->succ[v][0] = g->succ[v][1] = -1;
+        for (int i = 0; i < count; i++)
+        {
+            g->succ[v][i] = cfg_find(g, succ[i]);
+            g->pred_start[g->succ[v][i] + 1]++;
+        }
+        /* BR to the next instruction */
+        if (count == 2 && g->succ[v][0] == g->succ[v][1])
+        {
+            g->succ[v][1] = -1;
+            g->pred_start[g->succ[v][0] + 1]--;
+        }
+    }
+
+    for (int v = 0; v < g->count; v++)
+        g->pred_start[v + 1] += g->pred_start[v];
+    g->preds = malloc(MAX(g->pred_start[g->count], 1) * sizeof(int));
+    {
+        int *fill = malloc(g->count * sizeof(int));
+
+        memcpy(fill, g->pred_start, g->count * sizeof(int));
+        for (int v = 0; v < g->count; v++)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                if (g->succ[v][i] >= 0)
+                    g->preds[fill[g->succ[v][i]]++] = v;
+            }
+        }
+        free(fill);
+    }
+
+    cfg_loops(g);
+
+    /* register summary, a register both stored and loaded is taken as saved */
+    g->summarizing = 1;
+    for (int v = 0; v < g->count; v++)
+    {
+        uint16_t instr = memory[g->addr[v]];
+        uint8_t op = instr >> 12;
+
+        g->clobbers |= instr_writes(instr);
+        if (op == 0b0011 || op == 0b0111 || op == 0b1011) stored |= 1 << ((instr >> 9) & 0b111);
+        if (op == 0b0010 || op == 0b0110 || op == 0b1010) loaded |= 1 << ((instr >> 9) & 0b111);
+        if (op == 0b0100 || (op == 0b1111 && (instr & 0xff) != 0x25))
+            g->clobbers |= call_clobbers(an, g->addr[v]);
+    }
+    g->clobbers &= ~(stored & loaded);
+    g->summarizing = 0;
+
+    return g;
+}
+
+/* state right before node v: the entry gets the registers at the call
+   (nothing if it is also a loop header), a node with one predecessor what
+   that left and anything else nothing. the one predecessor always comes
+   first in reverse postorder */
+static struct const_state const_in(const struct cfg *g, const struct reg_context *ctx, int v)
+{
+    struct const_state in = {0};
+    int count = g->pred_start[v + 1] - g->pred_start[v];
+
+    if (v == g->root)
+    {
+        if (count) return in;
+        in.known = ctx->known;
+        in.dep = 0xff;
+        memcpy(in.value, ctx->value, sizeof(in.value));
+    }
+    else if (count == 1)
+    {
+        in = g->consts[g->preds[g->pred_start[v]]];
+    }
+
+    return in;
+}
+
+static void const_transfer(struct analysis *an, uint16_t addr, struct const_state *st)
+{
+    uint16_t instr = an->memory[addr];
+    int dr = (instr >> 9) & 0b111, sr1 = (instr >> 6) & 0b111, sr2 = instr & 0b111;
+    int known = 0, dep = 0;
+    uint16_t value = 0;
+
+    switch (instr >> 12)
+    {
+        case 0b0001: /* ADD */
+        case 0b0101: /* AND */
+        {
+            int b_known = 1;
+            uint16_t b = (uint16_t)sext5(instr & 0x1f);
+
+            if (!(instr & (1 << 5)))
+            {
+                b_known = st->known >> sr2 & 1;
+                b = st->value[sr2];
+                dep = st->dep & (1 << sr2) ? 1 : 0;
+            }
+
+            /* AND with 0 needs no source */
+            if (b_known && instr >> 12 == 0b0101 && !b)
+                known = 1;
+            else if (b_known)
+            {
+                known = st->known >> sr1 & 1;
+                dep |= st->dep >> sr1 & 1;
+                value = instr >> 12 == 0b0001 ? st->value[sr1] + b : st->value[sr1] & b;
+            }
+            break;
+        }
+        case 0b1001: /* NOT */
+            known = st->known >> sr1 & 1;
+            dep = st->dep >> sr1 & 1;
+            value = ~st->value[sr1];
+            break;
+        case 0b0010: /* LD, taken from the image */
+            known = 1;
+            value = an->memory[(uint16_t)(addr + 1 + sext9(instr & 0x1ff))];
+            break;
+        case 0b1110: /* LEA */
+            known = 1;
+            value = addr + 1 + sext9(instr & 0x1ff);
+            break;
+        case 0b0110: /* LDR */
+        case 0b1010: /* LDI */
+            break;
+        case 0b0100: /* JSR */
+        case 0b1111: /* TRAP */
+        {
+            uint8_t lost = (1 << 7) | call_clobbers(an, addr);
+
+            st->known &= ~lost;
+            st->dep &= ~lost;
+            return;
+        }
+        default:
+            return;
+    }
+
+    st->known = (st->known & ~(1 << dr)) | known << dr;
+    st->dep = (st->dep & ~(1 << dr)) | dep << dr;
+    st->value[dr] = value;
+}
+
+/* constants after every node of g for the registers in ctx, one forward
+   pass in reverse postorder, kept until the next context */
+static void const_pass(struct analysis *an, struct cfg *g, const struct reg_context *ctx)
+{
+    int same = g->has_consts && g->consts_ctx.known == ctx->known;
+
+    for (int r = 0; r < 8 && same; r++)
+        same = !(ctx->known & (1 << r)) || g->consts_ctx.value[r] == ctx->value[r];
+    if (same) return;
+
+    if (!g->consts)
+        g->consts = malloc(g->count * sizeof(*g->consts));
+
+    for (int i = 0; i < g->count; i++)
+    {
+        int v = g->order[i];
+
+        g->consts[v] = const_in(g, ctx, v);
+        const_transfer(an, g->addr[v], &g->consts[v]);
+    }
+
+    g->consts_ctx = *ctx;
+    g->has_consts = 1;
+}
+
+/* value of reg right before node v executes, -1 if it is not a known constant */
+static int32_t const_before(struct analysis *an, struct cfg *g, const struct reg_context *ctx, int v, int reg)
+{
+    struct const_state in;
+
+    const_pass(an, g, ctx);
+    in = const_in(g, ctx, v);
+    if (in.dep & (1 << reg)) g->uses_args = 1;
+    return in.known & (1 << reg) ? in.value[reg] : -1;
+}
+
+/* value of reg right after node v executes */
+static int32_t const_after(struct analysis *an, struct cfg *g, const struct reg_context *ctx, int v, int reg)
+{
+    const struct const_state *out;
+
+    const_pass(an, g, ctx);
+    out = &g->consts[v];
+    if (out->dep & (1 << reg)) g->uses_args = 1;
+    return out->known & (1 << reg) ? out->value[reg] : -1;
+}
+
+/* iterations of a loop polling a device register until it is ready */
+static uint64_t device_poll_bound(uint16_t reg)
+{
+    switch (reg)
+    {
+        /* the display is always ready and input is assumed to be there */
+        case OS_KBSR:
+        case OS_DSR:
+            return 1;
+        case DMA_CR:
+            return DMA_SETUP + 0x10000 / DMA_WORDS_PER_INSTR + 1;
+        case DSK_CR:
+            return DSK_LATENCY + 1;
+        default:
+            return WCET_UNBOUNDED;
+    }
+}
+
+/* iterations of loop li until the conditional branch at node v leaves it, stay
+   holds the condition codes that keep it in the loop */
+static uint64_t exit_bound(struct analysis *an, struct cfg *g, const struct reg_context *ctx, int li,
+                           int v, int stay, char *reason, size_t size)
+{
+    const uint16_t *memory = an->memory;
+    struct cfg_loop *l = &g->loops[li];
+    int p, counter, update = -1, sentinel = 0, after, top = 0, outside = -1;
+    int16_t offset = 0, step;
+    int32_t init;
+    uint16_t instr;
+
+    snprintf(reason, size, "no induction variable");
+
+    /* the instruction setting the condition codes */
+    if (g->pred_start[v + 1] - g->pred_start[v] != 1)
+        return WCET_UNBOUNDED;
+    p = g->preds[g->pred_start[v]];
+    instr = memory[g->addr[p]];
+
+    switch (instr >> 12)
+    {
+        case 0b1010: /* LDI of a device register */
+        {
+            uint16_t reg = memory[(uint16_t)(g->addr[p] + 1 + sext9(instr & 0x1ff))];
+
+            if (reg < 0xfe00) return WCET_UNBOUNDED;
+            snprintf(reason, size, "polls x%04X", reg);
+            return device_poll_bound(reg);
+        }
+        case 0b0001: /* ADD R,R,#imm or a copy with ADD R,S,#0 */
+            if (!(instr & (1 << 5))) return WCET_UNBOUNDED;
+            counter = (instr >> 6) & 0b111;
+            if (sext5(instr & 0x1f) && counter != ((instr >> 9) & 0b111)) return WCET_UNBOUNDED;
+            break;
+        case 0b0101: /* AND R,S,S */
+            if (instr & (1 << 5) || (instr & 0b111) != ((instr >> 6) & 0b111)) return WCET_UNBOUNDED;
+            counter = instr & 0b111;
+            break;
+        case 0b0110: /* LDR of a sentinel through a moving pointer */
+            counter = (instr >> 6) & 0b111;
+            offset = sext6(instr & 0x3f);
+            sentinel = 1;
+            break;
+        default:
+            return WCET_UNBOUNDED;
+    }
+
+    /* the counter changes by one ADD per iteration and nowhere else */
+    for (int x = 0; x < g->count; x++)
+    {
+        uint16_t w = memory[g->addr[x]];
+        uint8_t writes = instr_writes(w);
+
+        if (!l->body[x]) continue;
+        if (w >> 12 == 0b0100 || w >> 12 == 0b1111) writes |= call_clobbers(an, g->addr[x]);
+        if (!(writes & (1 << counter))) continue;
+
+        /* copies of itself */
+        if ((w & 0xf03f) == 0x1020 && ((w >> 6) & 0b111) == counter) continue;
+        if ((w & 0xf038) == 0x5000 && ((w >> 6) & 0b111) == counter && (w & 0b111) == counter) continue;
+
+        if (update < 0 && (w & 0xf020) == 0x1020 && ((w >> 6) & 0b111) == counter)
+        {
+            update = x;
+            continue;
+        }
+
+        snprintf(reason, size, "R%d changes more than once", counter);
+        return WCET_UNBOUNDED;
+    }
+
+    if (update < 0 || g->owner[update] != li)
+    {
+        snprintf(reason, size, update < 0 ? "R%d does not change" : "R%d changes in an inner loop", counter);
+        return WCET_UNBOUNDED;
+    }
+
+    for (int j = g->pred_start[l->header]; j < g->pred_start[l->header + 1]; j++)
+    {
+        int x = g->preds[j];
+
+        if (l->body[x] && !cfg_dominates(g, update, x))
+        {
+            snprintf(reason, size, "R%d is not updated on every iteration", counter);
+            return WCET_UNBOUNDED;
+        }
+        if (!l->body[x]) outside = outside == -1 ? x : -2;
+    }
+
+    /* value on entry: from the one way into the loop, or the arguments */
+    if (outside >= 0)
+        init = const_after(an, g, ctx, outside, counter);
+    else if (outside == -1 && l->header == g->root)
+    {
+        g->uses_args = 1;
+        init = ctx->known & (1 << counter) ? ctx->value[counter] : -1;
+    }
+    else
+        init = -1;
+
+    if (init < 0)
+    {
+        snprintf(reason, size, "R%d is unknown on entry", counter);
+        return WCET_UNBOUNDED;
+    }
+
+    /* is the test before the update in an iteration? */
+    after = 1;
+    if (p != update)
+    {
+        uint8_t *visited = calloc(g->count, 1);
+        int *work = malloc(g->count * sizeof(int));
+
+        work[top++] = l->header;
+        visited[l->header] = 1;
+        while (top)
+        {
+            int x = work[--top];
+
+            if (x == p) after = 0;
+            if (x == update) continue;
+
+            for (int k = 0; k < 2; k++)
+            {
+                int s = g->succ[x][k];
+
+                if (s < 0 || !l->body[s] || visited[s]) continue;
+                visited[s] = 1;
+                work[top++] = s;
+            }
+        }
+
+        free(visited);
+        free(work);
+    }
+
+    step = sext5(memory[g->addr[update]] & 0x1f);
+    for (uint32_t i = 0; i <= 0x10000; i++)
+    {
+        uint16_t value = init + (i + after) * step;
+        int16_t test = sentinel ? memory[(uint16_t)(value + offset)] : value;
+        int cc = test < 0 ? 0b100 : test ? 0b001 : 0b010;
+
+        if (!(cc & stay))
+        {
+            if (sentinel)
+                snprintf(reason, size, "R%d scans from x%04X", counter, init);
+            else
+                snprintf(reason, size, "R%d from %d by %d", counter, (int16_t)init, step);
+            return i + 1;
+        }
+    }
+
+    snprintf(reason, size, "R%d never reaches the exit", counter);
+    return WCET_UNBOUNDED;
+}
+
+static void loop_bound(struct analysis *an, struct cfg *g, const struct reg_context *ctx, int li)
+{
+    struct cfg_loop *l = &g->loops[li];
+    int exits = 0;
+
+    l->bound = WCET_UNBOUNDED;
+    snprintf(l->reason, sizeof(l->reason), "no exit");
+
+    for (int v = 0; v < g->count; v++)
+    {
+        uint16_t instr = g->addr[v] < 0xfe00 ? an->memory[g->addr[v]] : 0;
+        int nzp = (instr >> 9) & 0b111;
+        char reason[sizeof(l->reason)];
+        uint64_t bound;
+
+        if (!l->body[v] || g->owner[v] != li || instr >> 12 || !nzp || nzp == 0b111) continue;
+        if (g->succ[v][1] < 0 || l->body[g->succ[v][0]] == l->body[g->succ[v][1]]) continue;
+
+        bound = exit_bound(an, g, ctx, li, v, l->body[g->succ[v][1]] ? nzp : ~nzp & 0b111, reason, sizeof(reason));
+        if (bound < l->bound || !exits++)
+        {
+            l->bound = bound;
+            strcpy(l->reason, reason);
+        }
+    }
+}
+
+static uint64_t routine_cost(struct analysis *an, struct cfg *g, const struct reg_context *ctx);
+
+struct cost_walk {
+    struct analysis *an;
+    struct cfg *g;
+    const struct reg_context *ctx;
+    uint64_t *memo;
+    uint8_t *state;
+    uint64_t *loop_memo;
+    uint8_t *loop_state;
+};
+
+/* the instruction at v plus whatever it calls */
+static uint64_t node_cost(struct cost_walk *w, int v)
+{
+    struct cfg *g = w->g;
+    uint16_t addr = g->addr[v];
+    uint16_t instr = w->an->memory[addr];
+    struct reg_context call = {0};
+    int32_t target;
+
+    if (instr >> 12 == 0b1100 && ((instr >> 6) & 0b111) != 7)
+        return WCET_UNBOUNDED;
+    if (instr >> 12 != 0b0100 && instr >> 12 != 0b1111)
+        return 1;
+    if ((target = call_target(w->an->memory, addr)) < 0)
+        return WCET_UNBOUNDED;
+
+    for (int r = 0; r < 8; r++)
+    {
+        int32_t value = const_before(w->an, g, w->ctx, v, r);
+
+        if (value < 0) continue;
+        call.known |= 1 << r;
+        call.value[r] = value;
+    }
+
+    return sat_add(1, routine_cost(w->an, cfg_get(w->an, target), &call));
+}
+
+static uint64_t path_cost(struct cost_walk *w, int region, int v);
+
+static int in_region(const struct cfg *g, int region, int v)
+{
+    return region < 0 || (g->loops[region].body[v] && v != g->loops[region].header);
+}
+
+/* longest path from node v to the end of region (a loop, -1 for the whole routine),
+   loops nested inside region count as one node */
+static uint64_t path_cost(struct cost_walk *w, int region, int v)
+{
+    struct cfg *g = w->g;
+    int child = g->owner[v];
+    uint64_t best = 0, cost;
+
+    while (child >= 0 && child != region && g->loops[child].parent != region)
+        child = g->loops[child].parent;
+
+    if (child >= 0 && child != region)
+    {
+        struct cfg_loop *l = &g->loops[child];
+
+        if (l->header != v) return WCET_UNBOUNDED;
+        if (w->loop_state[child] == 2) return w->loop_memo[child];
+        if (w->loop_state[child] == 1) return WCET_UNBOUNDED;
+        w->loop_state[child] = 1;
+
+        for (int x = 0; x < g->count; x++)
+        {
+            for (int k = 0; l->body[x] && k < 2; k++)
+            {
+                int s = g->succ[x][k];
+
+                if (s >= 0 && !l->body[s] && in_region(g, region, s))
+                    best = MAX(best, path_cost(w, region, s));
+            }
+        }
+
+        cost = sat_add(sat_mul(l->bound, path_cost(w, child, v)), best);
+        w->loop_memo[child] = cost;
+        w->loop_state[child] = 2;
+        return cost;
+    }
+
+    if (w->state[v] == 2) return w->memo[v];
+    if (w->state[v] == 1) return WCET_UNBOUNDED;
+    w->state[v] = 1;
+
+    for (int k = 0; k < 2; k++)
+    {
+        int s = g->succ[v][k];
+
+        if (s >= 0 && in_region(g, region, s))
+            best = MAX(best, path_cost(w, region, s));
+    }
+
+    cost = sat_add(node_cost(w, v), best);
+    w->memo[v] = cost;
+    w->state[v] = 2;
+    return cost;
+}
+
+/* worst case instructions from the entry of g to its return, given the registers at the call */
+static uint64_t routine_cost(struct analysis *an, struct cfg *g, const struct reg_context *ctx)
+{
+    struct cost_walk w = { .an = an, .g = g, .ctx = ctx };
+    uint64_t cost;
+
+    if (g->has_cost) return g->cost;
+    /* recursion */
+    if (g->busy) return WCET_UNBOUNDED;
+    if (g->problem) return WCET_UNBOUNDED;
+
+    g->busy = 1;
+    g->uses_args = 0;
+
+    for (int li = 0; li < g->loop_count; li++)
+        loop_bound(an, g, ctx, li);
+
+    w.memo = malloc(g->count * sizeof(uint64_t));
+    w.state = calloc(g->count, 1);
+    w.loop_memo = malloc(MAX(g->loop_count, 1) * sizeof(uint64_t));
+    w.loop_state = calloc(MAX(g->loop_count, 1), 1);
+
+    cost = path_cost(&w, -1, g->root);
+
+    free(w.memo);
+    free(w.state);
+    free(w.loop_memo);
+    free(w.loop_state);
+
+    g->busy = 0;
+    if (!g->uses_args)
+    {
+        g->has_cost = 1;
+        g->cost = cost;
+    }
+
+    return cost;
+}
+
+static void analysis_init(struct analysis *an, const uint16_t *memory)
+{
+    an->memory = memory;
+    an->routines = calloc(0x10000, sizeof(*an->routines));
+}
+
+static void analysis_free(struct analysis *an)
+{
+    for (int i = 0; i < 0x10000; i++)
+    {
+        struct cfg *g = an->routines[i];
+
+        if (!g) continue;
+        for (int li = 0; li < g->loop_count; li++)
+            free(g->loops[li].body);
+        free(g->loops);
+        free(g->addr);
+        free(g->succ);
+        free(g->pred_start);
+        free(g->preds);
+        free(g->idom);
+        free(g->order);
+        free(g->consts);
+        free(g->owner);
+        free(g);
+    }
+
+    free(an->routines);
+}
+
+/* worst case instructions from boot to halt of a booted image, 0 if there is
+   no static bound. interrupt and exception handlers are not counted */
+static uint64_t static_limit(const uint16_t *memory, uint16_t user_pc)
+{
+    struct analysis an;
+    struct reg_context none = {0};
+    uint64_t cost;
+
+    analysis_init(&an, memory);
+    cost = sat_add(routine_cost(&an, cfg_get(&an, OS_START), &none), routine_cost(&an, cfg_get(&an, user_pc), &none));
+    analysis_free(&an);
+
+    return cost == WCET_UNBOUNDED ? 0 : cost;
+}
+
+
+/* registers are bits 0-7 of a dataflow set and the condition codes bit 8 */
+#define FLOW_CC (1 << 8)
+#define FLOW_ALL 0x1ff
+
+/* values an instruction reads. saving a register with a store is not counted,
+   neither is clearing one with AND R,R,#0 */
+static uint16_t flow_uses(uint16_t instr)
+{
+    int sr1 = (instr >> 6) & 0b111;
+
+    switch (instr >> 12)
+    {
+        case 0b0001: /* ADD */
+        case 0b0101: /* AND */
+            if (!(instr & (1 << 5)))
+                return 1 << sr1 | 1 << (instr & 0b111);
+            if (instr >> 12 == 0b0101 && !(instr & 0x1f))
+                return 0;
+            return 1 << sr1;
+        case 0b1001: /* NOT */
+        case 0b0110: /* LDR */
+        case 0b0111: /* STR, the base register */
+        case 0b1100: /* JMP */
+            return 1 << sr1;
+        case 0b0100: /* JSRR */
+            return instr & (1 << 11) ? 0 : 1 << sr1;
+        case 0b0000: /* BR */
+        {
+            uint16_t nzp = (instr >> 9) & 0b111;
+            return nzp && nzp != 0b111 ? FLOW_CC : 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+/* values an instruction sets, calls aside */
+static uint16_t flow_defs(uint16_t instr)
+{
+    uint16_t writes = instr_writes(instr);
+
+    switch (instr >> 12)
+    {
+        case 0b0001: /* ADD */
+        case 0b0101: /* AND */
+        case 0b1001: /* NOT */
+        case 0b0010: /* LD */
+        case 0b0110: /* LDR */
+        case 0b1010: /* LDI */
+        case 0b1110: /* LEA */
+            return writes | FLOW_CC;
+        default:
+            return writes;
+    }
+}
+
+static void flow_summarize(struct analysis *an, struct cfg *g);
+
+/* values read by the instruction at node v, including what a call reads */
+static uint16_t flow_node_uses(struct analysis *an, struct cfg *g, int v)
+{
+    uint16_t instr = an->memory[g->addr[v]];
+    int32_t target = call_target(an->memory, g->addr[v]);
+    struct cfg *callee;
+
+    if ((instr >> 12 != 0b0100 && instr >> 12 != 0b1111) || target < 0)
+        return flow_uses(instr);
+
+    callee = cfg_get(an, target);
+    flow_summarize(an, callee);
+
+    /* the call sets R7, a trap from user mode also switches R6 to the system stack */
+    if (instr >> 12 == 0b1111)
+        return callee->reads & ~(1 << 6 | 1 << 7);
+    return callee->reads & ~(1 << 7);
+}
+
+static uint16_t flow_transfer(struct analysis *an, struct cfg *g, int v, uint16_t in)
+{
+    uint16_t instr = an->memory[g->addr[v]];
+    int32_t target = call_target(an->memory, g->addr[v]);
+    struct cfg *callee;
+
+    if ((instr >> 12 != 0b0100 && instr >> 12 != 0b1111) || target < 0)
+        return in & ~flow_defs(instr);
+
+    callee = cfg_get(an, target);
+    flow_summarize(an, callee);
+
+    /* RTI restores the condition codes of the caller */
+    if (instr >> 12 == 0b1111)
+        return in & ~(callee->defines & ~FLOW_CC) & ~(1 << 7);
+    return in & ~callee->defines & ~(1 << 7);
+}
+
+/* values that may still be uninitialized before every node of g when nothing
+   is set at its entry */
+static uint16_t *flow_undefined(struct analysis *an, struct cfg *g)
+{
+    uint16_t *in = calloc(g->count, sizeof(uint16_t));
+    uint8_t *queued = malloc(g->count);
+    int *work = malloc(g->count * sizeof(int));
+    int top = 0;
+
+    in[g->root] = FLOW_ALL;
+    for (int v = g->count - 1; v >= 0; v--)
+    {
+        work[top++] = v;
+        queued[v] = 1;
+    }
+
+    while (top)
+    {
+        int v = work[--top];
+        uint16_t out;
+
+        queued[v] = 0;
+        out = flow_transfer(an, g, v, in[v]);
+
+        for (int k = 0; k < 2; k++)
+        {
+            int s = g->succ[v][k];
+
+            if (s < 0 || (in[s] | out) == in[s]) continue;
+            in[s] |= out;
+            if (!queued[s])
+            {
+                queued[s] = 1;
+                work[top++] = s;
+            }
+        }
+    }
+
+    free(queued);
+    free(work);
+    return in;
+}
+
+/* summary of a routine for its callers: what it reads before setting it and
+   what it sets on every path to its return. a register both stored and loaded
+   is taken as saved and restored rather than set */
+static void flow_summarize(struct analysis *an, struct cfg *g)
+{
+    uint16_t *in;
+    uint16_t undefined = 0;
+    uint8_t stored = 0, loaded = 0;
+    int returns = 0;
+
+    if (g->has_flow || g->flowing) return;
+    g->flowing = 1;
+
+    in = flow_undefined(an, g);
+    for (int v = 0; v < g->count; v++)
+    {
+        uint16_t instr = an->memory[g->addr[v]];
+        uint8_t op = instr >> 12;
+
+        g->reads |= flow_node_uses(an, g, v) & in[v];
+
+        if (op == 0b0011 || op == 0b0111 || op == 0b1011) stored |= 1 << ((instr >> 9) & 0b111);
+        if (op == 0b0010 || op == 0b0110 || op == 0b1010) loaded |= 1 << ((instr >> 9) & 0b111);
+
+        if (op == 0b1000 || (op == 0b1100 && ((instr >> 6) & 0b111) == 7))
+        {
+            undefined |= in[v];
+            returns = 1;
+        }
+    }
+
+    g->defines = returns ? ~undefined & FLOW_ALL & ~(stored & loaded) : 0;
+    free(in);
+
+    g->flowing = 0;
+    g->has_flow = 1;
+}
+
+/* print the reads of registers and condition codes that may happen before
+   they are set on some path from the entry of the program, returns how many */
+static int lint_program(const uint16_t *memory, uint16_t entry, FILE *out)
+{
+    struct analysis an;
+    struct cfg *g;
+    uint16_t *in;
+    int count = 0;
+
+    analysis_init(&an, memory);
+    g = cfg_get(&an, entry);
+    in = flow_undefined(&an, g);
+
+    for (int v = 0; v < g->count; v++)
+    {
+        uint16_t bad = flow_node_uses(&an, g, v) & in[v];
+        uint16_t instr = memory[g->addr[v]];
+        char text[0x40];
+        int n = 0;
+
+        if (!bad) continue;
+
+        disasm_instr(instr, text, sizeof(text));
+        fprintf(out, "x%04X: %s: may read uninitialized", g->addr[v], text);
+        for (int r = 0; r < 9; r++)
+        {
+            if (!(bad & (1 << r))) continue;
+            if (r < 8)
+                fprintf(out, "%s R%d", n++ ? "," : "", r);
+            else
+                fprintf(out, "%s condition codes", n++ ? "," : "");
+        }
+        if (instr >> 12 == 0b0100 || instr >> 12 == 0b1111)
+            fprintf(out, " (read by the callee)");
+        fprintf(out, "\n");
+        count++;
+    }
+
+    free(in);
+    analysis_free(&an);
+    return count;
+}
+
+
+/* the program and every subroutine it reaches through JSR, returns how many */
+static int collect_routines(struct analysis *an, uint16_t entry, uint16_t *routines, int max)
+{
+    int count = 0;
+
+    routines[count++] = entry;
+    for (int r = 0; r < count; r++)
+    {
+        struct cfg *g = cfg_get(an, routines[r]);
+
+        for (int v = 0; v < g->count; v++)
+        {
+            int32_t target = call_target(an->memory, g->addr[v]);
+            int known = 0;
+
+            if (an->memory[g->addr[v]] >> 12 != 0b0100 || target < 0) continue;
+            for (int i = 0; i < count; i++) known |= routines[i] == target;
+            if (!known && count < max) routines[count++] = target;
+        }
+    }
+
+    return count;
+}
+
+/* one peephole suggestion for --advise */
+struct advice {
+    uint16_t addr;
+    /* instructions it would have saved in the profiled run */
+    uint64_t saved;
+    char text[0x80];
+};
+
+static int advice_cmp(const void *a, const void *b)
+{
+    const struct advice *x = a, *y = b;
+
+    if (x->saved != y->saved) return x->saved < y->saved ? 1 : -1;
+    return x->addr - y->addr;
+}
+
+/* the only predecessor of node v, -1 if there are several */
+static int cfg_single_pred(const struct cfg *g, int v)
+{
+    return g->pred_start[v + 1] - g->pred_start[v] == 1 ? g->preds[g->pred_start[v]] : -1;
+}
+
+/* instr sets the condition codes from the value it leaves in reg */
+static int sets_cc_from(uint16_t instr, int reg)
+{
+    return (flow_defs(instr) & FLOW_CC) && ((instr >> 9) & 0b111) == reg;
+}
+
+/* address accessed by LD/ST at addr */
+static uint16_t pc_relative(const uint16_t *memory, uint16_t addr)
+{
+    return addr + 1 + sext9(memory[addr] & 0x1ff);
+}
+
+static int is_cond_branch(uint16_t instr)
+{
+    return !(instr >> 12) && (instr & 0x0e00) && (instr & 0x0e00) != 0x0e00;
+}
+
+/* a load at node v of loop li that reads the same word every iteration */
+static int loop_invariant_load(struct analysis *an, struct cfg *g, int li, int v)
+{
+    const uint16_t *memory = an->memory;
+    struct cfg_loop *l = &g->loops[li];
+    uint16_t source = pc_relative(memory, g->addr[v]);
+    int reg = (memory[g->addr[v]] >> 9) & 0b111;
+
+    for (int x = 0; x < g->count; x++)
+    {
+        uint16_t instr = memory[g->addr[x]];
+        uint8_t op = instr >> 12;
+
+        if (!l->body[x] || x == v) continue;
+        /* a store that may hit the word or a subroutine that may */
+        if (op == 0b0111 || op == 0b1011 || op == 0b0100) return 0;
+        if (op == 0b0011 && pc_relative(memory, g->addr[x]) == source) return 0;
+        if ((instr_writes(instr) | (op == 0b1111 ? call_clobbers(an, g->addr[x]) : 0)) & (1 << reg)) return 0;
+    }
+
+    return 1;
+}
+
+static void advise_routine(struct analysis *an, struct cfg *g, const uint32_t *profile,
+                           struct advice **list, int *count, int *capacity)
+{
+    const uint16_t *memory = an->memory;
+
+    for (int v = 0; v < g->count; v++)
+    {
+        uint16_t addr = g->addr[v];
+        uint16_t instr = memory[addr];
+        int dr = (instr >> 9) & 0b111, sr1 = (instr >> 6) & 0b111;
+        int p = cfg_single_pred(g, v);
+        uint16_t prev = p >= 0 ? memory[g->addr[p]] : 0;
+        uint64_t saved = profile[addr];
+        char text[0x80] = "";
+
+        /* ADD R,R,#0 or AND R,R,R right after R was set */
+        if (p >= 0 && (((instr & 0xf03f) == 0x1020 && dr == sr1) || ((instr & 0xf038) == 0x5000 && dr == sr1 && (instr & 0b111) == dr))
+            && sets_cc_from(prev, dr))
+        {
+            if ((prev & 0xf03f) == 0x5020)
+                snprintf(text, sizeof(text), "R%d was just cleared, this does nothing", dr);
+            else
+                snprintf(text, sizeof(text), "the condition codes already reflect R%d, remove this", dr);
+        }
+        /* ADD R,R,#a; ADD R,R,#b */
+        else if (p >= 0 && (instr & 0xf020) == 0x1020 && dr == sr1 && (prev & 0xf020) == 0x1020
+                 && ((prev >> 9) & 0b111) == dr && ((prev >> 6) & 0b111) == dr
+                 && sext5(prev & 0x1f) + sext5(instr & 0x1f) >= -16 && sext5(prev & 0x1f) + sext5(instr & 0x1f) <= 15
+                 && sext5(instr & 0x1f))
+        {
+            snprintf(text, sizeof(text), "merge into the ADD before it as R%d = R%d + %d", dr, dr,
+                     sext5(prev & 0x1f) + sext5(instr & 0x1f));
+        }
+        /* AND R,X,#0 twice */
+        else if (p >= 0 && (instr & 0xf03f) == 0x5020 && (prev & 0xf03f) == 0x5020 && ((prev >> 9) & 0b111) == dr)
+        {
+            snprintf(text, sizeof(text), "R%d is already clear", dr);
+        }
+        /* ST R,L; LD R,L */
+        else if (p >= 0 && instr >> 12 == 0b0010 && prev >> 12 == 0b0011 && ((prev >> 9) & 0b111) == dr
+                 && pc_relative(memory, g->addr[p]) == pc_relative(memory, addr) && !is_cond_branch(memory[(uint16_t)(addr + 1)]))
+        {
+            snprintf(text, sizeof(text), "R%d still holds the value just stored to x%04X", dr, pc_relative(memory, addr));
+        }
+        /* BR to the next instruction */
+        else if (is_cond_branch(instr) || (!(instr >> 12) && (instr & 0x0e00)))
+        {
+            uint16_t target = addr + 1 + sext9(instr & 0x1ff);
+            uint16_t next = memory[(uint16_t)(addr + 1)];
+            int n = cfg_find(g, addr + 1), t = cfg_find(g, target);
+
+            if (target == (uint16_t)(addr + 1))
+                snprintf(text, sizeof(text), "branches to the next instruction, remove it");
+            /* BRx over BRnzp */
+            else if (is_cond_branch(instr) && target == (uint16_t)(addr + 2) && (next & 0xfe00) == 0x0e00
+                     && n >= 0 && cfg_single_pred(g, n) == v)
+            {
+                snprintf(text, sizeof(text), "branch over a branch, use BR%s%s%s to x%04X instead",
+                         instr & 0x0800 ? "" : "n", instr & 0x0400 ? "" : "z", instr & 0x0200 ? "" : "p",
+                         (uint16_t)(addr + 2 + sext9(next & 0x1ff)));
+                saved = profile[(uint16_t)(addr + 1)];
+            }
+            /* BR to a BRnzp */
+            else if ((memory[target] & 0xfe00) == 0x0e00 && target != addr && t >= 0 && cfg_single_pred(g, t) == v)
+            {
+                snprintf(text, sizeof(text), "branches to a branch, go straight to x%04X",
+                         (uint16_t)(target + 1 + sext9(memory[target] & 0x1ff)));
+                saved = profile[target];
+            }
+        }
+        /* LD of a word the loop never changes */
+        else if (instr >> 12 == 0b0010 && g->owner[v] >= 0 && !is_cond_branch(memory[(uint16_t)(addr + 1)])
+                 && loop_invariant_load(an, g, g->owner[v], v))
+        {
+            struct cfg_loop *l = &g->loops[g->owner[v]];
+            uint64_t entries = 0;
+
+            for (int j = g->pred_start[l->header]; j < g->pred_start[l->header + 1]; j++)
+            {
+                if (!l->body[g->preds[j]])
+                    entries += profile[g->addr[g->preds[j]]];
+            }
+
+            snprintf(text, sizeof(text), "loads the same x%04X every iteration, load it once before the loop at x%04X",
+                     pc_relative(memory, addr), g->addr[l->header]);
+            saved = saved > entries ? saved - entries : 0;
+        }
+
+        if (!text[0]) continue;
+
+        if (*count == *capacity)
+        {
+            *capacity = *capacity ? *capacity * 2 : 0x20;
+            *list = realloc(*list, *capacity * sizeof(**list));
+        }
+        (*list)[*count].addr = addr;
+        (*list)[*count].saved = saved;
+        strcpy((*list)[*count].text, text);
+        (*count)++;
+    }
+}
+
+/* peephole suggestions for the program's own code, ranked by the
+   instructions they would have saved in the run recorded in profile
+   (executions per address). the caller frees the list */
+static struct advice *advise_collect(const uint16_t *memory, uint16_t entry, const uint32_t *profile, int *count)
+{
+    struct analysis an;
+    struct advice *list = NULL;
+    uint16_t routines[0x100];
+    int routine_count, capacity = 0;
+
+    *count = 0;
+    analysis_init(&an, memory);
+    routine_count = collect_routines(&an, entry, routines, ARRAY_SIZE(routines));
+    for (int r = 0; r < routine_count; r++)
+        advise_routine(&an, cfg_get(&an, routines[r]), profile, &list, count, &capacity);
+    analysis_free(&an);
+
+    qsort(list, *count, sizeof(*list), advice_cmp);
+    return list;
+}
+
+/* print the suggestions as a table for --advise, returns how many */
+static int advise_program(const uint16_t *memory, uint16_t entry, const uint32_t *profile, struct text_buffer *out)
+{
+    int count;
+    struct advice *list = advise_collect(memory, entry, profile, &count);
+    uint64_t total = 0, saved = 0;
+
+    for (int i = 0; i < 0x10000; i++) total += profile[i];
+    for (int i = 0; i < count; i++) saved += list[i].saved;
+
+    tb_printf(out, "suggestions: %d, saving %llu of %llu instructions executed (%.1f%%)\n", count,
+              (unsigned long long)saved, (unsigned long long)total, total ? 100.0 * saved / total : 0.0);
+    for (int i = 0; i < count; i++)
+    {
+        char text[0x40];
+
+        disasm_instr(memory[list[i].addr], text, sizeof(text));
+        tb_printf(out, "  %10llu  x%04X  %-20s %s%s\n", (unsigned long long)list[i].saved, list[i].addr, text,
+                  list[i].text, profile[list[i].addr] ? "" : " (not executed)");
+    }
+
+    free(list);
+    return count;
+}
+
+/* the same suggestions as a json array, for the batch results */
+static int advise_json(const uint16_t *memory, uint16_t entry, const uint32_t *profile, struct text_buffer *out)
+{
+    int count;
+    struct advice *list = advise_collect(memory, entry, profile, &count);
+
+    tb_printf(out, "[");
+    for (int i = 0; i < count; i++)
+    {
+        char text[0x40];
+
+        disasm_instr(memory[list[i].addr], text, sizeof(text));
+        tb_printf(out, "%s{\"addr\":\"0x%04x\",\"saved\":%llu,\"instr\":", i ? "," : "", list[i].addr,
+                  (unsigned long long)list[i].saved);
+        tb_json_string(out, text);
+        tb_printf(out, ",\"text\":");
+        tb_json_string(out, list[i].text);
+        tb_printf(out, ",\"executed\":%s}", profile[list[i].addr] ? "true" : "false");
+    }
+    tb_printf(out, "]");
+
+    free(list);
+    return count;
+}
+
+
+/* split a manifest line into arguments in place. "quoted strings" may contain
+   spaces and \n, \t, \\, \" escapes. returns the number of arguments */
+static int split_args(char *line, char **args, int max)
+{
+    char *r = line, *w = line;
+    int count = 0;
+
+    while (count < max)
+    {
+        int quoted = 0;
+
+        while (isspace(*r)) r++;
+        if (!*r || *r == '#') break;
+
+        args[count++] = w;
+
+        while (*r && (quoted || !isspace(*r)))
+        {
+            char c = *r++;
+
+            if (c == '"')
+            {
+                quoted = !quoted;
+                continue;
+            }
+
+            if (c == '\\' && *r)
+            {
+                c = *r++;
+                if (c == 'n') c = '\n';
+                else if (c == 't') c = '\t';
+            }
+
+            *w++ = c;
+        }
+
+        if (*r) r++;
+        *w++ = '\0';
+    }
+
+    return count;
+}
+
+#define MUTATE_DEFAULT_LIMIT 10000000
+
+#define MUTANT_FLIP_NZP 0
+#define MUTANT_IMM_INC 1
+#define MUTANT_IMM_DEC 2
+#define MUTANT_SWAP_REGS 3
+#define MUTANT_DROP 4
+
+static const char *mutant_names[] = { "flip-nzp", "imm+1", "imm-1", "swap-regs", "drop" };
+
+struct mutate_test {
+    struct run_options opts;
+    /* memory right after boot, every run starts from a copy of this */
+    uint16_t *image;
+    uint16_t pc;
+    /* results of the original program */
+    char *output;
+    uint16_t dumps[0x100];
+    uint64_t limit;
+};
+
+struct mutant {
+    uint16_t address;
+    uint16_t word;
+    uint8_t op;
+    /* 0: survived, 1: different results, 2: did not halt */
+    uint8_t killed;
+    int test;
+};
+
+struct mutate_ctx {
+    struct mutate_test *tests;
+    int test_count;
+    struct mutant *mutants;
+    int mutant_count;
+    _Atomic int next;
+};
+
+/* the immediate/offset field of an instruction, 0 if it has none */
+static uint16_t imm_mask(uint16_t instr)
+{
+    switch (instr >> 12)
+    {
+        case 0b0001: /* ADD */
+        case 0b0101: /* AND */
+            return instr & (1 << 5) ? 0x1f : 0;
+        case 0b0000: /* BR */
+        case 0b0010: /* LD */
+        case 0b0011: /* ST */
+        case 0b1010: /* LDI */
+        case 0b1011: /* STI */
+        case 0b1110: /* LEA */
+            return 0x1ff;
+        case 0b0110: /* LDR */
+        case 0b0111: /* STR */
+            return 0x3f;
+        case 0b0100: /* JSR */
+            return instr & (1 << 11) ? 0x7ff : 0;
+        default:
+            return 0;
+    }
+}
+
+static int add_mutant(struct mutant *out, int count, uint16_t address, uint16_t orig, uint16_t word, uint8_t op)
+{
+    if (word == orig) return count;
+
+    for (int i = count - 1; i >= 0 && out[i].address == address; i--)
+    {
+        if (out[i].word == word) return count;
+    }
+
+    out[count].address = address;
+    out[count].word = word;
+    out[count].op = op;
+    out[count].killed = 0;
+    out[count].test = -1;
+
+    return count + 1;
+}
+
+/* generate all mutants of the instruction at address, out needs room for 8 */
+static int mutate_instr(struct mutant *out, int count, uint16_t address, uint16_t instr)
+{
+    uint16_t opcode = instr >> 12;
+    uint16_t mask = imm_mask(instr);
+    uint16_t dr = (instr >> 9) & 0b111, sr1 = (instr >> 6) & 0b111;
+
+    /* BR with no condition codes is a NOP (or data), nothing to mutate */
+    if (opcode == 0b0000 && !(instr & (0b111 << 9)))
+        return count;
+
+    if (opcode == 0b0000)
+    {
+        for (int i = 0; i < 3; i++)
+            count = add_mutant(out, count, address, instr, instr ^ (1 << (9 + i)), MUTANT_FLIP_NZP);
+    }
+
+    if (mask)
+    {
+        count = add_mutant(out, count, address, instr, (instr & ~mask) | ((instr + 1) & mask), MUTANT_IMM_INC);
+        count = add_mutant(out, count, address, instr, (instr & ~mask) | ((instr - 1) & mask), MUTANT_IMM_DEC);
+    }
+
+    /* ADD, AND, NOT, LDR, STR */
+    if (opcode == 0b0001 || opcode == 0b0101 || opcode == 0b1001 || opcode == 0b0110 || opcode == 0b0111)
+        count = add_mutant(out, count, address, instr, (instr & ~(0b111111 << 6)) | (sr1 << 9) | (dr << 6), MUTANT_SWAP_REGS);
+
+    return add_mutant(out, count, address, instr, 0x0000, MUTANT_DROP);
+}
+
+static void mutate_prepare(struct lc3_machine *m, const struct mutate_test *t)
+{
+    lc3_reset(m, t->image, t->pc);
+    m->input = t->opts.input_buffer;
+    m->input_size = t->opts.input_size;
+    m->silent = 1;
+}
+
+/* 0 if the machine produced the same results as the original program */
+static int mutate_compare(const struct lc3_machine *m, const struct mutate_test *t)
+{
+    if (strcmp(m->output, t->output)) return 1;
+
+    for (int i = 0; i < t->opts.dump_size; i++)
+    {
+        if (m->memory[t->opts.dump_addr[i]] != t->dumps[i]) return 1;
+    }
+
+    return 0;
+}
+
+static void *mutate_worker(void *arg)
+{
+    struct mutate_ctx *ctx = arg;
+    struct lc3_machine m;
+    int i;
+
+    lc3_init(&m);
+
+    while ((i = atomic_fetch_add(&ctx->next, 1)) < ctx->mutant_count)
+    {
+        struct mutant *mu = &ctx->mutants[i];
+
+        /* stop at the first test that tells the mutant apart */
+        for (int t = 0; t < ctx->test_count && !mu->killed; t++)
+        {
+            const struct mutate_test *test = &ctx->tests[t];
+
+            mutate_prepare(&m, test);
+            m.memory[mu->address] = mu->word;
+
+            if (!lc3_run(&m, test->limit))
+                mu->killed = 2;
+            else if (mutate_compare(&m, test))
+                mu->killed = 1;
+
+            if (mu->killed)
+                mu->test = t + 1;
+        }
+    }
+
+    lc3_free(&m);
+    return NULL;
+}
+
+/* `lc3sim mutate [data.obj...] prog.obj tests.manifest`: measure how many
+   instruction level mutants of prog.obj the tests can tell apart from it */
+static int mutate_main(int argc, char **argv)
+{
+    const char *files[0x100];
+    int file_count = 0;
+    int jobs = default_jobs();
+    int show_all = 0;
+    uint16_t *base = calloc(LC3_MEMORY_WORDS, sizeof(uint16_t));
+    uint8_t *covered = calloc(0x10000, sizeof(uint8_t));
+    struct mutate_ctx ctx = {0};
+    struct lc3_machine m;
+    const char *program, *manifest;
+    uint16_t origin = 0;
+    uint32_t length = 0;
+    int capacity = 0x10;
+    int killed = 0, timeouts = 0;
+    char line[0x1000];
+    FILE *file;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strstr(argv[i], "-j") == argv[i])
+            jobs = atoi(argv[i] + 2);
+        else if (strstr(argv[i], "--jobs=") == argv[i])
+            jobs = atoi(argv[i] + 7);
+        else if (!strcmp(argv[i], "--all"))
+            show_all = 1;
+        else if (file_count < (int)ARRAY_SIZE(files))
+            files[file_count++] = argv[i];
+    }
+
+    if (file_count < 2 || jobs < 1)
+    {
+        fprintf(stderr, "usage: lc3sim mutate [-jN] [--all] [data.obj...] prog.obj tests.manifest\n");
+        return 1;
+    }
+
+    program = files[file_count - 2];
+    manifest = files[file_count - 1];
+
+    if (!(file = fopen(manifest, "r")))
+    {
+        fprintf(stderr, "Failed to open %s\n", manifest);
+        return 1;
+    }
+
+    memcpy(base, OSProgram, sizeof(OSProgram));
+    for (int i = 0; i < file_count - 2; i++)
+    {
+        if (!load_object(files[i], base, NULL))
+            fprintf(stderr, "Failed to load %s\n", files[i]);
+    }
+
+    if (!load_object(program, base, &length))
+    {
+        fprintf(stderr, "Failed to load %s\n", program);
+        return 1;
+    }
+
+    lc3_init(&m);
+    ctx.tests = calloc(capacity, sizeof(*ctx.tests));
+
+    /* every line is one test: run options and extra objects to load */
+    while (fgets(line, sizeof(line), file))
+    {
+        char *args[0x40];
+        int count = split_args(line, args, ARRAY_SIZE(args));
+        struct mutate_test *t;
+        const char *unsupported;
+        uint16_t *start;
+
+        if (!count) continue;
+
+        if (ctx.test_count == capacity)
+        {
+            capacity *= 2;
+            ctx.tests = realloc(ctx.tests, capacity * sizeof(*ctx.tests));
+        }
+
+        t = &ctx.tests[ctx.test_count++];
+        memset(t, 0, sizeof(*t));
+        t->image = malloc(LC3_MEMORY_WORDS * sizeof(uint16_t));
+        memcpy(t->image, base, LC3_MEMORY_WORDS * sizeof(uint16_t));
+
+        for (int i = 0; i < count; i++)
+        {
+            if (strstr(args[i], "--") == args[i])
+            {
+                if (!parse_run_option(&t->opts, args[i] + 2))
+                    fprintf(stderr, "%s:%d: unknown option %s\n", manifest, ctx.test_count, args[i]);
+            }
+            else if (!load_object(args[i], t->image, NULL))
+            {
+                fprintf(stderr, "%s:%d: failed to load %s\n", manifest, ctx.test_count, args[i]);
+            }
+        }
+
+        if ((unsupported = run_option_unsupported(&t->opts, 0)))
+        {
+            fprintf(stderr, "%s:%d: %s is not supported in a test\n", manifest, ctx.test_count, unsupported);
+            return 1;
+        }
+
+        if (!(start = load_object(program, t->image, &length)))
+        {
+            fprintf(stderr, "Failed to load %s\n", program);
+            return 1;
+        }
+
+        origin = start - t->image;
+
+        /* boot in a scratch machine so the saved image has the OS pointed at the program */
+        memcpy(m.memory, t->image, LC3_MEMORY_WORDS * sizeof(uint16_t));
+        lc3_boot(&m, origin, &t->opts);
+        memcpy(t->image, m.memory, LC3_MEMORY_WORDS * sizeof(uint16_t));
+        t->pc = m.pc - m.memory;
+
+        if (t->opts.limit_auto)
+        {
+            uint64_t limit = static_limit(t->image, origin);
+            if (limit)
+                t->opts.limit = limit;
+        }
+
+        /* golden run, also records which words are executed */
+        mutate_prepare(&m, t);
+        t->limit = t->opts.limit ? t->opts.limit : MUTATE_DEFAULT_LIMIT;
+        while (lc3_running(&m) && m.instret < t->limit)
+        {
+            covered[m.pc - m.memory] = 1;
+            if (lc3_step(&m) < 0) break;
+        }
+
+        if (lc3_running(&m))
+        {
+            fprintf(stderr, "%s:%d: the original program does not halt\n", manifest, ctx.test_count);
+            return 1;
+        }
+
+        t->output = strdup(m.output);
+        for (int i = 0; i < t->opts.dump_size; i++)
+            t->dumps[i] = m.memory[t->opts.dump_addr[i]];
+
+        /* mutants get some slack before they count as hung */
+        t->limit = m.instret * 4 + 10000;
+    }
+
+    fclose(file);
+
+    if (!ctx.test_count)
+    {
+        fprintf(stderr, "%s has no tests\n", manifest);
+        return 1;
+    }
+
+    /* only mutate instructions the tests actually execute */
+    ctx.mutants = calloc(length * 8 + 1, sizeof(*ctx.mutants));
+    for (uint32_t i = 0; i < length; i++)
+    {
+        uint16_t address = origin + i;
+        if (covered[address])
+            ctx.mutant_count = mutate_instr(ctx.mutants, ctx.mutant_count, address, base[address]);
+    }
+
+    run_workers(MIN(jobs, ctx.mutant_count > 0 ? ctx.mutant_count : 1), mutate_worker, &ctx);
+
+    for (int i = 0; i < ctx.mutant_count; i++)
+    {
+        struct mutant *mu = &ctx.mutants[i];
+        char before[0x40], after[0x40];
+
+        killed += mu->killed != 0;
+        timeouts += mu->killed == 2;
+
+        if (mu->killed && !show_all) continue;
+
+        if (!disasm_instr(base[mu->address], before, sizeof(before)))
+            snprintf(before, sizeof(before), ".FILL %#x", base[mu->address]);
+        if (!disasm_instr(mu->word, after, sizeof(after)))
+            snprintf(after, sizeof(after), ".FILL %#x", mu->word);
+
+        if (mu->killed)
+            printf("killed   %#06x: %s -> %s [%s] by test %d%s\n", mu->address, before, after,
+                   mutant_names[mu->op], mu->test, mu->killed == 2 ? " (hang)" : "");
+        else
+            printf("survived %#06x: %s -> %s [%s]\n", mu->address, before, after, mutant_names[mu->op]);
+    }
+
+    printf("\ntests: %d\n", ctx.test_count);
+    printf("mutants: %d\n", ctx.mutant_count);
+    printf("killed: %d (%d by not halting)\n", killed, timeouts);
+    printf("survived: %d\n", ctx.mutant_count - killed);
+    printf("mutation score: %.1f%%\n", ctx.mutant_count ? 100.0 * killed / ctx.mutant_count : 100.0);
+
+    for (int i = 0; i < ctx.test_count; i++)
+    {
+        free(ctx.tests[i].image);
+        free(ctx.tests[i].output);
+    }
+
+    free(ctx.tests);
+    free(ctx.mutants);
+    free(covered);
+    free(base);
+    lc3_free(&m);
+    return 0;
+}
+
+struct symbol {
+    char name[0x40];
+    uint16_t address;
+};
+
+struct symbol_table {
+    struct symbol *symbols;
+    int count;
+};
+
+/* load the lc3as symbol table (foo.sym) that belongs to foo.obj, lines look like
+   "//	LABEL		3000" */
+static int load_symbols(const char *obj_path, struct symbol_table *table)
+{
+    char path[0x400];
+    char line[0x200];
+    char cached[0x400];
+    const char *dot;
+    int capacity = 0;
+    FILE *file;
+
+    if (is_asm_path(obj_path) && asm_cache_lookup(obj_path, cached, sizeof(cached)))
+        obj_path = cached;
+    dot = strrchr(obj_path, '.');
+
+    snprintf(path, sizeof(path), "%.*s.sym", dot ? (int)(dot - obj_path) : (int)strlen(obj_path), obj_path);
+
+    if (!(file = fopen(path, "r")))
+        return 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[0x40];
+        unsigned address;
+        char *p = line;
+
+        while (*p == '/' || isspace(*p)) p++;
+
+        if (sscanf(p, "%63s %x", name, &address) != 2)
+            continue;
+
+        if (table->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 0x40;
+            table->symbols = realloc(table->symbols, capacity * sizeof(*table->symbols));
+        }
+
+        strcpy(table->symbols[table->count].name, name);
+        table->symbols[table->count].address = address;
+        table->count++;
+    }
+
+    fclose(file);
+    return 1;
+}
+
+static int lookup_symbol(const struct symbol_table *table, const char *name, uint16_t *address)
+{
+    for (int i = 0; i < table->count; i++)
+    {
+        if (!strcasecmp(table->symbols[i].name, name))
+        {
+            *address = table->symbols[i].address;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* a label from the program's .sym file or a hex address */
+static int resolve_address(const char *obj_path, const char *name, uint16_t *address)
+{
+    struct symbol_table table = {0};
+    unsigned value;
+    int found;
+
+    load_symbols(obj_path, &table);
+    found = lookup_symbol(&table, name, address);
+    free(table.symbols);
+
+    if (found) return 1;
+
+    if (sscanf(name, "%x", &value) == 1)
+    {
+        *address = value;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* random test value, biased towards the edge cases that break LC-3 code */
+static uint16_t random_word(uint64_t *state)
+{
+    static const uint16_t edges[] = { 0, 1, 2, 0xffff, 0xfffe, 0x7fff, 0x8000, 0x8001, 0x00ff, 0xff00 };
+    uint64_t r = splitmix64(state);
+
+    switch (r & 3)
+    {
+        case 0:
+            return edges[(r >> 8) % ARRAY_SIZE(edges)];
+        case 1:
+            /* small signed values */
+            return (int16_t)((r >> 8) % 65) - 32;
+        default:
+            return r >> 16;
+    }
+}
+
+/* subroutines return here, we stop before fetching from it. an unassigned
+   device address, so it is neither program code nor a device register */
+#define EQUIV_RETURN 0xfff0
+#define EQUIV_STACK 0xfe00
+#define EQUIV_DEFAULT_LIMIT 1000000
+
+#define OUTCOME_RETURNED 0
+#define OUTCOME_HALTED 1
+#define OUTCOME_TIMEOUT 2
+
+static const char *outcome_names[] = { "returned", "halted", "did not return" };
+
+/* which registers (bitmask) and memory ranges are inputs/outputs */
+struct state_spec {
+    uint8_t regs;
+    int range_count;
+    uint16_t range_start[0x10];
+    uint16_t range_end[0x10]; /* inclusive */
+    int words;
+};
+
+static int parse_state_spec(struct state_spec *spec, char *arg)
+{
+    memset(spec, 0, sizeof(*spec));
+
+    for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ","))
+    {
+        unsigned s, e, r;
+
+        if (!strcasecmp(tok, "regs"))
+        {
+            /* R6 and R7 are the stack pointer and return address */
+            spec->regs |= 0x3f;
+        }
+        else if (sscanf(tok, "R%u", &r) == 1 || sscanf(tok, "r%u", &r) == 1)
+        {
+            if (r > 7) return 0;
+            spec->regs |= 1 << r;
+        }
+        else if (strstr(tok, "mem:") == tok && spec->range_count < (int)ARRAY_SIZE(spec->range_start))
+        {
+            if (sscanf(tok + 4, "%x-%x", &s, &e) != 2)
+            {
+                if (sscanf(tok + 4, "%x", &s) != 1) return 0;
+                e = s;
+            }
+
+            if (s > e || e > 0xffff) return 0;
+
+            spec->range_start[spec->range_count] = s;
+            spec->range_end[spec->range_count] = e;
+            spec->range_count++;
+            spec->words += e - s + 1;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+struct equiv_program {
+    const char *path;
+    uint16_t entry;
+    /* booted image shared read-only by all workers */
+    uint16_t *image;
+};
+
+struct equiv_ctx {
+    struct equiv_program programs[2];
+    struct state_spec inputs;
+    struct state_spec outputs;
+    int values; /* number of input values: 8 registers + input memory words */
+    uint64_t seed;
+    uint64_t limit;
+    int trials;
+    _Atomic int next;
+    /* lowest failing trial, so results do not depend on thread scheduling */
+    _Atomic int first_failure;
+};
+
+static void equiv_generate(const struct equiv_ctx *ctx, int trial, uint16_t *values)
+{
+    uint64_t state = ctx->seed ^ ((uint64_t)trial * 0xd1342543de82ef95ull);
+
+    for (int i = 0; i < ctx->values; i++)
+        values[i] = random_word(&state);
+}
+
+static int equiv_run(struct lc3_machine *m, const struct equiv_ctx *ctx, const struct equiv_program *p, const uint16_t *values)
+{
+    int v = 8;
+
+    lc3_reset(m, p->image, p->entry);
+
+    for (int r = 0; r < 8; r++)
+    {
+        if (ctx->inputs.regs & (1 << r))
+            m->registers[r] = values[r];
+    }
+
+    if (!(ctx->inputs.regs & (1 << 6)))
+        m->registers[6] = EQUIV_STACK;
+    m->registers[7] = EQUIV_RETURN;
+
+    for (int i = 0; i < ctx->inputs.range_count; i++)
+    {
+        for (uint32_t a = ctx->inputs.range_start[i]; a <= ctx->inputs.range_end[i]; a++)
+            m->memory[a] = values[v++];
+    }
+
+    while (m->pc - m->memory != EQUIV_RETURN)
+    {
+        if (!lc3_running(m)) return OUTCOME_HALTED;
+        if (m->instret >= ctx->limit || lc3_step(m) < 0) return OUTCOME_TIMEOUT;
+    }
+
+    return OUTCOME_RETURNED;
+}
+
+/* returns 0 if both machines agree, otherwise describes the first difference in out */
+static int equiv_compare(const struct equiv_ctx *ctx, struct lc3_machine *a, int ra, struct lc3_machine *b, int rb,
+                         char *out, size_t size)
+{
+    if (ra != rb)
+    {
+        snprintf(out, size, "%s %s but %s %s", ctx->programs[0].path, outcome_names[ra],
+                 ctx->programs[1].path, outcome_names[rb]);
+        return 1;
+    }
+
+    for (int r = 0; r < 8; r++)
+    {
+        if ((ctx->outputs.regs & (1 << r)) && a->registers[r] != b->registers[r])
+        {
+            snprintf(out, size, "R%d: %#x vs %#x", r, a->registers[r], b->registers[r]);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < ctx->outputs.range_count; i++)
+    {
+        for (uint32_t addr = ctx->outputs.range_start[i]; addr <= ctx->outputs.range_end[i]; addr++)
+        {
+            if (a->memory[addr] != b->memory[addr])
+            {
+                snprintf(out, size, "memory[%#x]: %#x vs %#x", addr, a->memory[addr], b->memory[addr]);
+                return 1;
+            }
+        }
+    }
+
+    if (strcmp(a->output, b->output))
+    {
+        snprintf(out, size, "console output \"%s\" vs \"%s\"", a->output, b->output);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int equiv_check(const struct equiv_ctx *ctx, struct lc3_machine *a, struct lc3_machine *b,
+                       const uint16_t *values, char *out, size_t size)
+{
+    int ra = equiv_run(a, ctx, &ctx->programs[0], values);
+    int rb = equiv_run(b, ctx, &ctx->programs[1], values);
+    return equiv_compare(ctx, a, ra, b, rb, out, size);
+}
+
+static void *equiv_worker(void *arg)
+{
+    struct equiv_ctx *ctx = arg;
+    struct lc3_machine a, b;
+    uint16_t *values = calloc(ctx->values, sizeof(uint16_t));
+    char why[0x100];
+    int trial;
+
+    lc3_init(&a);
+    lc3_init(&b);
+
+    while ((trial = atomic_fetch_add(&ctx->next, 1)) < ctx->trials)
+    {
+        int first = atomic_load(&ctx->first_failure);
+
+        /* a lower trial already failed, nothing left to find */
+        if (first >= 0 && first < trial) break;
+
+        equiv_generate(ctx, trial, values);
+
+        if (equiv_check(ctx, &a, &b, values, why, sizeof(why)))
+        {
+            while ((first < 0 || trial < first) && !atomic_compare_exchange_weak(&ctx->first_failure, &first, trial));
+        }
+    }
+
+    free(values);
+    lc3_free(&a);
+    lc3_free(&b);
+    return NULL;
+}
+
+/* greedily replace input values with simpler ones while the programs still disagree */
+static void equiv_shrink(const struct equiv_ctx *ctx, struct lc3_machine *a, struct lc3_machine *b, uint16_t *values)
+{
+    char why[0x100];
+    int changed = 1;
+
+    for (int pass = 0; changed && pass < 16; pass++)
+    {
+        changed = 0;
+
+        for (int i = 0; i < ctx->values; i++)
+        {
+            int16_t v = values[i];
+            int16_t candidates[] = { 0, 1, -1, v / 2, v > 0 ? v - 1 : v + 1 };
+
+            if (i < 8 && !(ctx->inputs.regs & (1 << i))) continue;
+
+            for (size_t c = 0; c < ARRAY_SIZE(candidates); c++)
+            {
+                int16_t simpler = candidates[c];
+
+                /* only accept values closer to zero */
+                if (abs(simpler) >= abs(v) && !(simpler == 1 && v == -1)) continue;
+
+                values[i] = simpler;
+                if (equiv_check(ctx, a, b, values, why, sizeof(why)))
+                {
+                    changed = 1;
+                    break;
+                }
+                values[i] = v;
+            }
+        }
+    }
+}
+
+static int equiv_load(struct equiv_program *p, const char *entry, const char **data, int data_count)
+{
+    struct lc3_machine m;
+    struct run_options opts = {0};
+    uint16_t *origin;
+
+    lc3_init(&m);
+    memcpy(m.memory, OSProgram, sizeof(OSProgram));
+
+    for (int i = 0; i < data_count; i++)
+    {
+        if (!load_object(data[i], m.memory, NULL))
+            fprintf(stderr, "Failed to load %s\n", data[i]);
+    }
+
+    if (!(origin = load_object(p->path, m.memory, NULL)))
+    {
+        fprintf(stderr, "Failed to load %s\n", p->path);
+        lc3_free(&m);
+        return 0;
+    }
+
+    p->entry = origin - m.memory;
+    if (entry && !resolve_address(p->path, entry, &p->entry))
+    {
+        fprintf(stderr, "%s: unknown entry point %s\n", p->path, entry);
+        lc3_free(&m);
+        return 0;
+    }
+
+    /* boot, then skip the OS and start in user mode with the supervisor stack set up */
+    lc3_boot(&m, p->entry, &opts);
+    m.memory[OS_PSR] = 0x8002;
+    m.memory[OS_SSP] = m.memory[OS_INITIAL_SSP];
+
+    p->image = m.memory;
+    free(m.output);
+    return 1;
+}
+
+static void equiv_print_values(const struct equiv_ctx *ctx, const uint16_t *values)
+{
+    int v = 8;
+
+    for (int r = 0; r < 8; r++)
+    {
+        if (ctx->inputs.regs & (1 << r))
+            printf("  R%d = %#x (%d)\n", r, values[r], (int16_t)values[r]);
+    }
+
+    for (int i = 0; i < ctx->inputs.range_count; i++)
+    {
+        for (uint32_t a = ctx->inputs.range_start[i]; a <= ctx->inputs.range_end[i]; a++, v++)
+        {
+            if (values[v])
+                printf("  memory[%#x] = %#x (%d)\n", a, values[v], (int16_t)values[v]);
+        }
+    }
+
+    if (ctx->inputs.range_count)
+        printf("  (other input memory is 0)\n");
+}
+
+/* `lc3sim equiv a.obj b.obj --entry=LABEL --inputs=regs,mem:RANGE`: run both
+   subroutines from random states and compare what they leave behind */
+static int equiv_main(int argc, char **argv)
+{
+    struct equiv_ctx ctx = {0};
+    const char *files[0x100];
+    const char *entry = NULL;
+    char inputs[0x100] = "regs", outputs[0x100] = "";
+    int file_count = 0;
+    int jobs = default_jobs();
+    struct lc3_machine a, b;
+    uint16_t *values;
+    char why[0x100];
+
+    ctx.trials = 10000;
+    ctx.seed = 1;
+    ctx.limit = EQUIV_DEFAULT_LIMIT;
+    atomic_store(&ctx.first_failure, -1);
+
+    for (int i = 1; i < argc; i++)
+    {
+        char *arg = argv[i];
+
+        if (strstr(arg, "--entry=") == arg)
+            entry = arg + 8;
+        else if (strstr(arg, "--inputs=") == arg)
+            snprintf(inputs, sizeof(inputs), "%s", arg + 9);
+        else if (strstr(arg, "--outputs=") == arg)
+            snprintf(outputs, sizeof(outputs), "%s", arg + 10);
+        else if (strstr(arg, "--trials=") == arg)
+            ctx.trials = atoi(arg + 9);
+        else if (strstr(arg, "--seed=") == arg)
+            ctx.seed = strtoull(arg + 7, NULL, 0);
+        else if (strstr(arg, "--limit=") == arg)
+            ctx.limit = strtoull(arg + 8, NULL, 0);
+        else if (strstr(arg, "-j") == arg)
+            jobs = atoi(arg + 2);
+        else if (strstr(arg, "--jobs=") == arg)
+            jobs = atoi(arg + 7);
+        else if (file_count < (int)ARRAY_SIZE(files))
+            files[file_count++] = arg;
+    }
+
+    if (file_count < 2 || jobs < 1 || ctx.trials < 1)
+    {
+        fprintf(stderr, "usage: lc3sim equiv [data.obj...] a.obj b.obj [--entry=LABEL] [--inputs=regs,R6,mem:4000-40ff]\n"
+                        "                    [--outputs=...] [--trials=N] [--seed=N] [--limit=N] [-jN]\n");
+        return 1;
+    }
+
+    /* outputs default to the inputs */
+    if (!outputs[0])
+        memcpy(outputs, inputs, sizeof(outputs));
+
+    if (!parse_state_spec(&ctx.inputs, inputs) || !parse_state_spec(&ctx.outputs, outputs))
+    {
+        fprintf(stderr, "Invalid --inputs/--outputs\n");
+        return 1;
+    }
+
+    ctx.values = 8 + ctx.inputs.words;
+    ctx.programs[0].path = files[file_count - 2];
+    ctx.programs[1].path = files[file_count - 1];
+
+    if (!equiv_load(&ctx.programs[0], entry, files, file_count - 2) ||
+        !equiv_load(&ctx.programs[1], entry, files, file_count - 2))
+        return 1;
+
+    run_workers(MIN(jobs, ctx.trials), equiv_worker, &ctx);
+
+    if (atomic_load(&ctx.first_failure) < 0)
+    {
+        printf("equivalent on %d random inputs (seed %llu)\n", ctx.trials, (unsigned long long)ctx.seed);
+        return 0;
+    }
+
+    lc3_init(&a);
+    lc3_init(&b);
+    values = calloc(ctx.values, sizeof(uint16_t));
+
+    equiv_generate(&ctx, atomic_load(&ctx.first_failure), values);
+    printf("NOT equivalent, trial %d (seed %llu) differs:\n", atomic_load(&ctx.first_failure), (unsigned long long)ctx.seed);
+    equiv_print_values(&ctx, values);
+
+    equiv_shrink(&ctx, &a, &b, values);
+    equiv_check(&ctx, &a, &b, values, why, sizeof(why));
+    printf("\nminimal counterexample:\n");
+    equiv_print_values(&ctx, values);
+    printf("difference: %s\n", why);
+
+    free(values);
+    lc3_free(&a);
+    lc3_free(&b);
+    return 3;
+}
+
+#define TARGET_REGS 0
+#define TARGET_MEM 1
+#define TARGET_PSR 2
+
+#define FAULT_MASKED 0
+#define FAULT_SDC 1
+#define FAULT_EXCEPTION 2
+#define FAULT_HANG 3
+
+static const char *fault_names[] = { "masked", "silent data corruption", "exception", "hang" };
+
+/* PSR bits that mean something: condition codes, priority, privilege */
+static const uint8_t psr_bits[] = { 0, 1, 2, 8, 9, 10, 15 };
+
+/* machine state at some point of the golden run. the whole machine is kept
+   so cycles, device events, pending interrupts, the counters and the timing
+   and DMA settings resume exactly where the golden run was */
+struct checkpoint {
+    struct lc3_machine machine;
+    uint16_t *memory;
+    uint16_t pc;
+};
+
+struct fault {
+    uint64_t index;
+    uint16_t location; /* register, address or PSR bit */
+    uint8_t bit;
+    uint8_t outcome;
+};
+
+struct inject_ctx {
+    struct run_options opts;
+    uint16_t *image;
+    uint16_t start_pc;
+    int target;
+    uint16_t mem_start, mem_end; /* inclusive */
+    uint64_t window_start, window_end;
+    uint64_t seed;
+    uint64_t limit;
+    /* golden run */
+    char *output;
+    uint16_t dumps[0x100];
+    int golden_exception;
+    struct checkpoint *checkpoints;
+    int checkpoint_count;
+    uint64_t checkpoint_interval;
+    /* entry points of the exception handlers */
+    uint8_t *handlers;
+    struct fault *faults;
+    int fault_count;
+    _Atomic int next;
+};
+
+static void inject_generate(const struct inject_ctx *ctx, int n, struct fault *f)
+{
+    uint64_t state = ctx->seed ^ ((uint64_t)n * 0xd1342543de82ef95ull);
+    uint64_t r = splitmix64(&state);
+
+    f->index = ctx->window_start + splitmix64(&state) % (ctx->window_end - ctx->window_start);
+    f->outcome = FAULT_MASKED;
+
+    switch (ctx->target)
+    {
+        case TARGET_REGS:
+            f->location = r % 8;
+            f->bit = (r >> 8) % 16;
+            break;
+        case TARGET_MEM:
+            f->location = ctx->mem_start + r % (ctx->mem_end - ctx->mem_start + 1);
+            f->bit = (r >> 32) % 16;
+            break;
+        default:
+            f->location = OS_PSR;
+            f->bit = psr_bits[(r >> 8) % ARRAY_SIZE(psr_bits)];
+            break;
+    }
+}
+
+static void inject_restore(struct lc3_machine *m, const struct inject_ctx *ctx, const struct checkpoint *cp)
+{
+    uint16_t *memory = m->memory;
+    char *output = m->output;
+    int output_size = m->output_size;
+
+    /* everything but the buffers, which stay m's own */
+    *m = cp->machine;
+    m->memory = memory;
+    m->output = output;
+    m->output_size = output_size;
+    m->output_len = 0;
+    m->output[0] = 0;
+    memcpy(m->memory, cp->memory, LC3_MEMORY_WORDS * sizeof(uint16_t));
+    m->pc = m->memory + cp->pc;
+    m->input = ctx->opts.input_buffer;
+    m->silent = 1;
+
+    /* the output so far is the golden output */
+    for (int i = 0; i < cp->machine.output_len; i++)
+        lc3_putc(m, ctx->output[i]);
+}
+
+/* run to the end watching for exception handlers, returns the fault outcome */
+static int inject_finish(struct lc3_machine *m, const struct inject_ctx *ctx)
+{
+    int exception = 0;
+
+    while (lc3_running(m) && m->instret < ctx->limit)
+    {
+        exception |= ctx->handlers[m->pc - m->memory];
+        if (lc3_step(m) < 0) break;
+    }
+
+    if (lc3_running(m))
+        return FAULT_HANG;
+
+    if (exception && !ctx->golden_exception)
+        return FAULT_EXCEPTION;
+
+    if (strcmp(m->output, ctx->output))
+        return FAULT_SDC;
+
+    for (int i = 0; i < ctx->opts.dump_size; i++)
+    {
+        if (m->memory[ctx->opts.dump_addr[i]] != ctx->dumps[i])
+            return FAULT_SDC;
+    }
+
+    return FAULT_MASKED;
+}
+
+static void *inject_worker(void *arg)
+{
+    struct inject_ctx *ctx = arg;
+    struct lc3_machine m;
+    int n;
+
+    lc3_init(&m);
+
+    while ((n = atomic_fetch_add(&ctx->next, 1)) < ctx->fault_count)
+    {
+        struct fault *f = &ctx->faults[n];
+        int c = MIN((f->index - ctx->window_start) / ctx->checkpoint_interval, (uint64_t)ctx->checkpoint_count - 1);
+
+        /* start from the closest checkpoint before the fault instead of booting */
+        inject_restore(&m, ctx, &ctx->checkpoints[c]);
+        lc3_run(&m, f->index);
+
+        if (!lc3_running(&m))
+        {
+            /* the fault lands after the program halted */
+            f->outcome = FAULT_MASKED;
+            continue;
+        }
+
+        if (ctx->target == TARGET_REGS)
+            m.registers[f->location] ^= 1u << f->bit;
+        else
+            m.memory[f->location] ^= 1u << f->bit;
+
+        f->outcome = inject_finish(&m, ctx);
+    }
+
+    lc3_free(&m);
+    return NULL;
+}
+
+/* `lc3sim inject prog.obj --faults=N --target=regs|mem|psr --window=I1-I2`:
+   flip single bits during a run and classify what happens */
+static int inject_main(int argc, char **argv)
+{
+    struct inject_ctx ctx = {0};
+    const char *files[0x100];
+    int file_count = 0;
+    int jobs = default_jobs();
+    int verbose = 0;
+    int counts[4] = {0};
+    struct lc3_machine m;
+    uint16_t *origin;
+    uint32_t length = 0;
+    uint64_t golden_instret;
+    int have_window = 0, have_range = 0;
+    const char *unsupported;
+
+    ctx.fault_count = 1000;
+    ctx.seed = 1;
+    ctx.target = TARGET_REGS;
+
+    for (int i = 1; i < argc; i++)
+    {
+        char *arg = argv[i];
+
+        if (strstr(arg, "--faults=") == arg)
+            ctx.fault_count = atoi(arg + 9);
+        else if (strstr(arg, "--seed=") == arg)
+            ctx.seed = strtoull(arg + 7, NULL, 0);
+        else if (strstr(arg, "--window=") == arg)
+        {
+            unsigned long long s, e;
+            if (sscanf(arg + 9, "%llu-%llu", &s, &e) != 2 || s >= e)
+            {
+                fprintf(stderr, "Invalid --window, expected I1-I2\n");
+                return 1;
+            }
+            ctx.window_start = s;
+            ctx.window_end = e;
+            have_window = 1;
+        }
+        else if (strstr(arg, "--target=") == arg)
+        {
+            unsigned s, e;
+            arg += 9;
+            if (!strcmp(arg, "regs"))
+                ctx.target = TARGET_REGS;
+            else if (!strcmp(arg, "psr"))
+                ctx.target = TARGET_PSR;
+            else if (!strcmp(arg, "mem"))
+                ctx.target = TARGET_MEM;
+            else if (sscanf(arg, "mem:%x-%x", &s, &e) == 2 && s <= e && e <= 0xffff)
+            {
+                ctx.target = TARGET_MEM;
+                ctx.mem_start = s;
+                ctx.mem_end = e;
+                have_range = 1;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid --target, expected regs, mem, mem:START-END or psr\n");
+                return 1;
+            }
+        }
+        else if (strstr(arg, "-j") == arg)
+            jobs = atoi(arg + 2);
+        else if (strstr(arg, "--jobs=") == arg)
+            jobs = atoi(arg + 7);
+        else if (!strcmp(arg, "--verbose"))
+            verbose = 1;
+        else if (strstr(arg, "--") == arg)
+        {
+            if (!parse_run_option(&ctx.opts, arg + 2))
+                fprintf(stderr, "unknown option %s\n", arg);
+        }
+        else if (file_count < (int)ARRAY_SIZE(files))
+            files[file_count++] = arg;
+    }
+
+    if (!file_count || jobs < 1 || ctx.fault_count < 1)
+    {
+        fprintf(stderr, "usage: lc3sim inject [data.obj...] prog.obj [--faults=N] [--target=regs|mem[:START-END]|psr]\n"
+                        "                     [--window=I1-I2] [--seed=N] [-jN] [--verbose] [run options]\n");
+        return 1;
+    }
+
+    if ((unsupported = run_option_unsupported(&ctx.opts, 0)))
+    {
+        fprintf(stderr, "%s is not supported by inject\n", unsupported);
+        return 1;
+    }
+
+    lc3_init(&m);
+    memcpy(m.memory, OSProgram, sizeof(OSProgram));
+
+    for (int i = 0; i < file_count - 1; i++)
+    {
+        if (!load_object(files[i], m.memory, NULL))
+            fprintf(stderr, "Failed to load %s\n", files[i]);
+    }
+
+    if (!(origin = load_object(files[file_count - 1], m.memory, &length)))
+    {
+        fprintf(stderr, "Failed to load %s\n", files[file_count - 1]);
+        return 1;
+    }
+
+    /* memory faults default to the program itself */
+    if (!have_range)
+    {
+        ctx.mem_start = origin - m.memory;
+        ctx.mem_end = ctx.mem_start + (length ? length - 1 : 0);
+    }
+
+    lc3_boot(&m, origin - m.memory, &ctx.opts);
+    m.silent = 1;
+
+    if (ctx.opts.limit_auto)
+    {
+        uint64_t limit = static_limit(m.memory, origin - m.memory);
+        if (limit)
+            ctx.opts.limit = limit;
+    }
+    ctx.image = malloc(LC3_MEMORY_WORDS * sizeof(uint16_t));
+    memcpy(ctx.image, m.memory, LC3_MEMORY_WORDS * sizeof(uint16_t));
+    ctx.start_pc = m.pc - m.memory;
+
+    /* only the exception vectors, the device interrupt handlers at x180 and
+       up run in a healthy program too */
+    ctx.handlers = calloc(0x10000, sizeof(uint8_t));
+    ctx.handlers[ctx.image[0x00]] = 1; /* bad trap */
+    for (int i = 0x100; i <= 0x102; i++)
+        ctx.handlers[ctx.image[i]] = 1;
+
+    /* golden run */
+    if (!lc3_run(&m, ctx.opts.limit ? ctx.opts.limit : MUTATE_DEFAULT_LIMIT))
+    {
+        fprintf(stderr, "the program does not halt without faults\n");
+        return 1;
+    }
+
+    golden_instret = m.instret;
+    ctx.output = strdup(m.output);
+    for (int i = 0; i < ctx.opts.dump_size; i++)
+        ctx.dumps[i] = m.memory[ctx.opts.dump_addr[i]];
+    ctx.limit = golden_instret * 2 + 10000;
+
+    if (!have_window)
+    {
+        ctx.window_start = 0;
+        ctx.window_end = golden_instret;
+    }
+
+    ctx.window_end = MIN(ctx.window_end, golden_instret);
+    if (ctx.window_start >= ctx.window_end)
+    {
+        fprintf(stderr, "the window is past the end of the run (%llu instructions)\n", (unsigned long long)golden_instret);
+        return 1;
+    }
+
+    /* second golden run, saving up to 64 checkpoints spread over the window */
+    ctx.checkpoint_interval = (ctx.window_end - ctx.window_start + 63) / 64;
+    ctx.checkpoints = calloc(64, sizeof(*ctx.checkpoints));
+
+    lc3_reset(&m, ctx.image, ctx.start_pc);
+    m.input = ctx.opts.input_buffer;
+    m.input_size = ctx.opts.input_size;
+
+    for (uint64_t next = ctx.window_start; ctx.checkpoint_count < 64 && next < ctx.window_end; next += ctx.checkpoint_interval)
+    {
+        struct checkpoint *cp = &ctx.checkpoints[ctx.checkpoint_count++];
+
+        lc3_run(&m, next);
+
+        cp->machine = m;
+        cp->memory = malloc(LC3_MEMORY_WORDS * sizeof(uint16_t));
+        memcpy(cp->memory, m.memory, LC3_MEMORY_WORDS * sizeof(uint16_t));
+        cp->pc = m.pc - m.memory;
+    }
+
+    /* did the golden run itself go through an exception handler? */
+    inject_restore(&m, &ctx, &ctx.checkpoints[0]);
+    ctx.golden_exception = inject_finish(&m, &ctx) == FAULT_EXCEPTION;
+
+    ctx.faults = calloc(ctx.fault_count, sizeof(*ctx.faults));
+    for (int i = 0; i < ctx.fault_count; i++)
+        inject_generate(&ctx, i, &ctx.faults[i]);
+
+    run_workers(MIN(jobs, ctx.fault_count), inject_worker, &ctx);
+
+    for (int i = 0; i < ctx.fault_count; i++)
+    {
+        struct fault *f = &ctx.faults[i];
+
+        counts[f->outcome]++;
+
+        if (!verbose) continue;
+
+        if (ctx.target == TARGET_REGS)
+            printf("fault %d: instruction %llu R%d bit %d: %s\n", i, (unsigned long long)f->index,
+                   f->location, f->bit, fault_names[f->outcome]);
+        else
+            printf("fault %d: instruction %llu memory[%#x] bit %d: %s\n", i, (unsigned long long)f->index,
+                   f->location, f->bit, fault_names[f->outcome]);
+    }
+
+    printf("golden run: %llu instructions, faults in [%llu, %llu)\n", (unsigned long long)golden_instret,
+           (unsigned long long)ctx.window_start, (unsigned long long)ctx.window_end);
+
+    for (size_t i = 0; i < ARRAY_SIZE(counts); i++)
+        printf("%s: %d (%.1f%%)\n", fault_names[i], counts[i], 100.0 * counts[i] / ctx.fault_count);
+
+    for (int i = 0; i < ctx.checkpoint_count; i++)
+        free(ctx.checkpoints[i].memory);
+    free(ctx.checkpoints);
+    free(ctx.faults);
+    free(ctx.handlers);
+    free(ctx.output);
+    free(ctx.image);
+    lc3_free(&m);
+    return 0;
+}
+
+static const char *trap_names[] = { "GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT" };
+
+/* name of a routine for the report: its label, the trap name or its address */
+static void routine_name(const struct symbol_table *table, uint16_t addr, char *out, size_t size)
+{
+    for (int i = 0; i < table->count; i++)
+    {
+        if (table->symbols[i].address == addr)
+        {
+            snprintf(out, size, "%s", table->symbols[i].name);
+            return;
+        }
+    }
+
+    snprintf(out, size, "x%04X", addr);
+}
+
+/* `lc3sim analyze [data.obj...] prog.obj`: worst case instruction counts of the
+   program and its subroutines, found statically */
+static int analyze_main(int argc, char **argv)
+{
+    struct run_options opts = {0};
+    struct symbol_table table = {0};
+    struct reg_context none = {0};
+    struct analysis an;
+    const char *files[0x100];
+    int file_count = 0;
+    struct lc3_machine m;
+    uint16_t *origin;
+    uint16_t routines[0x100];
+    int routine_count;
+    uint64_t boot, total;
+    char name[0x40];
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strstr(argv[i], "--") == argv[i])
+        {
+            if (!parse_run_option(&opts, argv[i] + 2))
+                fprintf(stderr, "unknown option %s\n", argv[i]);
+        }
+        else if (file_count < (int)ARRAY_SIZE(files))
+            files[file_count++] = argv[i];
+    }
+
+    if (!file_count)
+    {
+        fprintf(stderr, "usage: lc3sim analyze [data.obj...] prog.obj [--memory=...]\n");
+        return 1;
+    }
+
+    lc3_init(&m);
+    memcpy(m.memory, OSProgram, sizeof(OSProgram));
+
+    for (int i = 0; i < file_count - 1; i++)
+    {
+        if (!load_object(files[i], m.memory, NULL))
+            fprintf(stderr, "Failed to load %s\n", files[i]);
+    }
+
+    if (!(origin = load_object(files[file_count - 1], m.memory, NULL)))
+    {
+        fprintf(stderr, "Failed to load %s\n", files[file_count - 1]);
+        return 1;
+    }
+
+    lc3_boot(&m, origin - m.memory, &opts);
+    load_symbols(files[file_count - 1], &table);
+    analysis_init(&an, m.memory);
+
+    boot = routine_cost(&an, cfg_get(&an, OS_START), &none);
+    total = sat_add(boot, routine_cost(&an, cfg_get(&an, origin - m.memory), &none));
+
+    routine_count = collect_routines(&an, origin - m.memory, routines, ARRAY_SIZE(routines));
+
+    for (int r = 0; r < routine_count; r++)
+    {
+        struct cfg *g = cfg_get(&an, routines[r]);
+        uint64_t cost = routine_cost(&an, g, &none);
+        int calls = 0;
+
+        routine_name(&table, g->entry, name, sizeof(name));
+        if (cost != WCET_UNBOUNDED)
+            printf("%s (x%04X): %llu instructions\n", name, g->entry, (unsigned long long)cost);
+        else
+            printf("%s (x%04X): unbounded%s\n", name, g->entry, g->uses_args ? " without known arguments" : "");
+
+        if (g->problem)
+            printf("  %s at x%04X\n", g->problem, g->problem_addr);
+
+        for (int li = 0; li < g->loop_count; li++)
+        {
+            struct cfg_loop *l = &g->loops[li];
+
+            if (l->bound != WCET_UNBOUNDED)
+                printf("  loop x%04X-x%04X: %llu iterations, %s\n", l->first, l->last, (unsigned long long)l->bound, l->reason);
+            else
+                printf("  loop x%04X-x%04X: unbounded, %s\n", l->first, l->last, l->reason);
+        }
+
+        for (int v = 0; v < g->count; v++)
+        {
+            uint16_t instr = m.memory[g->addr[v]];
+            int32_t target = call_target(m.memory, g->addr[v]);
+
+            if (instr >> 12 == 0b1111 && (instr & 0xff) >= 0x20 && (instr & 0xff) <= 0x25)
+                snprintf(name, sizeof(name), "%s", trap_names[(instr & 0xff) - 0x20]);
+            else if (instr >> 12 == 0b1111)
+                snprintf(name, sizeof(name), "TRAP x%02X", instr & 0xff);
+            else if (instr >> 12 == 0b0100 && target >= 0)
+                routine_name(&table, target, name, sizeof(name));
+            else if (instr >> 12 == 0b0100)
+                snprintf(name, sizeof(name), "JSRR R%d", (instr >> 6) & 0b111);
+            else
+                continue;
+
+            printf(calls++ ? ", %s" : "  calls %s", name);
+        }
+        if (calls) printf("\n");
+    }
+
+    if (total != WCET_UNBOUNDED)
+        printf("worst case from boot to halt: %llu instructions\n", (unsigned long long)total);
+    else
+        printf("worst case from boot to halt: unbounded\n");
+
+    if (!lint_program(m.memory, origin - m.memory, stdout))
+        printf("no uninitialized reads\n");
+
+    analysis_free(&an);
+    free(table.symbols);
+    lc3_free(&m);
+    return 0;
+}
+
+/* intervals [start, end) kept in a binary search tree on start, every node
+   also holds the largest end in its subtree so overlaps are found without
+   visiting every node */
+struct interval_node {
+    uint32_t start;
+    uint32_t end;
+    uint32_t max_end;
+    int id;
+    struct interval_node *left;
+    struct interval_node *right;
+};
+
+static struct interval_node *interval_insert(struct interval_node *root, uint32_t start, uint32_t end, int id)
+{
+    struct interval_node **link = &root;
+    struct interval_node *n = calloc(1, sizeof(*n));
+
+    n->start = start;
+    n->end = n->max_end = end;
+    n->id = id;
+
+    while (*link)
+    {
+        (*link)->max_end = MAX((*link)->max_end, end);
+        link = start < (*link)->start ? &(*link)->left : &(*link)->right;
+    }
+
+    *link = n;
+    return root;
+}
+
+/* some interval overlapping [start, end), NULL if there is none */
+static const struct interval_node *interval_overlap(const struct interval_node *n, uint32_t start, uint32_t end)
+{
+    while (n)
+    {
+        if (n->start < end && start < n->end)
+            return n;
+
+        /* the left subtree can only overlap if it reaches past start */
+        if (n->left && n->left->max_end > start)
+            n = n->left;
+        else
+            n = n->right;
+    }
+
+    return NULL;
+}
+
+static void interval_free(struct interval_node *n)
+{
+    if (!n) return;
+    interval_free(n->left);
+    interval_free(n->right);
+    free(n);
+}
+
+/* relocatable objects, all fields are big endian 16-bit words like .obj:
+   "LC3R", origin (REL_FLOATING to place anywhere), length, the words,
+   symbol count, symbols (value, kind, name length, name bytes padded to a
+   word), relocation count, relocations (offset, kind, symbol index or
+   REL_BASE) */
+#define REL_MAGIC "LC3R"
+#define REL_FLOATING 0xffff
+#define REL_BASE 0xffff
+
+/* symbol kinds */
+#define SYM_LOCAL 0
+#define SYM_EXPORT 1
+#define SYM_IMPORT 2
+
+/* relocation kinds, the field already holds an addend */
+#define RELOC_WORD 0
+#define RELOC_PC9 1
+#define RELOC_PC11 2
+
+struct link_symbol {
+    char name[0x40];
+    /* offset into the module, the resolved address for imports */
+    uint16_t value;
+    uint16_t kind;
+};
+
+struct link_reloc {
+    uint16_t offset;
+    uint16_t kind;
+    uint16_t symbol;
+};
+
+struct link_module {
+    const char *path;
+    uint16_t origin;
+    uint16_t base;
+    uint16_t length;
+    uint16_t *words;
+    struct link_symbol *symbols;
+    int symbol_count;
+    struct link_reloc *relocs;
+    int reloc_count;
+};
+
+static int read_word(FILE *file, uint16_t *word)
+{
+    int hi = getc(file), lo = getc(file);
+
+    if (hi == EOF || lo == EOF) return 0;
+    *word = hi << 8 | lo;
+    return 1;
+}
+
+static void write_word(FILE *file, uint16_t word)
+{
+    putc(word >> 8, file);
+    putc(word & 0xff, file);
+}
+
+static int load_relocatable(FILE *file, struct link_module *mod)
+{
+    uint16_t count;
+
+    if (!read_word(file, &mod->origin) || !read_word(file, &mod->length))
+        return 0;
+
+    mod->words = malloc(MAX(mod->length, 1) * sizeof(uint16_t));
+    for (int i = 0; i < mod->length; i++)
+    {
+        if (!read_word(file, &mod->words[i])) return 0;
+    }
+
+    if (!read_word(file, &count)) return 0;
+    mod->symbols = calloc(MAX(count, 1), sizeof(*mod->symbols));
+    for (mod->symbol_count = 0; mod->symbol_count < count; mod->symbol_count++)
+    {
+        struct link_symbol *sym = &mod->symbols[mod->symbol_count];
+        uint16_t size;
+
+        if (!read_word(file, &sym->value) || !read_word(file, &sym->kind) || !read_word(file, &size))
+            return 0;
+        for (int i = 0; i < (size + 1) / 2 * 2; i++)
+        {
+            int c = getc(file);
+
+            if (c == EOF) return 0;
+            if (i < size && i < (int)sizeof(sym->name) - 1) sym->name[i] = c;
+        }
+    }
+
+    if (!read_word(file, &count)) return 0;
+    mod->relocs = calloc(MAX(count, 1), sizeof(*mod->relocs));
+    for (mod->reloc_count = 0; mod->reloc_count < count; mod->reloc_count++)
+    {
+        struct link_reloc *r = &mod->relocs[mod->reloc_count];
+
+        if (!read_word(file, &r->offset) || !read_word(file, &r->kind) || !read_word(file, &r->symbol))
+            return 0;
+        if (r->offset >= mod->length || (r->symbol != REL_BASE && r->symbol >= mod->symbol_count))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* a relocatable object, or an .obj (fixed at its origin, every label in its .sym exported) */
+static int load_module(const char *path, struct link_module *mod)
+{
+    char magic[4];
+    FILE *file = fopen(path, "rb");
+    uint16_t *scratch, *base;
+    uint32_t length;
+    struct symbol_table table = {0};
+    int ok;
+
+    mod->path = path;
+    if (!file) return 0;
+
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && !memcmp(magic, REL_MAGIC, sizeof(magic)))
+    {
+        ok = load_relocatable(file, mod);
+        fclose(file);
+        return ok;
+    }
+    fclose(file);
+
+    scratch = calloc(0x10000, sizeof(uint16_t));
+    if (!(base = load_object(path, scratch, &length)) || length > 0xffff)
+    {
+        free(scratch);
+        return 0;
+    }
+
+    mod->origin = base - scratch;
+    mod->length = length;
+    mod->words = malloc(MAX(mod->length, 1) * sizeof(uint16_t));
+    memcpy(mod->words, base, mod->length * sizeof(uint16_t));
+    free(scratch);
+
+    load_symbols(path, &table);
+    mod->symbols = calloc(MAX(table.count, 1), sizeof(*mod->symbols));
+    for (int i = 0; i < table.count; i++)
+    {
+        struct link_symbol *sym = &mod->symbols[mod->symbol_count++];
+
+        strcpy(sym->name, table.symbols[i].name);
+        sym->value = table.symbols[i].address - mod->origin;
+        sym->kind = SYM_EXPORT;
+    }
+
+    free(table.symbols);
+    return 1;
+}
+
+/* write mod in the format load_relocatable reads */
+static int write_relocatable(const char *path, const struct link_module *mod)
+{
+    FILE *file = fopen(path, "wb");
+
+    if (!file) return 0;
+
+    fwrite(REL_MAGIC, 1, strlen(REL_MAGIC), file);
+    write_word(file, mod->origin);
+    write_word(file, mod->length);
+    for (int i = 0; i < mod->length; i++)
+        write_word(file, mod->words[i]);
+
+    write_word(file, mod->symbol_count);
+    for (int i = 0; i < mod->symbol_count; i++)
+    {
+        const struct link_symbol *sym = &mod->symbols[i];
+        size_t size = strlen(sym->name);
+
+        write_word(file, sym->value);
+        write_word(file, sym->kind);
+        write_word(file, size);
+        fwrite(sym->name, 1, size, file);
+        if (size & 1) putc(0, file);
+    }
+
+    write_word(file, mod->reloc_count);
+    for (int i = 0; i < mod->reloc_count; i++)
+    {
+        write_word(file, mod->relocs[i].offset);
+        write_word(file, mod->relocs[i].kind);
+        write_word(file, mod->relocs[i].symbol);
+    }
+
+    return fclose(file) == 0;
+}
+
+/* `lc3sim link -r [-o out.rel] [--float] [--import=NAME,...] prog.obj`: turn an
+   assembled .obj and its .sym into a relocatable module. lc3as has no external
+   symbols, so an import is a placeholder label (`MUL .BLKW 1`) and every
+   PC-relative instruction that targets it and every word equal to its address
+   becomes a relocation against it. --float also relocates every word equal to
+   the address of one of the module's own labels and lets the linker place it */
+static int link_relocatable(int argc, char **argv)
+{
+    struct link_module mod = {0};
+    const char *in_path = NULL;
+    const char *out_path = NULL;
+    char rel_path[0x400];
+    const char *dot;
+    char *imports[0x40];
+    int import_count = 0, floating = 0, errors = 0;
+    int imported = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out_path = argv[++i];
+        else if (!strcmp(argv[i], "--float"))
+            floating = 1;
+        else if (strstr(argv[i], "--import=") == argv[i])
+        {
+            for (char *name = strtok(argv[i] + 9, ","); name; name = strtok(NULL, ","))
+            {
+                if (import_count < (int)ARRAY_SIZE(imports))
+                    imports[import_count++] = name;
+            }
+        }
+        else if (!in_path && argv[i][0] != '-')
+            in_path = argv[i];
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!in_path)
+    {
+        fprintf(stderr, "usage: lc3sim link -r [-o out.rel] [--float] [--import=NAME,...] prog.obj\n");
+        return 1;
+    }
+
+    if (!load_module(in_path, &mod))
+    {
+        fprintf(stderr, "Failed to load %s\n", in_path);
+        return 1;
+    }
+
+    /* only a relocatable module comes with a relocation table */
+    if (mod.relocs)
+    {
+        fprintf(stderr, "%s is already relocatable\n", in_path);
+        errors++;
+    }
+
+    for (int i = 0; i < import_count; i++)
+    {
+        int s;
+
+        for (s = 0; s < mod.symbol_count; s++)
+        {
+            if (!strcasecmp(mod.symbols[s].name, imports[i])) break;
+        }
+
+        if (s == mod.symbol_count)
+        {
+            fprintf(stderr, "%s: no label %s to import\n", in_path, imports[i]);
+            errors++;
+            continue;
+        }
+        mod.symbols[s].kind = SYM_IMPORT;
+    }
+
+    /* at most one relocation per word */
+    mod.relocs = calloc(MAX(mod.length, 1), sizeof(*mod.relocs));
+    for (int i = 0; i < mod.length && !errors; i++)
+    {
+        uint16_t word = mod.words[i];
+        uint16_t addr = mod.origin + i;
+        int op = word >> 12;
+        struct link_reloc *rel = &mod.relocs[mod.reloc_count];
+        int found = 0;
+
+        rel->offset = i;
+        for (int s = 0; s < mod.symbol_count && !found; s++)
+        {
+            uint16_t target = mod.origin + mod.symbols[s].value;
+
+            if (mod.symbols[s].kind != SYM_IMPORT) continue;
+
+            if (word == target)
+            {
+                rel->kind = RELOC_WORD;
+                mod.words[i] = 0;
+            }
+            else if (((op == 0 && (word & 0x0e00)) || op == 2 || op == 3 || op == 10 || op == 11 || op == 14) &&
+                     (uint16_t)(addr + 1 + sext9(word & 0x1ff)) == target)
+            {
+                rel->kind = RELOC_PC9;
+                mod.words[i] &= ~0x1ff;
+            }
+            else if (op == 4 && (word & 0x0800) && (uint16_t)(addr + 1 + sext11(word & 0x7ff)) == target)
+            {
+                rel->kind = RELOC_PC11;
+                mod.words[i] &= ~0x7ff;
+            }
+            else
+                continue;
+
+            rel->symbol = s;
+            found = 1;
+        }
+
+        /* an address inside the module moves with it */
+        for (int s = 0; floating && s < mod.symbol_count && !found; s++)
+        {
+            if (mod.symbols[s].kind == SYM_IMPORT || word != (uint16_t)(mod.origin + mod.symbols[s].value)) continue;
+
+            rel->kind = RELOC_WORD;
+            rel->symbol = REL_BASE;
+            mod.words[i] = mod.symbols[s].value;
+            found = 1;
+        }
+
+        if (found) mod.reloc_count++;
+    }
+
+    if (errors)
+    {
+        free(mod.words);
+        free(mod.symbols);
+        free(mod.relocs);
+        return 1;
+    }
+
+    for (int s = 0; s < mod.symbol_count; s++)
+    {
+        if (mod.symbols[s].kind == SYM_IMPORT)
+        {
+            mod.symbols[s].value = 0;
+            imported++;
+        }
+    }
+    if (floating)
+        mod.origin = REL_FLOATING;
+
+    if (!out_path)
+    {
+        dot = strrchr(in_path, '.');
+        snprintf(rel_path, sizeof(rel_path), "%.*s.rel", dot ? (int)(dot - in_path) : (int)strlen(in_path), in_path);
+        out_path = rel_path;
+    }
+
+    if (!write_relocatable(out_path, &mod))
+    {
+        fprintf(stderr, "Failed to write %s\n", out_path);
+        errors++;
+    }
+    else
+        printf("wrote %s: %u words, %d exports, %d imports, %d relocations\n", out_path, mod.length,
+               mod.symbol_count - imported, imported, mod.reloc_count);
+
+    free(mod.words);
+    free(mod.symbols);
+    free(mod.relocs);
+    return errors ? 1 : 0;
+}
+
+/* `lc3sim link [-o out.obj] [--base=x3000] main.rel lib.rel ...`: place the
+   modules, resolve imports against exports and write one image and its .sym */
+static int link_main(int argc, char **argv)
+{
+    struct link_module mods[0x40] = {0};
+    struct interval_node *placed = NULL;
+    const char *out_path = "a.obj";
+    uint16_t base = 0x3000;
+    int count = 0, errors = 0;
+    uint32_t lo = 0x10000, hi = 0;
+    uint16_t *image;
+    char sym_path[0x400];
+    const char *dot;
+    FILE *file;
+
+    if (argc >= 2 && !strcmp(argv[1], "-r"))
+        return link_relocatable(argc - 1, argv + 1);
+
+    for (int i = 1; i < argc; i++)
+    {
+        unsigned value;
+
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out_path = argv[++i];
+        else if (sscanf(argv[i], "--base=%x", &value) == 1)
+            base = value;
+        else if (count < (int)ARRAY_SIZE(mods) && argv[i][0] != '-')
+        {
+            if (!load_module(argv[i], &mods[count]))
+            {
+                fprintf(stderr, "Failed to load %s\n", argv[i]);
+                return 1;
+            }
+            count++;
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!count)
+    {
+        fprintf(stderr, "usage: lc3sim link [-o out.obj] [--base=x3000] main.obj|.rel [module...]\n");
+        return 1;
+    }
+
+    /* fixed modules first, then the floating ones in the first gap that fits */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            struct link_module *mod = &mods[i];
+            const struct interval_node *other;
+            uint32_t start;
+
+            if ((mod->origin == REL_FLOATING) != pass) continue;
+
+            if (pass)
+            {
+                for (start = base; start + mod->length <= 0xfe00; start = other->end)
+                {
+                    if (!(other = interval_overlap(placed, start, start + mod->length)))
+                        break;
+                }
+
+                if (start + mod->length > 0xfe00)
+                {
+                    fprintf(stderr, "%s: no room for %u words above x%04X\n", mod->path, mod->length, base);
+                    errors++;
+                    continue;
+                }
+            }
+            else
+            {
+                start = mod->origin;
+                if ((other = interval_overlap(placed, start, start + mod->length)))
+                {
+                    fprintf(stderr, "%s (x%04X-x%04X) overlaps %s (x%04X-x%04X)\n", mod->path, start,
+                            start + mod->length - 1, mods[other->id].path, other->start, other->end - 1);
+                    errors++;
+                    continue;
+                }
+            }
+
+            mod->base = start;
+            if (mod->length)
+            {
+                placed = interval_insert(placed, start, start + mod->length, i);
+                lo = MIN(lo, start);
+                hi = MAX(hi, start + mod->length);
+            }
+        }
+    }
+
+    /* resolve imports */
+    for (int i = 0; i < count; i++)
+    {
+        for (int s = 0; s < mods[i].symbol_count; s++)
+        {
+            struct link_symbol *sym = &mods[i].symbols[s];
+            const struct link_module *found = NULL;
+
+            if (sym->kind != SYM_IMPORT) continue;
+
+            for (int j = 0; j < count; j++)
+            {
+                for (int k = 0; k < mods[j].symbol_count; k++)
+                {
+                    const struct link_symbol *def = &mods[j].symbols[k];
+
+                    if (def->kind != SYM_EXPORT || strcasecmp(def->name, sym->name)) continue;
+                    if (found)
+                    {
+                        fprintf(stderr, "%s: %s is defined in both %s and %s\n", mods[i].path, sym->name,
+                                found->path, mods[j].path);
+                        errors++;
+                    }
+                    found = &mods[j];
+                    sym->value = mods[j].base + def->value;
+                }
+            }
+
+            if (!found)
+            {
+                fprintf(stderr, "%s: undefined symbol %s\n", mods[i].path, sym->name);
+                errors++;
+            }
+        }
+    }
+
+    /* patch the references */
+    for (int i = 0; i < count && !errors; i++)
+    {
+        struct link_module *mod = &mods[i];
+
+        for (int r = 0; r < mod->reloc_count; r++)
+        {
+            struct link_reloc *rel = &mod->relocs[r];
+            uint16_t *word = &mod->words[rel->offset];
+            uint16_t addr = mod->base + rel->offset;
+            uint16_t target = rel->symbol == REL_BASE ? mod->base : mod->symbols[rel->symbol].kind == SYM_IMPORT
+                              ? mod->symbols[rel->symbol].value : mod->base + mod->symbols[rel->symbol].value;
+            int offset;
+
+            switch (rel->kind)
+            {
+                case RELOC_WORD:
+                    *word += target;
+                    continue;
+                case RELOC_PC9:
+                    offset = (int16_t)(target + sext9(*word & 0x1ff) - addr - 1);
+                    if (offset < -256 || offset > 255) break;
+                    *word = (*word & ~0x1ff) | (offset & 0x1ff);
+                    continue;
+                case RELOC_PC11:
+                    offset = (int16_t)(target + sext11(*word & 0x7ff) - addr - 1);
+                    if (offset < -1024 || offset > 1023) break;
+                    *word = (*word & ~0x7ff) | (offset & 0x7ff);
+                    continue;
+            }
+
+            fprintf(stderr, "%s: x%04X cannot reach x%04X\n", mod->path, addr, target);
+            errors++;
+        }
+    }
+
+    if (!errors && mods[0].base != lo)
+    {
+        fprintf(stderr, "%s has to be the lowest module to be the entry point, it is at x%04X and the image starts at x%04X\n",
+                mods[0].path, mods[0].base, lo);
+        errors++;
+    }
+
+    if (errors)
+    {
+        interval_free(placed);
+        return 1;
+    }
+
+    image = calloc(MAX(hi - lo, 1), sizeof(uint16_t));
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(image + mods[i].base - lo, mods[i].words, mods[i].length * sizeof(uint16_t));
+        printf("%s: x%04X-x%04X\n", mods[i].path, mods[i].base, mods[i].base + mods[i].length - 1);
+    }
+
+    if (!(file = fopen(out_path, "wb")))
+    {
+        fprintf(stderr, "Failed to open %s\n", out_path);
+        return 1;
+    }
+    write_word(file, lo);
+    for (uint32_t i = 0; i < hi - lo; i++)
+        write_word(file, image[i]);
+    fclose(file);
+
+    /* merged symbol table in the lc3as format */
+    dot = strrchr(out_path, '.');
+    snprintf(sym_path, sizeof(sym_path), "%.*s.sym", dot ? (int)(dot - out_path) : (int)strlen(out_path), out_path);
+    if (!(file = fopen(sym_path, "w")))
+    {
+        fprintf(stderr, "Failed to open %s\n", sym_path);
+        return 1;
+    }
+    fprintf(file, "// Symbol table\n// Scope level 0:\n//\tSymbol Name       Page Address\n//\t----------------  ------------\n");
+    for (int i = 0; i < count; i++)
+    {
+        for (int s = 0; s < mods[i].symbol_count; s++)
+        {
+            if (mods[i].symbols[s].kind != SYM_IMPORT)
+                fprintf(file, "//\t%-16s  %04X\n", mods[i].symbols[s].name, (uint16_t)(mods[i].base + mods[i].symbols[s].value));
+        }
+    }
+    fclose(file);
+
+    printf("wrote %s (x%04X-x%04X) and %s\n", out_path, lo, hi - 1, sym_path);
+
+    for (int i = 0; i < count; i++)
+    {
+        free(mods[i].words);
+        free(mods[i].symbols);
+        free(mods[i].relocs);
+    }
+    free(image);
+    interval_free(placed);
+    return 0;
+}
+
+/* --memo keeps the --json result of deterministic runs, keyed by a hash of
+   the booted machine and everything else that decides how it runs. a hit
+   touches the entry and the oldest entries are evicted once the directory
+   outgrows --memo-size, --memo-verify reruns that fraction of the hits */
+#define MEMO_VERSION 1
+#define MEMO_DEFAULT_SIZE (64ull << 20)
+
+/* the result of a run as printed by --json */
+static void json_result(struct text_buffer *tb, const struct lc3_machine *m, const struct run_options *opts, int halted)
+{
+    tb_printf(tb, "{\"halted\":%s,\"instructions\":%llu,\"cycles\":%llu,\"pc\":\"0x%04x\",\"psr\":\"0x%04x\",\"registers\":[",
+              halted ? "true" : "false", (unsigned long long)m->instret, (unsigned long long)m->cycles,
+              (unsigned)(m->pc - m->memory), m->memory[OS_PSR]);
+    for (int i = 0; i < 8; i++)
+        tb_printf(tb, "%s\"0x%04x\"", i ? "," : "", m->registers[i]);
+
+    tb_printf(tb, "],\"output\":");
+    tb_json_string(tb, m->output);
+
+    tb_printf(tb, ",\"memory\":{");
+    for (int i = 0; i < opts->dump_size; i++)
+        tb_printf(tb, "%s\"0x%04x\":\"0x%04x\"", i ? "," : "", opts->dump_addr[i], m->memory[opts->dump_addr[i]]);
+    tb_printf(tb, "}}");
+}
+
+/* why a run cannot be memoized, NULL if it can */
+static const char *memo_refusal(const struct run_options *opts)
+{
+    if (opts->randomize && !opts->has_seed) return "--randomize without --seed";
+    if (opts->debug) return "--debug";
+    if (opts->disk_path) return "--disk";
+    if (opts->shm_name) return "--shm";
+    if (opts->micro || opts->vcd_path) return "--micro and --vcd";
+    if (opts->cache_spec || opts->pipeline_spec || opts->branch_stats || opts->advise)
+        return "--cache, --pipeline, --branch-stats and --advise";
+    return NULL;
+}
+
+/* the loaded images, presets and seed all end up in the booted memory and
+   registers, the rest is the input and the options that change the run */
+static uint64_t memo_key(const struct lc3_machine *m, const struct run_options *opts)
+{
+    uint32_t version = MEMO_VERSION;
+    uint64_t key = fnv1a(FNV_OFFSET, &version, sizeof(version));
+
+    key = fnv1a(key, m->memory, LC3_MEMORY_WORDS * sizeof(uint16_t));
+    key = fnv1a(key, m->registers, sizeof(m->registers));
+    key = fnv1a(key, &opts->input_size, sizeof(opts->input_size));
+    key = fnv1a(key, opts->input_buffer, opts->input_size);
+    key = fnv1a(key, &opts->limit, sizeof(opts->limit));
+    key = fnv1a(key, &opts->dma, sizeof(opts->dma));
+    key = fnv1a(key, m->cost, sizeof(m->cost));
+    key = fnv1a(key, &m->cost_taken, sizeof(m->cost_taken));
+    key = fnv1a(key, &m->cost_int, sizeof(m->cost_int));
+    key = fnv1a(key, &opts->dump_size, sizeof(opts->dump_size));
+    return fnv1a(key, opts->dump_addr, opts->dump_size * sizeof(uint16_t));
+}
+
+static void memo_dir(const struct run_options *opts, char *out, size_t size)
+{
+    char dir[0x300];
+
+    if (*opts->memo_dir)
+    {
+        snprintf(out, size, "%s", opts->memo_dir);
+    }
+    else
+    {
+        asm_cache_dir(dir, sizeof(dir));
+        snprintf(out, size, "%s/memo", dir);
+    }
+    mkdir(out, 0755);
+}
+
+/* a uniform draw that --seed does not make repeat */
+static double memo_draw(void)
+{
+    struct timespec now;
+    pid_t pid = getpid();
+    uint64_t hash;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hash = fnv1a(fnv1a(FNV_OFFSET, &now, sizeof(now)), &pid, sizeof(pid));
+    return (hash >> 11) * 0x1p-53;
+}
+
+struct memo_entry {
+    char name[0x20];
+    time_t mtime;
+    long mtime_ns;
+    off_t size;
+};
+
+static int memo_entry_cmp(const void *a, const void *b)
+{
+    const struct memo_entry *x = a, *y = b;
+
+    if (x->mtime != y->mtime) return x->mtime < y->mtime ? -1 : 1;
+    return (x->mtime_ns > y->mtime_ns) - (x->mtime_ns < y->mtime_ns);
+}
+
+/* drop the least recently used entries until the directory fits in max bytes */
+static void memo_evict(const char *dir, uint64_t max)
+{
+    struct memo_entry *entries = NULL;
+    int count = 0, capacity = 0;
+    uint64_t total = 0;
+    char path[0x500];
+    struct dirent *ent;
+    struct stat st;
+    DIR *d = opendir(dir);
+
+    if (!d) return;
+
+    while ((ent = readdir(d)))
+    {
+        size_t len = strlen(ent->d_name);
+
+        if (len != 21 || strcmp(ent->d_name + 16, ".json")) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (stat(path, &st)) continue;
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 0x40;
+            entries = realloc(entries, capacity * sizeof(*entries));
+        }
+        memcpy(entries[count].name, ent->d_name, len + 1);
+        entries[count].mtime = st.st_mtim.tv_sec;
+        entries[count].mtime_ns = st.st_mtim.tv_nsec;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    if (total > max)
+    {
+        qsort(entries, count, sizeof(*entries), memo_entry_cmp);
+        for (int i = 0; i < count && total > max; i++)
+        {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+            /* a concurrent run may have evicted it already */
+            unlink(path);
+            total -= entries[i].size;
+        }
+    }
+
+    free(entries);
+}
+
+/* write the entry under a temporary name and rename it into place */
+static void memo_store(const char *dir, uint64_t key, const char *data, size_t size, uint64_t max)
+{
+    char tmp[0x400], path[0x400];
+    int fd, ok;
+
+    snprintf(tmp, sizeof(tmp), "%s/tmp-XXXXXX", dir);
+    if ((fd = mkstemp(tmp)) < 0) return;
+    ok = !fchmod(fd, 0644) && write(fd, data, size) == (ssize_t)size;
+    close(fd);
+
+    snprintf(path, sizeof(path), "%s/%016llx.json", dir, (unsigned long long)key);
+    if (!ok || rename(tmp, path))
+    {
+        unlink(tmp);
+        return;
+    }
+
+    memo_evict(dir, max);
+}
+
+/* `lc3sim batch` runs every job of a manifest against one program. The
+   manifest is the mutate format plus named fixtures: `fixture NAME args...`
+   declares run options, data objects and an expected output once, and a
+   job refers to it with `@NAME`. Objects are loaded when the fixture is
+   declared and copied into each job's memory from then on. The manifest is
+   read by its own thread into a bounded queue, so the workers start on the
+   first job while the rest of a large manifest is still being read */
+#define BATCH_MAX_FIXTURES 0x400
+#define BATCH_MAX_REFS 8
+#define BATCH_QUEUE 0x100
+#define BATCH_MAX_NODES 0x40
+/* --limit=auto results a worker keeps, by image */
+#define BATCH_LIMIT_CACHE 0x40
+
+/* words of one loaded object */
+struct batch_patch {
+    uint16_t start;
+    uint32_t length;
+    uint16_t *words;
+};
+
+struct batch_fixture {
+    char name[0x40];
+    /* manifest line that declared it */
+    int line;
+    struct run_options opts;
+    struct batch_patch *patches;
+    int patch_count;
+    /* console output the job must produce, NULL to only report the result */
+    char *expect;
+};
+
+struct batch_job {
+    int index;
+    int line;
+    /* the fixtures' options merged with the job's own */
+    struct run_options opts;
+    const char *expect;
+    const struct batch_fixture *refs[BATCH_MAX_REFS];
+    int ref_count;
+    /* objects and expectation given on the job line itself */
+    struct batch_fixture own;
+};
+
+/* what one worker did, for --worker-stats */
+/* the static bound of one booted image */
+struct batch_limit {
+    uint64_t key;
+    uint64_t limit;
+    int valid;
+};
+
+struct batch_worker_stats {
+    int cpu;
+    int node;
+    uint64_t jobs;
+    uint64_t instructions;
+    uint64_t ns;
+};
+
+struct batch_ctx {
+    const char *manifest;
+    FILE *file;
+    /* OS, data objects and program before boot, the program goes in again after the job's objects */
+    uint16_t *base;
+    struct batch_patch program;
+    uint16_t origin;
+    struct batch_fixture *fixtures;
+    int fixture_count;
+    /* lines the reader rejected without making a job of them */
+    int errors;
+    /* filled by the reader, drained by the workers */
+    struct batch_job *queue[BATCH_QUEUE];
+    int head, tail;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    _Atomic int passed, failed, unchecked, hung;
+    /* --pin-workers: worker i runs on slots[i % slot_count] */
+    struct cpu_slot *slots;
+    int slot_count;
+    /* --numa: a copy of base on every node, made by the first worker there.
+       fixture and job patches are small and stay shared */
+    int numa;
+    uint16_t *replicas[BATCH_MAX_NODES];
+    pthread_mutex_t replica_lock[BATCH_MAX_NODES];
+    struct batch_worker_stats *workers;
+    _Atomic int next_worker;
+};
+
+static void batch_patch_apply(uint16_t *memory, const struct batch_patch *p)
+{
+    memcpy(memory + p->start, p->words, p->length * sizeof(uint16_t));
+}
+
+/* hash of what makes a job's booted image differ from the others: the
+   fixtures, its own objects and the --memory presets */
+static uint64_t batch_image_key(const struct batch_job *job)
+{
+    uint64_t hash = fnv1a(FNV_OFFSET, job->refs, job->ref_count * sizeof(job->refs[0]));
+
+    for (int i = 0; i < job->own.patch_count; i++)
+    {
+        const struct batch_patch *p = &job->own.patches[i];
+
+        hash = fnv1a(hash, &p->start, sizeof(p->start));
+        hash = fnv1a(hash, &p->length, sizeof(p->length));
+        hash = fnv1a(hash, p->words, p->length * sizeof(uint16_t));
+    }
+
+    hash = fnv1a(hash, &job->opts.memory_size, sizeof(job->opts.memory_size));
+    hash = fnv1a(hash, job->opts.memory_set[0], job->opts.memory_size * sizeof(uint16_t));
+    return fnv1a(hash, job->opts.memory_set[1], job->opts.memory_size * sizeof(uint16_t));
+}
+
+static int batch_patch_load(struct batch_patch *p, const char *path, uint16_t *scratch)
+{
+    uint16_t *start = load_object(path, scratch, &p->length);
+
+    if (!start) return 0;
+
+    p->start = start - scratch;
+    p->words = malloc(p->length * sizeof(uint16_t));
+    memcpy(p->words, start, p->length * sizeof(uint16_t));
+    return 1;
+}
+
+static void batch_fixture_free(struct batch_fixture *f)
+{
+    for (int i = 0; i < f->patch_count; i++)
+        free(f->patches[i].words);
+    free(f->patches);
+    free(f->expect);
+}
 
-        sscanf(tok, "%x", &instr);
+/* add the options of a fixture to a job, lists are appended and the rest is overridden */
+static void merge_run_options(struct run_options *dst, const struct run_options *src)
+{
+    for (int i = 0; i < src->dump_size && dst->dump_size < (int)ARRAY_SIZE(dst->dump_addr); i++)
+        dst->dump_addr[dst->dump_size++] = src->dump_addr[i];
 
-        instr &= 0xffff;
-        dump_instr(instr);
-        return 0;
+    for (int i = 0; i < src->memory_size && dst->memory_size < (int)ARRAY_SIZE(dst->memory_set[0]); i++)
+    {
+        dst->memory_set[0][dst->memory_size] = src->memory_set[0][i];
+        dst->memory_set[1][dst->memory_size++] = src->memory_set[1][i];
     }
 
-    if (!strcmp(tok, "write"))
+    if (src->input_size)
     {
-        tok = strtok(NULL, " ");
-        unsigned addr, val;
-
-        if (!tok)
-        {
-            printf("Invalid parameter!\n");
-            return 0;
-        }
+        memcpy(dst->input_buffer, src->input_buffer, sizeof(dst->input_buffer));
+        dst->input_size = src->input_size;
+    }
 
-        sscanf(tok, "%x", &addr);
+    if (src->limit) dst->limit = src->limit;
+    if (src->timing) dst->timing = src->timing;
+    if (src->has_mem_latency)
+    {
+        dst->mem_latency = src->mem_latency;
+        dst->has_mem_latency = 1;
+    }
+    if (src->has_seed)
+    {
+        dst->seed = src->seed;
+        dst->has_seed = 1;
+    }
+    dst->limit_auto |= src->limit_auto;
+    dst->randomize |= src->randomize;
+    dst->dma |= src->dma;
+    dst->advise |= src->advise;
+}
 
-        tok = strtok(NULL, " ");
+/* parse the arguments of a fixture or job line into f, 0 on error */
+static int batch_parse(struct batch_ctx *ctx, int line, char **args, int count,
+                       struct batch_fixture *f, struct batch_job *job, uint16_t *scratch)
+{
+    /* merge the fixtures first so the job's own options win wherever they are on the line */
+    for (int i = 0; i < count; i++)
+    {
+        char *arg = args[i];
 
-        if (!tok)
+        if (arg[0] == '@')
         {
-            printf("Invalid parameter!\n");
-            return 0;
-        }
-
-        sscanf(tok, "%x", &val);
+            int k;
 
-        addr &= 0xffff;
-        val &= 0xffff;
+            for (k = 0; k < ctx->fixture_count && strcmp(ctx->fixtures[k].name, arg + 1); k++);
 
-        memory[addr] = val;
-        printf("memory[%#x]=%#x\n", addr, val);
-        memcpy(ctx->last, string, ARRAY_SIZE(string));
+            if (!job)
+            {
+                fprintf(stderr, "%s:%d: fixtures cannot refer to other fixtures\n", ctx->manifest, line);
+                return 0;
+            }
+            if (k == ctx->fixture_count)
+            {
+                fprintf(stderr, "%s:%d: unknown fixture %s\n", ctx->manifest, line, arg + 1);
+                return 0;
+            }
+            if (job->ref_count == BATCH_MAX_REFS)
+            {
+                fprintf(stderr, "%s:%d: more than %d fixtures\n", ctx->manifest, line, BATCH_MAX_REFS);
+                return 0;
+            }
 
-        return 0;
+            job->refs[job->ref_count++] = &ctx->fixtures[k];
+            merge_run_options(&job->opts, &ctx->fixtures[k].opts);
+            if (ctx->fixtures[k].expect)
+                job->expect = ctx->fixtures[k].expect;
+        }
     }
 
-    if (!strcmp(tok, "reg"))
+    for (int i = 0; i < count; i++)
     {
-        tok = strtok(NULL, " ");
+        char *arg = args[i];
 
-        if (!tok)
+        if (arg[0] == '@')
         {
-            printf("Invalid parameter!\n");
-            return 0;
+            /* merged above */
         }
-
-        if (!strcmp(tok, "list") || !strcmp(tok, "show"))
+        else if (strstr(arg, "--expect=") == arg)
         {
-            dump_registers(registers, memory[OS_PSR], *pc - memory, **pc);
-            memcpy(ctx->last, string, ARRAY_SIZE(string));
-            return 0;
+            free(f->expect);
+            f->expect = strdup(arg + 9);
         }
-        else if (!strcmp(tok, "clear"))
+        else if (strstr(arg, "--expect-file=") == arg)
         {
-            memset(registers, 0, 8 * sizeof(uint16_t));
-            memcpy(ctx->last, string, ARRAY_SIZE(string));
-            return 0;
+            size_t size;
+            char *text = map_file(arg + 14, &size);
+
+            free(f->expect);
+            f->expect = text ? strndup(text, size) : strdup("");
+            if (text)
+                munmap(text, size);
+            else
+                fprintf(stderr, "%s:%d: failed to read %s, expecting no output\n", ctx->manifest, line, arg + 14);
         }
-        else if (!strcmp(tok, "set"))
+        else if (!strcmp(arg, "--json"))
         {
-            tok = strtok(NULL, " ");
-            unsigned num;
-            unsigned value;
+            /* every result is printed as json already */
+        }
+        else if (strstr(arg, "--") == arg)
+        {
+            struct run_options *opts = job ? &job->opts : &f->opts;
+            const char *unsupported;
 
-            if (!tok)
+            if (!parse_run_option(opts, arg + 2))
             {
-                printf("Invalid parameter!\n");
+                fprintf(stderr, "%s:%d: unknown option %s\n", ctx->manifest, line, arg);
                 return 0;
             }
-
-            sscanf(tok, "R%u", &num);
-
-            tok = strtok(NULL, " ");
-
-            if (!tok)
+            else if ((unsupported = run_option_unsupported(opts, 1)))
             {
-                printf("Invalid parameter!\n");
+                fprintf(stderr, "%s:%d: %s is not supported in a batch\n", ctx->manifest, line, unsupported);
+                return 0;
+            }
+        }
+        else
+        {
+            f->patches = realloc(f->patches, (f->patch_count + 1) * sizeof(*f->patches));
+            if (!batch_patch_load(&f->patches[f->patch_count], arg, scratch))
+            {
+                fprintf(stderr, "%s:%d: failed to load %s\n", ctx->manifest, line, arg);
                 return 0;
             }
+            f->patch_count++;
+        }
+    }
 
-            sscanf(tok, "%x", &value);
+    if (job && f->expect)
+        job->expect = f->expect;
+    return 1;
+}
 
-            registers[num] = value;
+static void batch_push(struct batch_ctx *ctx, struct batch_job *job)
+{
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->tail - ctx->head == BATCH_QUEUE)
+        pthread_cond_wait(&ctx->not_full, &ctx->lock);
+    ctx->queue[ctx->tail++ % BATCH_QUEUE] = job;
+    pthread_cond_signal(&ctx->not_empty);
+    pthread_mutex_unlock(&ctx->lock);
+}
 
-            memcpy(ctx->last, string, ARRAY_SIZE(string));
-            return 0;
-        }
+/* NULL once the manifest is exhausted */
+static struct batch_job *batch_pop(struct batch_ctx *ctx)
+{
+    struct batch_job *job = NULL;
 
-        printf("Invalid parameter!\n");
-        return 0;
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->head == ctx->tail && !ctx->done)
+        pthread_cond_wait(&ctx->not_empty, &ctx->lock);
+    if (ctx->head != ctx->tail)
+    {
+        job = ctx->queue[ctx->head++ % BATCH_QUEUE];
+        pthread_cond_signal(&ctx->not_full);
     }
+    pthread_mutex_unlock(&ctx->lock);
 
-    if (!strcmp(tok, "break"))
+    return job;
+}
+
+/* parse_run_option uses strtok, so all parsing stays on this thread */
+static void *batch_reader(void *arg)
+{
+    struct batch_ctx *ctx = arg;
+    uint16_t *scratch = calloc(LC3_MEMORY_WORDS, sizeof(uint16_t));
+    char line[0x1000];
+    int number = 0, index = 0;
+
+    while (fgets(line, sizeof(line), ctx->file))
     {
-        tok = strtok(NULL, " ");
-        unsigned addr;
+        char *args[0x40];
+        size_t size = strlen(line);
+        struct batch_job *job;
+        int count, c;
 
-        if (!tok)
+        number++;
+
+        /* fgets splits a longer line, which must not become two jobs */
+        if (size == sizeof(line) - 1 && line[size - 1] != '\n' && (c = getc(ctx->file)) != EOF && c != '\n')
         {
-            printf("Invalid parameter!\n");
-            return 0;
+            while ((c = getc(ctx->file)) != EOF && c != '\n');
+            fprintf(stderr, "%s:%d: line is longer than %d characters\n", ctx->manifest, number, (int)sizeof(line) - 2);
+            ctx->errors++;
+            continue;
         }
 
-        if (!strcmp(tok, "add") || !strcmp(tok, "push"))
+        if (!(count = split_args(line, args, ARRAY_SIZE(args)))) continue;
+
+        if (!strcmp(args[0], "fixture"))
         {
-            tok = strtok(NULL, " ");
+            struct batch_fixture *f = &ctx->fixtures[ctx->fixture_count];
+            int k;
 
-            if (!tok)
+            if (count < 2 || ctx->fixture_count == BATCH_MAX_FIXTURES)
             {
-                printf("Invalid parameter!\n");
-                return 0;
+                fprintf(stderr, "%s:%d: expected `fixture NAME args...`, at most %d of them\n",
+                        ctx->manifest, number, BATCH_MAX_FIXTURES);
+                ctx->errors++;
+                continue;
             }
 
-            sscanf(tok, "%x\n", &addr);
-
-            addr &= 0xffff;
+            for (k = 0; k < ctx->fixture_count && strcmp(ctx->fixtures[k].name, args[1]); k++);
+            if (k < ctx->fixture_count)
+            {
+                fprintf(stderr, "%s:%d: fixture %s is already declared on line %d\n",
+                        ctx->manifest, number, args[1], ctx->fixtures[k].line);
+                ctx->errors++;
+                continue;
+            }
 
-            for (int i = 0; i < ctx->breakpoint_size; i++)
+            memset(f, 0, sizeof(*f));
+            snprintf(f->name, sizeof(f->name), "%s", args[1]);
+            f->line = number;
+            if (batch_parse(ctx, number, args + 2, count - 2, f, NULL, scratch))
+                ctx->fixture_count++;
+            else
             {
-                if (addr == ctx->breakpoints[i])
-                {
-                    printf("breakpoint already set at %#x\n", addr);
-                    memcpy(ctx->last, string, ARRAY_SIZE(string));
-                    return 0;
-                }
+                batch_fixture_free(f);
+                ctx->errors++;
             }
+            continue;
+        }
 
-            ctx->breakpoints[ctx->breakpoint_size++] = addr;
+        job = calloc(1, sizeof(*job));
+        job->index = ++index;
+        job->line = number;
+        if (!batch_parse(ctx, number, args, count, &job->own, job, scratch))
+        {
+            /* still reported, as a failure */
+            job->ref_count = -1;
+        }
+        batch_push(ctx, job);
+    }
 
-            printf("breakpoint set at %#x\n", addr);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->done = 1;
+    pthread_cond_broadcast(&ctx->not_empty);
+    pthread_mutex_unlock(&ctx->lock);
+
+    free(scratch);
+    return NULL;
+}
+
+static void *batch_worker(void *arg)
+{
+    struct batch_ctx *ctx = arg;
+    struct batch_worker_stats *stats = &ctx->workers[atomic_fetch_add(&ctx->next_worker, 1)];
+    const uint16_t *base = ctx->base;
+    struct batch_limit limits[BATCH_LIMIT_CACHE] = {0};
+    uint32_t *profile = NULL;
+    struct lc3_machine m;
+    struct batch_job *job;
+    uint64_t start;
+
+    stats->cpu = -1;
+    if (ctx->slots)
+    {
+        const struct cpu_slot *slot = &ctx->slots[(stats - ctx->workers) % ctx->slot_count];
+
+        if (pin_thread(slot->cpu))
+        {
+            stats->cpu = slot->cpu;
+            stats->node = slot->node;
         }
-        else if (!strcmp(tok, "rm") || !strcmp(tok, "remove"))
+    }
+
+    /* pages go to the node of the thread that first touches them, so the
+       machine and the replica are only written once the worker is pinned */
+    if (ctx->numa && stats->cpu >= 0 && stats->node < BATCH_MAX_NODES)
+    {
+        /* one lock per node, so copying never holds up the job queue or the other nodes */
+        pthread_mutex_t *lock = &ctx->replica_lock[stats->node];
+        uint16_t *copy;
+
+        pthread_mutex_lock(lock);
+        if (!ctx->replicas[stats->node] && (copy = malloc(LC3_MEMORY_WORDS * sizeof(uint16_t))))
         {
-            tok = strtok(NULL, " ");
-            unsigned addr;
+            memcpy(copy, ctx->base, LC3_MEMORY_WORDS * sizeof(uint16_t));
+            ctx->replicas[stats->node] = copy;
+        }
+        /* without a copy the node reads the shared image */
+        if (ctx->replicas[stats->node])
+            base = ctx->replicas[stats->node];
+        pthread_mutex_unlock(lock);
+    }
 
-            sscanf(tok, "%x\n", &addr);
+    lc3_init(&m);
+    start = monotonic_ns();
 
-            addr &= 0xffff;
+    while ((job = batch_pop(ctx)))
+    {
+        struct text_buffer out = {0};
+        int halted = 0, pass = 0;
 
-            for (int i = 0; i < ctx->breakpoint_size; i++)
+        if (job->ref_count < 0)
+        {
+            atomic_fetch_add(&ctx->failed, 1);
+            tb_printf(&out, "{\"job\":%d,\"line\":%d,\"pass\":false,\"error\":\"invalid job\"}\n", job->index, job->line);
+        }
+        else
+        {
+            lc3_reset(&m, base, 0);
+            for (int i = 0; i < job->ref_count; i++)
             {
-                if (addr == ctx->breakpoints[i])
+                for (int j = 0; j < job->refs[i]->patch_count; j++)
+                    batch_patch_apply(m.memory, &job->refs[i]->patches[j]);
+            }
+            for (int j = 0; j < job->own.patch_count; j++)
+                batch_patch_apply(m.memory, &job->own.patches[j]);
+            batch_patch_apply(m.memory, &ctx->program);
+
+            /* rand() is shared between threads, every job gets its own sequence */
+            if (job->opts.randomize)
+            {
+                unsigned seed = job->opts.has_seed ? job->opts.seed : (unsigned)job->line;
+                for (int i = 0; i < 8; i++)
+                    m.registers[i] = rand_r(&seed);
+            }
+
+            lc3_boot(&m, ctx->origin, &job->opts);
+            m.silent = 1;
+
+            /* the analysis costs more than most jobs, do it once per image */
+            if (job->opts.limit_auto)
+            {
+                uint64_t key = batch_image_key(job);
+                struct batch_limit *slot = &limits[key % BATCH_LIMIT_CACHE];
+
+                if (!slot->valid || slot->key != key)
                 {
-                    memmove(ctx->breakpoints + i, ctx->breakpoints + i + 1, (ctx->breakpoint_size - i - 1) * sizeof(uint16_t));
-                    ctx->breakpoint_size--;
-                    printf("breakpoint removed at %#x\n", addr);
-                    memcpy(ctx->last, string, ARRAY_SIZE(string));
-                    return 0;
+                    slot->key = key;
+                    slot->limit = static_limit(m.memory, ctx->origin);
+                    slot->valid = 1;
                 }
+                if (slot->limit)
+                    job->opts.limit = slot->limit;
             }
 
-            printf("breakpoint not found!\n");
-        }
-        else if (!strcmp(tok, "pop"))
-        {
-            unsigned addr;
-
-            if (ctx->breakpoint_size > 0)
+            if (job->opts.advise)
             {
-                addr = ctx->breakpoints[--ctx->breakpoint_size];
-                printf("breakpoint removed at %#x\n", addr);
-            } else {
-                printf("no breakpoints available to remove!\n");
+                uint64_t limit = job->opts.limit ? job->opts.limit : MUTATE_DEFAULT_LIMIT;
+
+                /* the worker's own profile, counted the way main does for --advise */
+                if (!profile)
+                    profile = malloc(0x10000 * sizeof(uint32_t));
+                memset(profile, 0, 0x10000 * sizeof(uint32_t));
+
+                while (lc3_running(&m) && m.instret < limit)
+                {
+                    profile[m.pc - m.memory]++;
+                    if (lc3_step(&m) < 0) break;
+                }
+                halted = !lc3_running(&m);
             }
-        }
-        else if (!strcmp(tok, "list") || !strcmp(tok, "show"))
-        {
-            for (int i = 0; i < ctx->breakpoint_size; i++)
+            else
+                halted = lc3_run(&m, job->opts.limit ? job->opts.limit : MUTATE_DEFAULT_LIMIT);
+            stats->instructions += m.instret;
+            pass = halted && (!job->expect || !strcmp(m.output, job->expect));
+
+            if (!halted)
+                atomic_fetch_add(&ctx->hung, 1);
+            if (!job->expect && halted)
+                atomic_fetch_add(&ctx->unchecked, 1);
+            else
+                atomic_fetch_add(pass ? &ctx->passed : &ctx->failed, 1);
+
+            tb_printf(&out, "{\"job\":%d,\"line\":%d,\"pass\":%s,\"result\":", job->index, job->line,
+                      job->expect || !halted ? (pass ? "true" : "false") : "null");
+            json_result(&out, &m, &job->opts, halted);
+            if (job->opts.advise)
             {
-                printf("breakpoint[%d] = %#x\n", i, ctx->breakpoints[i]);
+                tb_printf(&out, ",\"advice\":");
+                advise_json(m.memory, ctx->origin, profile, &out);
             }
-        }
-        else if (!strcmp(tok, "clear"))
-        {
-            ctx->breakpoint_size = 0;
-        }
-        else
-        {
-            printf("Invalid parameter!\n");
-            return 0;
+            tb_printf(&out, "}\n");
         }
 
-        memcpy(ctx->last, string, ARRAY_SIZE(string));
+        /* one write per line keeps the workers' lines whole */
+        fwrite(out.data, 1, out.size, stdout);
+        free(out.data);
 
-        return 0;
+        batch_fixture_free(&job->own);
+        free(job);
+        stats->jobs++;
     }
 
-    printf("invalid command: %s\n", string);
-    return 0;
+    stats->ns = monotonic_ns() - start;
+    free(profile);
+    lc3_free(&m);
+    return NULL;
 }
 
-//#define LC3_EXTENDED
-
-#ifdef LC3_EXTENDED
-
-/* LC-3e: parse 2 word extended instructions */
-static void parse_extended(uint16_t instr1, uint16_t instr2, uint16_t *memory, uint16_t *registers)
+/* `lc3sim batch [-jN] [data.obj...] prog.obj jobs.manifest`: print a JSON
+   result for every job, in the order they finish */
+static int batch_main(int argc, char **argv)
 {
-    uint16_t op = ((instr1 & 0x3) << 4) | (instr2 & (0xf << 12)) >> 12;
-    uint16_t dst = (instr2 & (0b111 << 9)) >> 9;
-    uint16_t sr1 = (instr2 & (0b111 << 6)) >> 6;
-    uint16_t sr2 = instr2 & 0b111;
-    int16_t imm5 = sext5(instr2 & 0b11111);
-
-    switch (op)
+    struct batch_ctx ctx = {0};
+    const char *files[0x100];
+    int file_count = 0;
+    int jobs = 0, pin = 0, worker_stats = 0;
+    int physical;
+    uint16_t *start;
+    pthread_t reader;
+
+    for (int i = 1; i < argc; i++)
     {
-        case 0b000000: /* MUL (signed) */
+        if (strstr(argv[i], "-j") == argv[i])
+            jobs = atoi(argv[i] + 2);
+        else if (strstr(argv[i], "--jobs=") == argv[i])
+            jobs = atoi(argv[i] + 7);
+        else if (!strcmp(argv[i], "--pin-workers"))
+            pin = 1;
+        else if (!strcmp(argv[i], "--numa"))
+            pin = ctx.numa = 1;
+        else if (!strcmp(argv[i], "--worker-stats"))
+            worker_stats = 1;
+        else if (argv[i][0] == '-')
         {
-            if (instr2 & (1 << 5))
-            {
-                registers[dst] = registers[sr1] * imm5;
-            } else {
-                registers[dst] = (int16_t)registers[sr1] * (int16_t)registers[sr2];
-            }
-
-            break;
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
         }
-        case 0b000001: /* DIV (signed) */
-        {
-            /* divide by 0 -> divide by 1 to avoid creating new exceptions */
-            if (instr2 & (1 << 5))
-            {
-                if (imm5 == 0) imm5 = 1;
-                registers[dst] = registers[sr1] / imm5;
-            } else {
-                int16_t v = registers[sr2];
-                if (v == 0) v = 1;
-                registers[dst] = (int16_t)registers[sr1] / v;
-            }
+        else if (file_count < (int)ARRAY_SIZE(files))
+            files[file_count++] = argv[i];
+    }
 
-            break;
-        }
-        case 0b000010: /* RSHIFT +/- imm6 */
-        {
-            break;
-        }
-        case 0b000100: /* XCHG (exchange) */
-        {
+    ctx.slots = calloc(CPU_SETSIZE, sizeof(*ctx.slots));
+    physical = cpu_slots(ctx.slots, &ctx.slot_count);
+
+    /* SMT siblings share an execution core, the emulator gains little from them */
+    if (!jobs && !(jobs = physical))
+        jobs = default_jobs();
+
+    if (file_count < 2 || jobs < 1)
+    {
+        fprintf(stderr, "usage: lc3sim batch [-jN] [--pin-workers] [--numa] [--worker-stats] [data.obj...] prog.obj jobs.manifest\n");
+        return 1;
+    }
+
+    if (!pin || !ctx.slot_count)
+    {
+        if (pin)
+            fprintf(stderr, "No CPU topology, running without --pin-workers\n");
+        free(ctx.slots);
+        ctx.slots = NULL;
+        ctx.numa = 0;
+    }
+    ctx.workers = calloc(jobs, sizeof(*ctx.workers));
 
-            break;
-        }
-        case 0b0010000: /* OR */
-        {
+    ctx.manifest = files[file_count - 1];
+    if (!(ctx.file = fopen(ctx.manifest, "r")))
+    {
+        fprintf(stderr, "Failed to open %s\n", ctx.manifest);
+        return 1;
+    }
 
-            break;
-        }
-        case 0b0010001: /* XOR */
-        {
+    ctx.base = calloc(LC3_MEMORY_WORDS, sizeof(uint16_t));
+    memcpy(ctx.base, OSProgram, sizeof(OSProgram));
+    for (int i = 0; i < file_count - 2; i++)
+    {
+        if (!load_object(files[i], ctx.base, NULL))
+            fprintf(stderr, "Failed to load %s\n", files[i]);
+    }
 
-            break;
-        }
-        default:
-        {
-            /* TODO: throw invalid instruction exception */
-            break;
-        }
+    if (!(start = load_object(files[file_count - 2], ctx.base, &ctx.program.length)))
+    {
+        fprintf(stderr, "Failed to load %s\n", files[file_count - 2]);
+        return 1;
+    }
+    ctx.origin = ctx.program.start = start - ctx.base;
+    ctx.program.words = malloc(ctx.program.length * sizeof(uint16_t));
+    memcpy(ctx.program.words, start, ctx.program.length * sizeof(uint16_t));
+
+    ctx.fixtures = calloc(BATCH_MAX_FIXTURES, sizeof(*ctx.fixtures));
+    pthread_mutex_init(&ctx.lock, NULL);
+    for (int i = 0; i < BATCH_MAX_NODES; i++)
+        pthread_mutex_init(&ctx.replica_lock[i], NULL);
+    pthread_cond_init(&ctx.not_empty, NULL);
+    pthread_cond_init(&ctx.not_full, NULL);
+
+    if (pthread_create(&reader, NULL, batch_reader, &ctx))
+    {
+        fprintf(stderr, "Failed to start the manifest reader\n");
+        return 1;
     }
-}
 
-#endif
+    run_workers(jobs, batch_worker, &ctx);
+    pthread_join(reader, NULL);
+    fclose(ctx.file);
 
-#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+    fprintf(stderr, "jobs: %d, passed: %d, failed: %d (%d by not halting), no expected output: %d\n",
+            ctx.passed + ctx.failed + ctx.unchecked, ctx.passed, ctx.failed, ctx.hung, ctx.unchecked);
+
+    for (int i = 0; i < jobs && worker_stats; i++)
+    {
+        const struct batch_worker_stats *w = &ctx.workers[i];
+        double seconds = w->ns ? w->ns / 1e9 : 1e-9;
+
+        if (w->cpu >= 0)
+            fprintf(stderr, "worker %d (cpu %d, node %d): ", i, w->cpu, w->node);
+        else
+            fprintf(stderr, "worker %d: ", i);
+        fprintf(stderr, "%llu jobs, %.0f jobs/s, %.1fM instructions/s\n", (unsigned long long)w->jobs,
+                w->jobs / seconds, w->instructions / seconds / 1e6);
+    }
+
+    for (int i = 0; i < BATCH_MAX_NODES; i++)
+    {
+        free(ctx.replicas[i]);
+        pthread_mutex_destroy(&ctx.replica_lock[i]);
+    }
+    free(ctx.workers);
+    free(ctx.slots);
+
+    for (int i = 0; i < ctx.fixture_count; i++)
+        batch_fixture_free(&ctx.fixtures[i]);
+    free(ctx.fixtures);
+    free(ctx.program.words);
+    free(ctx.base);
+    pthread_mutex_destroy(&ctx.lock);
+    pthread_cond_destroy(&ctx.not_empty);
+    pthread_cond_destroy(&ctx.not_full);
+    return ctx.failed || ctx.errors ? 1 : 0;
+}
 
 int main(int argc, char **argv)
 {
-    uint16_t *pc;
-    /* LC-3 can only address [0, 0xffff] but we have extra few values for ssp, usp, pc, registers */
-    uint16_t *memory = calloc(0x10000 + 2, sizeof(uint16_t));
-    uint16_t registers[8] = {0};
+    struct lc3_machine machine;
+    struct lc3_machine *m = &machine;
+    struct run_options opts = {0};
     struct debugger_ctx debug_ctx = {0};
-    int ddrsize = 0x100;
-    char *buffer = calloc(ddrsize, sizeof(char));
-    int ddrct = 0;
-    int debug = 0;
-    uint16_t dump_addr[0x100] = {0};
-    uint16_t memory_set[2][0x100] = {0};
-    uint8_t input_buffer[0x100] = {0};
-    int input_size = 0;
-    int input_index = 0;
-    int memory_size = 0;
-    int dump_size = 0;
-    int silent = 0;
-    int randomize = 0;
+    struct lc3_shm_state *shm = NULL;
+    struct lc3_micro micro = { .state = UCODE_FETCH, .last = -1 };
+    /* ISA engine run in lockstep with --micro */
+    struct lc3_machine isa = {0};
+    struct vcd_writer *vcd = NULL;
+    struct cache_system *cache = NULL;
+    struct pipe_ring *pipe = NULL;
+    struct branch_stats *branches = NULL;
+    /* executions per address for --advise */
+    uint32_t *profile = NULL;
+    /* --memo entry being checked by --memo-verify */
+    char memo_path[0x380];
+    uint64_t key = 0;
+    void *stored = NULL;
+    size_t stored_size = 0;
+    uint16_t *pc;
+    uint16_t *memory;
+    int halted;
+
+    if (argc >= 2 && !strcmp(argv[1], "inspect"))
+        return inspect_main(argc - 1, argv + 1);
+
+    if (argc >= 2 && !strcmp(argv[1], "mutate"))
+        return mutate_main(argc - 1, argv + 1);
+
+    if (argc >= 2 && !strcmp(argv[1], "equiv"))
+        return equiv_main(argc - 1, argv + 1);
+
+    if (argc >= 2 && !strcmp(argv[1], "inject"))
+        return inject_main(argc - 1, argv + 1);
+
+    if (argc >= 2 && !strcmp(argv[1], "analyze"))
+        return analyze_main(argc - 1, argv + 1);
+
+    if (argc >= 2 && !strcmp(argv[1], "link"))
+        return link_main(argc - 1, argv + 1);
+
+    if (argc >= 2 && !strcmp(argv[1], "batch"))
+        return batch_main(argc - 1, argv + 1);
+
+    lc3_init(m);
+    memory = m->memory;
 
     memcpy(memory, OSProgram, sizeof(OSProgram));
 
     {
+        struct load_segment *segments = calloc(argc, sizeof(*segments));
+        int segment_count = 0;
+
         /* parse additional programs/data */
         for (int i = 1; i < argc; i++)
         {
@@ -1718,408 +10044,417 @@ int main(int argc, char **argv)
             if (strstr(arg, "--") == arg)
             {
                 arg += 2;
-                if (strstr(arg, "dump=") == arg)
-                {
-                    char *tok;
-                    unsigned addr;
-                    arg += 5;
-                    tok = strtok(arg, ",");
-
-                    do
-                    {
-                        sscanf(tok, "%x", &addr);
-
-                        dump_addr[dump_size] = addr & 0xffff;
-                        dump_size++;
-                        dump_size %= ARRAY_SIZE(dump_addr);
-
-                    } while ((tok = strtok(NULL, ",")));
-                }
-                else if (!strcmp(arg, "help"))
+                if (!strcmp(arg, "help"))
                 {
                     printf("Welcome to the LC-3 simulator!\n");
                     printf("Here are the supported command line flags:\n\n");
                     printf("--help: Prints this menu\n");
                     printf("--debug: Enables the debugger\n");
-                    printf("--dump=0xeceb,0xbeef,etc: Dump specified memory addresses on simulator exit\n\n");
+                    printf("--dump=0xeceb,0xbeef,etc: Dump specified memory addresses on simulator exit\n");
+                    printf("--limit=N|auto: Stop after N instructions, auto uses the static worst case\n");
+                    printf("--shm=NAME: Publish machine state for `lc3sim inspect NAME`\n");
+                    printf("--dma: Enable the DMA controller at 0xFE10-0xFE16\n");
+                    printf("--disk=FILE: Map FILE as a block device at 0xFE18-0xFE1E\n");
+                    printf("--timing=fsm[,mem=N]: Charge cycles like the textbook state machine\n");
+                    printf("--stats: Print instruction and cycle counts on exit\n");
+                    printf("--micro: Run on the microsequencer, checked against the ISA engine\n");
+                    printf("--vcd=FILE: Write a waveform of the registers and devices to FILE\n");
+                    printf("--cache=L1:size,assoc,line[,L2:...]: Simulate caches, see README\n");
+                    printf("--pipeline[=noforward,static|1bit|2bit,loaduse=N]: Model a 5 stage pipeline\n");
+                    printf("--branch-stats: Profile every conditional branch and compare predictors\n");
+                    printf("--lint: Warn about registers and condition codes read before they are set\n");
+                    printf("--advise: Suggest peephole improvements ranked by the instructions they save\n");
+                    printf("--load-map: Print where every file was loaded\n");
+                    printf("--strict-load: Refuse to run when loaded files overlap each other or the OS vectors\n");
+                    printf("--seed=N: Make --randomize repeatable\n");
+                    printf("--json: Print the result as a JSON object\n");
+                    printf("--memo[=DIR]: Reuse the stored --json result of an identical run\n");
+                    printf("--memo-size=MB: Evict the least recently used results past MB megabytes (default 64)\n");
+                    printf("--memo-verify=RATE: Rerun this fraction of memo hits and check they match\n\n");
+                    printf("Tools:\n");
+                    printf("lc3sim inspect NAME: Watch an emulator started with --shm=NAME\n");
+                    printf("lc3sim mutate [data.obj...] prog.obj tests.manifest: Mutation score of a test suite\n");
+                    printf("lc3sim equiv a.obj b.obj --entry=LABEL --inputs=regs,mem:RANGE: Compare two subroutines\n");
+                    printf("lc3sim inject prog.obj --faults=N --target=regs|mem|psr --window=I1-I2: Fault injection\n");
+                    printf("lc3sim analyze [data.obj...] prog.obj: Static worst case instruction counts\n");
+                    printf("lc3sim link [-o out.obj] main.obj|.rel [module...]: Link modules into one image\n");
+                    printf("lc3sim link -r [--float] [--import=NAME,...] prog.obj: Make a relocatable module\n");
+                    printf("lc3sim batch [-jN] [data.obj...] prog.obj jobs.manifest: JSON result of every job, with shared fixtures\n\n");
                     printf("NOTE: The last specified object file is assumed to be the main program!\n");
 
 
                     return 0;
                 }
-                else if (!strcmp(arg, "debug"))
-                {
-                    debug = 1;
-                }
-                else if (!strcmp(arg, "randomize"))
-                {
-                    randomize = 1;
-                }
-                else if (!strcmp(arg, "silent"))
-                {
-                    silent = 1;
-                }
-                else if (strstr(arg, "input=") == arg)
+
+                parse_run_option(&opts, arg);
+            }
+            else
+            {
+                uint32_t length;
+                uint16_t *base = load_object(arg, memory, &length);
+
+                if (base)
                 {
-                    arg += 6;
-                    int size = strlen(arg);
-                    input_size = MIN(size * sizeof(uint8_t), sizeof(input_buffer))+1;
-                    memcpy(input_buffer, arg, input_size);
-                    input_size /= sizeof(uint8_t); /* convert to length in characters */
+                    segments[segment_count].path = arg;
+                    segments[segment_count].start = base - memory;
+                    segments[segment_count].length = length;
+                    segment_count++;
                 }
-                else if (strstr(arg, "memory=") == arg)
+                else if (i < argc-1)
                 {
-                    char *tok;
-                    unsigned addr;
-                    unsigned i = 0;
-                    arg += 7;
-                    tok = strtok(arg, ",");
-
-                    do
-                    {
-                        sscanf(tok, "%x", &addr);
-
-                        memory_set[i][memory_size] = addr & 0xffff;
-                        if (i)
-                        {
-                            memory_size++;
-                            memory_size %= ARRAY_SIZE(memory_set[0]);
-                        }
-                        i = (i + 1) % 2;
-
-                    } while ((tok = strtok(NULL, ",")));
+                    fprintf(stderr, "Failed to load %s\n", argv[i]);
                 }
             }
-            else if (!parse_program_from_bin(arg, memory) && i < argc-1)
-            {
-                fprintf(stderr, "Failed to load %s\n", argv[i]);
-                continue;
-            }
         }
 
         /* last program is what we set PC to */
-        if (!(argc >= 2 && (pc = parse_program_from_bin(argv[argc-1], memory))))
+        if (!(argc >= 2 && (pc = load_object(argv[argc-1], memory, NULL))))
         {
             fprintf(stderr, "No program specified!\n");
             return 1;
         }
+
+        if (load_map_check(segments, segment_count) && opts.strict_load)
+        {
+            fprintf(stderr, "Refusing to run with overlapping files (--strict-load)\n");
+            return 1;
+        }
+
+        if (opts.load_map)
+            load_map_print(segments, segment_count, argv[argc-1]);
+
+        free(segments);
     }
 
 
-    if (randomize)
+    if (opts.randomize)
     {
-        srand(time(NULL));
+        srand(opts.has_seed ? opts.seed : time(NULL));
         for (int i = 0; i < 8; i++)
-            registers[i] = rand();
+            m->registers[i] = rand();
     }
 
-    /* overwrite the OS memory to use the start address of the given program */
-    /* FIXME: is this correct? */
-    memory[USER_PC] = pc - memory;
-    pc = memory + OS_START;
+    lc3_boot(m, pc - memory, &opts);
 
-    /* enable the clock */
-    memory[OS_MCR] |= (1u << 15);
-    /* we are ready for some data */
-    memory[OS_DSR] |= (1u << 15);
-    /* reset ddr */
-    memory[OS_DDR] = 0;
+    if (opts.lint)
+        lint_program(memory, pc - memory, stderr);
 
-    /* initialize specified memory locations */
-    for (int i = 0; i < memory_size; i++)
+    if (opts.limit_auto)
     {
-        memory[memory_set[0][i]] = memory_set[1][i];
-    }
+        uint64_t limit = static_limit(memory, pc - memory);
 
-    /* setup a breakpoint at USER_PC */
-    if (debug)
-    {
-        debug_ctx.next_bp = -1;
-        debug_ctx.cont = 1;
-        debug_ctx.breakpoint_size = 1;
-        debug_ctx.breakpoints[0] = memory[USER_PC];
+        if (limit)
+            opts.limit = limit;
+        else
+            fprintf(stderr, "No static bound for the program%s\n", opts.limit ? "" : ", running without a limit");
     }
 
-    /* terminate the emulator if clock gets disabled */
-    while (memory[OS_MCR] & (1u << 15))
+    if (opts.memo_dir)
     {
-        uint16_t instr = *pc;
-        pc++;
+        const char *refusal = memo_refusal(&opts);
+        char path[0x500];
 
-        memory[OS_KBSR] = (input_index < input_size) << 15;
-        if (memory[OS_KBSR]) memory[OS_KBDR] = input_buffer[input_index];
-
-        switch ((instr & 0xf000) >> 12)
+        if (refusal)
+        {
+            fprintf(stderr, "Not memoizing a run with %s\n", refusal);
+            opts.memo_dir = NULL;
+        }
+        else
         {
-            case 0b0001: /* ADD */
+            memo_dir(&opts, memo_path, sizeof(memo_path));
+            key = memo_key(m, &opts);
+            snprintf(path, sizeof(path), "%s/%016llx.json", memo_path, (unsigned long long)key);
+
+            if ((stored = map_file(path, &stored_size)))
             {
-                uint16_t sr2;
-                if (instr & (1 << 5))
+                /* most recently used goes last in eviction order */
+                utimensat(AT_FDCWD, path, NULL, 0);
+
+                if (memo_draw() >= opts.memo_verify)
                 {
-                    /* imm5 */
-                    sr2 = sext5(instr & 0b11111);
-                } else {
-                    /* SR2 */
-                    sr2 = registers[instr & 0b111];
+                    fwrite(stored, 1, stored_size, stdout);
+                    halted = stored_size > 14 && !memcmp(stored, "{\"halted\":true", 14);
+                    munmap(stored, stored_size);
+                    lc3_free(m);
+                    return halted ? 0 : 2;
                 }
+            }
+        }
+    }
 
-                registers[(instr & (0b111 << 9)) >> 9] = registers[(instr & (0b111 << 6)) >> 6] + sr2;
+    if (opts.disk_path && !lc3_attach_disk(m, opts.disk_path))
+    {
+        fprintf(stderr, "Failed to map disk image %s\n", opts.disk_path);
+        return 1;
+    }
 
-                update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+    if (opts.shm_name && !(shm = shm_create(opts.shm_name)))
+    {
+        fprintf(stderr, "Failed to create shared memory region %s\n", opts.shm_name);
+        return 1;
+    }
 
-                break;
-            }
-            case 0b0101: /* AND */
-            {
-                uint16_t sr2;
-                if (instr & (1 << 5))
-                {
-                    /* imm5 */
-                    sr2 = sext5(instr & 0b11111);
-                } else {
-                    /* SR2 */
-                    sr2 = registers[instr & 0b111];
-                }
+    micro.mem_latency = run_mem_latency(&opts);
+    debug_ctx.micro = &micro;
+    if (opts.micro)
+        micro_shadow(&isa, m);
 
-                registers[(instr & (0b111 << 9)) >> 9] = registers[(instr & (0b111 << 6)) >> 6] & sr2;
+    if ((opts.cache_spec || opts.pipeline_spec || opts.branch_stats || opts.advise) && opts.micro)
+    {
+        fprintf(stderr, "--cache, --pipeline, --branch-stats and --advise only work on the ISA engine\n");
+        return 1;
+    }
 
-                update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+    if (opts.advise)
+        profile = calloc(0x10000, sizeof(uint32_t));
 
-                break;
-            }
-            case 0b1001: /* NOT */
-            {
-                registers[(instr & (0b111 << 9)) >> 9] = ~registers[(instr & (0b111 << 6)) >> 6];
+    if (opts.branch_stats)
+        branches = branch_stats_create();
 
-                update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
+    if (opts.pipeline_spec && !(pipe = pipe_create(opts.pipeline_spec)))
+    {
+        fprintf(stderr, "Invalid pipeline configuration %s\n", opts.pipeline_spec);
+        return 1;
+    }
 
-                break;
-            }
-            case 0b1111: /* TRAP */
-            {
-                uint16_t temp = memory[OS_PSR];
-                /* check user mode */
-                if (memory[OS_PSR] & (1u << 15))
-                {
-                    memory[OS_USP] = registers[6];
-                    registers[6] = memory[OS_SSP];
-                    memory[OS_PSR] &= ~(1u << 15);
-                }
+    if (opts.cache_spec)
+    {
+        if (!(cache = cache_create(opts.cache_spec)))
+        {
+            fprintf(stderr, "Invalid cache configuration %s\n", opts.cache_spec);
+            return 1;
+        }
+    }
 
-                /* push old PSR and PC */
+    if (opts.vcd_path)
+    {
+        if (!(vcd = vcd_open(opts.vcd_path, opts.micro)))
+        {
+            fprintf(stderr, "Failed to open %s\n", opts.vcd_path);
+            return 1;
+        }
+        vcd_sample(vcd, m, &micro, *m->pc, 0);
+    }
 
-                registers[6]--; /* push */
-                memory[registers[6]] = temp;
-                registers[6]--; /* push */
-                memory[registers[6]] = pc - memory;
+    /* setup a breakpoint at USER_PC */
+    if (opts.debug)
+    {
+        m->dbg = &debug_ctx;
+        debug_ctx.finish_depth = -1;
+        debug_ctx.cont = 1;
+        debug_ctx.breakpoint_size = 1;
+        debug_ctx.breakpoints[0] = memory[USER_PC];
+    }
 
-                pc = memory + memory[instr & 0xff];
+    /* terminate the emulator if clock gets disabled */
+    while (lc3_running(m))
+    {
+        if (opts.limit && m->instret >= opts.limit && micro.state == UCODE_FETCH)
+            break;
 
-                break;
-            }
-            case 0b1110: /* LEA */
-            {
-                registers[(instr & (0b111 << 9)) >> 9] = (pc - memory) + sext9(instr & 0b111111111);
-                update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
-                break;
-            }
-            case 0b1100: /* JMP */
-            {
-                pc = memory + (int16_t)registers[(instr & (0b111 << 6)) >> 6];
-                break;
-            }
-            case 0b0000: /* BR */
-            {
-                if (((instr & (0b111 << 9)) >> 9) & (memory[OS_PSR] & 0b111))
-                    pc += sext9(instr & 0b111111111);
-                break;
-            }
-            case 0b0100: /* JSR(R) */
-            {
-                registers[7] = pc - memory;
-                if (instr & (1 << 11))
-                {
-                    /* imm11 */
-                    pc += sext11(instr & 0b11111111111);
-                } else {
-                    /* R */
-                    pc += (int16_t)registers[(instr & (0b111 << 6)) >> 6];
-                }
-                break;
-            }
-            case 0b0011: /* ST */
+        if (debug_ctx.ustep)
+        {
+            debug_ctx.ustep = 0;
+            int done = micro_state(m, &micro);
+            micro_dump(&micro);
+            if (vcd)
+                vcd_sample(vcd, m, &micro, micro.ir, opts.micro ? micro.cycles : m->cycles);
+
+            /* stay in the debugger until the instruction is complete */
+            if (!done)
             {
-                uint16_t *a = &pc[sext9(instr & 0b111111111)];
-                if (check_user_address(memory[OS_PSR], a - memory))
-                    interrupt(memory, registers, &pc, 0x2);
-                *a = registers[(instr & (0b111 << 9)) >> 9];
-                break;
+                while (!debug_cmd(&debug_ctx, memory, &m->pc, m->registers));
+                continue;
             }
-            case 0b1011: /* STI */
-            {
-                uint16_t *a = &pc[sext9(instr & 0b111111111)];
-                uint16_t address = *a;
-                if (check_user_address(memory[OS_PSR], a - memory))
-                    interrupt(memory, registers, &pc, 0x2);
-                if (check_user_address(memory[OS_PSR], address))
-                    interrupt(memory, registers, &pc, 0x2);
-                else
-                {
-                    memory[address] = registers[(instr & (0b111 << 9)) >> 9];
-                    if (address == OS_DDR && memory[OS_DDR])
-                    {
-                        buffer[ddrct++] = memory[OS_DDR];
-                        if (ddrct >= ddrsize-1)
-                        {
-                            ddrsize += 0x100;
-                            buffer = realloc(buffer, ddrsize);
-                            buffer[ddrct] = 0;
-                        }
-                    }
-                }
+        }
+        else if (opts.micro || micro.state != UCODE_FETCH)
+        {
+            int done;
 
-                break;
-            }
-            case 0b0111: /* STR */
-            {
-                uint16_t address = registers[(instr & (0b111 << 6)) >> 6] + sext6(instr & 0b111111);
-                if (check_user_address(memory[OS_PSR], address))
-                    interrupt(memory, registers, &pc, 0x2);
-                else
-                    memory[address] = registers[(instr & (0b111 << 9)) >> 9];
-                break;
-            }
-            case 0b0010: /* LD */
-            {
-                uint16_t *a = &pc[sext9(instr & 0b111111111)];
-                if (check_user_address(memory[OS_PSR], a - memory))
-                    interrupt(memory, registers, &pc, 0x2);
-                registers[(instr & (0b111 << 9)) >> 9] = *a;
-                update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
-                break;
-            }
-            case 0b1010: /* LDI */
-            {
-                uint16_t *a = &pc[sext9(instr & 0b111111111)];
-                uint16_t address = *a;
-                if (check_user_address(memory[OS_PSR], a - memory))
-                    interrupt(memory, registers, &pc, 0x2);
-                if (check_user_address(memory[OS_PSR], address))
-                    interrupt(memory, registers, &pc, 0x2);
-                else
-                {
-                    registers[(instr & (0b111 << 9)) >> 9] = memory[address];
-                    if (address == OS_KBDR) input_index++;
-                    update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
-                }
-                break;
-            }
-            case 0b0110: /* LDR */
-            {
-                uint16_t address = registers[(instr & (0b111 << 6)) >> 6] + sext6(instr & 0b111111);
-                if (check_user_address(memory[OS_PSR], address))
-                    interrupt(memory, registers, &pc, 0x2);
-                else
-                {
-                    registers[(instr & (0b111 << 9)) >> 9] = memory[address];
-                    update_cond_code(registers[(instr & (0b111 << 9)) >> 9], memory);
-                }
-                break;
-            }
-            case 0b1000: /* RTI */
+            do
             {
-                if (~memory[OS_PSR] & (1 << 15))
-                {
-                    pc = memory + memory[registers[6]];
-                    registers[6]++; /* pop */
-                    memory[OS_PSR] = memory[registers[6]];
-                    registers[6]++; /* pop */
+                done = micro_state(m, &micro);
+                if (vcd)
+                    vcd_sample(vcd, m, &micro, micro.ir, opts.micro ? micro.cycles : m->cycles);
+            } while (!done);
+        }
+        else
+        {
+            uint16_t ir = *m->pc;
 
-                    if (memory[OS_PSR] & (1 << 15))
-                    {
-                        /* setup user stack */
-                        memory[OS_SSP] = registers[6];
-                        registers[6] = memory[OS_USP];
-
-                        /* dump buffer on user return */
-                        if (!silent && debug)
-                        {
-                            printf(" --- buffer begin ---\n%s\n --- buffer end --- \n\n", buffer);
-                            printf("\n\n");
-                        }
-                    }
-                } else {
-                    /* throw exception */
-                    interrupt(memory, registers, &pc, 0x0);
-                }
-                break;
-            }
-            case 0b1101:
+            if (profile)
+                profile[m->pc - memory]++;
+
+            if ((cache || pipe || branches ? lc3_step_traced(m) : lc3_step(m)) < 0)
             {
-#ifndef LC3_EXTENDED
-                /* illegal instruction exception */
-                interrupt(memory, registers, &pc, 0x1);
-#else
-                parse_extended(instr, *pc, memory, registers);
-                pc++;
-#endif
-                break;
+                /* keep the waveform up to the fault */
+                if (vcd)
+                    vcd_close(vcd);
+                lc3_free(m);
+                return 1;
             }
-            default:
+
+            if (cache)
+                m->cycles += cache_trace(cache, &m->trace);
+            if (pipe)
+                pipe_push(pipe, &m->trace);
+            if (branches && !(m->trace.instr >> 12))
+                branch_record(branches, m->trace.pc, m->trace.instr, m->trace.taken);
+
+            if (vcd)
+                vcd_sample(vcd, m, &micro, ir, m->cycles);
+        }
+
+        if (opts.micro)
+        {
+            lc3_step(&isa);
+            if (!micro_check(m, &isa, &micro))
             {
-                fprintf(stderr, "unimplemented instruction %x\n", instr & 0xf000 >> 12);
-                free(memory);
-                free(buffer);
+                printf("The microsequencer and the ISA engine disagree after instruction %llu!\n",
+                       (unsigned long long)m->instret);
+                printf("microsequencer: ");
+                dump_registers(m->registers, memory[OS_PSR], m->pc - memory, *m->pc);
+                printf("ISA engine: ");
+                dump_registers(isa.registers, isa.memory[OS_PSR], isa.pc - isa.memory, *isa.pc);
+                if (vcd)
+                    vcd_close(vcd);
+                lc3_free(m);
                 return 1;
             }
         }
 
+        /* only pay for the live view when an inspector asked for it */
+        if (shm && !(m->instret & SHM_POLL_MASK) &&
+            atomic_load_explicit(&shm->request, memory_order_relaxed) != atomic_load_explicit(&shm->served, memory_order_relaxed))
+            shm_publish(shm, memory, m->registers, m->pc - memory, m->instret, 0);
+
         //printf("memory[0x4000]=%d\n", (int16_t)memory[0x4000]);
         //printf("memory[0x4001]=%d\n", (int16_t)memory[0x4001]);
 
-        if (debug)
+        if (opts.debug)
         {
-            if (pc - memory == debug_ctx.next_bp)
-                debug_ctx.next_bp = -1;
-
-            for (int i = 0; i < debug_ctx.breakpoint_size; i++)
+            if (debug_ctx.finish_depth >= 0)
             {
-                if (pc - memory == debug_ctx.breakpoints[i])
+                /* next/finish only watch the shadow call stack */
+                if (debug_ctx.depth <= debug_ctx.finish_depth)
+                {
+                    debug_ctx.finish_depth = -1;
                     debug_ctx.cont = 0;
+                }
+            }
+            else
+            {
+                for (int i = 0; i < debug_ctx.breakpoint_size; i++)
+                {
+                    if (m->pc - memory == debug_ctx.breakpoints[i])
+                        debug_ctx.cont = 0;
+                }
             }
         }
 
-        if (debug && !debug_ctx.cont && debug_ctx.next_bp == -1)
+        if (opts.debug && !debug_ctx.cont && debug_ctx.finish_depth == -1)
         {
-            dump_instr(*pc);
-            dump_registers(registers, memory[OS_PSR], pc - memory, *pc);
+            dump_instr(*m->pc);
+            dump_registers(m->registers, memory[OS_PSR], m->pc - memory, *m->pc);
         }
 
-        if (debug && !debug_ctx.cont && debug_ctx.next_bp == -1)
-            while (!debug_cmd(&debug_ctx, memory, &pc, registers));
+        if (opts.debug && !debug_ctx.cont && debug_ctx.finish_depth == -1)
+        {
+            while (!debug_cmd(&debug_ctx, memory, &m->pc, m->registers));
+            /* the debugger may have changed memory or registers */
+            if (opts.micro)
+                micro_shadow(&isa, m);
+        }
     }
 
+    halted = !lc3_running(m);
 
-    if (!silent)
+    if (!opts.silent && !opts.json)
     {
-        printf(" --- buffer begin ---\n%s\n --- buffer end --- \n\n", buffer);
+        printf(" --- buffer begin ---\n%s\n --- buffer end --- \n\n", m->output);
         printf("\n\n");
     }
 
-    if (debug)
+    if (opts.debug)
+    {
+        dump_registers(m->registers, memory[OS_PSR], m->pc - memory - 1, *(m->pc - 1));
+    }
+
+    for (int i = 0; i < opts.dump_size && !opts.json; i++)
     {
-        dump_registers(registers, memory[OS_PSR], pc - memory - 1, *(pc - 1));
+        printf("memory[%#x]=%#x\n", opts.dump_addr[i], memory[opts.dump_addr[i]]);
     }
 
-    for (int i = 0; i < dump_size; i++)
+    if (opts.stats && !opts.json)
     {
-        printf("memory[%#x]=%#x\n", dump_addr[i], memory[dump_addr[i]]);
+        printf("instructions: %llu\n", (unsigned long long)m->instret);
+        printf("cycles: %llu\n", (unsigned long long)m->cycles);
+        printf("CPI: %.2f\n", m->instret ? (double)m->cycles / m->instret : 0.0);
+        if (opts.micro)
+            printf("microsequencer cycles: %llu\n", (unsigned long long)micro.cycles);
     }
 
-    if (!silent)
-        printf("\n\nThe clock was disabled!\n\n");
+    if (cache)
+        cache_report(cache, memory);
 
-    free(buffer);
-    free(memory);
-    return 0;
+    if (pipe)
+    {
+        pipe_finish(pipe);
+        pipe_report(pipe, memory);
+    }
+
+    if (branches)
+        branch_report(branches, memory);
+
+    if (profile)
+    {
+        struct text_buffer advice = {0};
+
+        advise_program(memory, pc - memory, profile, &advice);
+        tb_flush(&advice, stdout);
+        free(profile);
+    }
+
+    if (vcd)
+        vcd_close(vcd);
+
+    if (opts.micro)
+    {
+        if (memcmp(memory, isa.memory, LC3_MEMORY_WORDS * sizeof(uint16_t)) || strcmp(m->output, isa.output))
+            printf("The microsequencer and the ISA engine finished with different memory or output!\n");
+        free(isa.memory);
+        free(isa.output);
+    }
+
+    if (opts.json)
+    {
+        struct text_buffer result = {0};
+
+        json_result(&result, m, &opts, halted);
+        tb_printf(&result, "\n");
+        if (stored)
+        {
+            if (stored_size != result.size || memcmp(stored, result.data, result.size))
+                fprintf(stderr, "Stored result %016llx differs from a fresh run, replacing it\n", (unsigned long long)key);
+            else
+                opts.memo_dir = NULL;
+            munmap(stored, stored_size);
+        }
+
+        if (opts.memo_dir)
+            memo_store(memo_path, key, result.data, result.size, opts.memo_size ? opts.memo_size : MEMO_DEFAULT_SIZE);
+        tb_flush(&result, stdout);
+    }
+    else if (!opts.silent)
+        printf(halted ? "\n\nThe clock was disabled!\n\n" : "\n\nThe instruction limit was reached!\n\n");
+
+    if (shm)
+    {
+        /* leave a final snapshot for anyone still attached */
+        shm_publish(shm, memory, m->registers, m->pc - memory, m->instret, 1);
+        shm_destroy(shm, opts.shm_name);
+    }
+
+    lc3_free(m);
+    return halted ? 0 : 2;
 }
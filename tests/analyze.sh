@@ -0,0 +1,60 @@
+#!/bin/sh
+# lc3sim analyze bounds loops with a few patterns. every fixture checks the
+# loops it finds, the worst case from boot, and that a real run stays within
+# that bound. runs are in supervisor mode (x238 is the PSR the OS starts the
+# program with) so the polling loop may read the display status register
+. tests/common.sh
+
+build lc3sim
+
+# analyze NAME WORDS EXPECTED_LOOPS EXPECTED_BOUND
+analyze()
+{
+    words be "$dir/$1.obj" $2
+    out=$("$dir/lc3sim" analyze "$dir/$1.obj" | grep '^  loop' | sed 's/^  //' | tr '\n' ';')
+    check "$1: loops" "$3" "$out"
+    out=$("$dir/lc3sim" analyze "$dir/$1.obj" | sed -n 's/^worst case from boot to halt: //p')
+    check "$1: bound" "$4" "$out"
+
+    case $4 in
+        unbounded) ;;
+        *)
+            ran=$("$dir/lc3sim" --silent --stats --memory=0x238,0x0002 "$dir/$1.obj" | sed -n 's/^instructions: //p')
+            bound=${4% instructions}
+            check "$1: a run stays within the bound" yes "$([ "$ran" -le "$bound" ] && echo yes || echo "no, $ran")"
+            ;;
+    esac
+}
+
+# R1 = 10, then decrement and branch back while positive
+analyze test-last "3000 5260 1265 1241 127f 03fe f025" \
+    "loop x3003-x3004: 10 iterations, R1 from 10 by -1;" "217 instructions"
+
+# R1 = 6, test R1 at the top of the loop and leave when it is zero
+analyze test-first "3000 5260 1266 1260 0402 127f 0ffc f025" \
+    "loop x3002-x3005: 7 iterations, R1 from 6 by -1;" "224 instructions"
+
+# 3 outer iterations of 4 inner ones
+analyze nested "3000 5020 1023 5260 1264 127f 03fe 103f 03fa f025" \
+    "loop x3004-x3005: 4 iterations, R1 from 4 by -1;loop x3002-x3007: 3 iterations, R0 from 3 by -1;" \
+    "232 instructions"
+
+# walk a pointer over "abc" until the terminating zero
+analyze sentinel "3000 e005 6200 0402 1021 0ffc f025 0061 0062 0063 0000" \
+    "loop x3001-x3004: 4 iterations, R0 scans from x3006;" "211 instructions"
+
+# wait for the display, which the analysis counts as ready
+analyze polling "3000 a202 07fe f025 fe04" \
+    "loop x3000-x3001: 1 iterations, polls xFE04;" "196 instructions"
+
+# count up forever
+analyze unbounded "3000 1261 0ffe" "loop x3000-x3001: unbounded, no exit;" "unbounded"
+
+# batch keeps the bound per booted image: the second job raises the counter
+# with a --memory preset and needs a larger limit than the first
+words be "$dir/count.obj" 3000 5260 1265 1241 127f 03fe f025
+printf -- '--limit=auto\n--limit=auto --memory=0x3001,0x126f\n' > "$dir/auto.manifest"
+out=$("$dir/lc3sim" batch -j1 "$dir/count.obj" "$dir/auto.manifest" 2>/dev/null | sed 's/.*"halted":\([a-z]*\).*/\1/' | tr '\n' ' ')
+check "batch --limit=auto is computed per image" "true true " "$out"
+
+exit $fail
@@ -0,0 +1,82 @@
+#!/bin/sh
+# lc3sim batch manifests: quoting, fixtures and the lines it has to reject.
+# one worker, so the JSON lines come out in manifest order
+. tests/common.sh
+
+build lc3sim
+
+# echo the input up to and including the first newline, then halt
+words be "$dir/echo.obj" 3000 f020 f021 1236 0bfc f025
+
+# batch MANIFEST: run it, the JSON lines go to $dir/out, stderr to $dir/err
+# and the exit status to $status
+batch()
+{
+    status=0
+    "$dir/lc3sim" batch -j1 "$dir/echo.obj" "$dir/$1" > "$dir/out" 2> "$dir/err" || status=$?
+}
+
+# line N FILE: one line of a file
+line()
+{
+    sed -n "$1p" "$dir/$2"
+}
+
+regs='"pc":"0x0220","psr":"0x0002","registers":["0x0000","0x7fff","0x0000","0x0000","0x0000","0x0000","0x2ffe","0x0000"]'
+
+cat > "$dir/good.manifest" << 'EOF'
+# quoting and escapes
+--input="a b\n" --expect="a b\n\n\nHalting!\n\n"
+--input=tab\there\n
+--input="say \"hi\"\n"
+fixture A --input="a\n" --memory=0x3100,1 --dump=0x3100
+fixture B --input="b\n" --expect="b\n\n\nHalting!\n\n"
+# later fixtures win over earlier ones, the job's own options over both
+@A @B
+@B @A
+--input="j\n" @A --memory=0x3100,2
+EOF
+batch good.manifest
+check "quoted spaces" \
+    '{"job":1,"line":2,"pass":true,"result":{"halted":true,"instructions":247,"cycles":247,'"$regs"',"output":"a b\n\n\nHalting!\n\n","memory":{}}}' \
+    "$(line 1 out)"
+check "escapes outside quotes" \
+    '{"job":2,"line":3,"pass":null,"result":{"halted":true,"instructions":327,"cycles":327,'"$regs"',"output":"tab\u0009here\n\n\nHalting!\n\n","memory":{}}}' \
+    "$(line 2 out)"
+check "escaped quotes" \
+    '{"job":3,"line":4,"pass":null,"result":{"halted":true,"instructions":327,"cycles":327,'"$regs"',"output":"say \"hi\"\n\n\nHalting!\n\n","memory":{}}}' \
+    "$(line 3 out)"
+check "the last fixture wins" \
+    '{"job":4,"line":8,"pass":true,"result":{"halted":true,"instructions":215,"cycles":215,'"$regs"',"output":"b\n\n\nHalting!\n\n","memory":{"0x3100":"0x0001"}}}' \
+    "$(line 4 out)"
+check "in the order they are named" \
+    '{"job":5,"line":9,"pass":false,"result":{"halted":true,"instructions":215,"cycles":215,'"$regs"',"output":"a\n\n\nHalting!\n\n","memory":{"0x3100":"0x0001"}}}' \
+    "$(line 5 out)"
+check "the job wins on either side of the fixture" \
+    '{"job":6,"line":10,"pass":null,"result":{"halted":true,"instructions":215,"cycles":215,'"$regs"',"output":"j\n\n\nHalting!\n\n","memory":{"0x3100":"0x0002"}}}' \
+    "$(line 6 out)"
+check "a failed job fails the batch" 1 "$status"
+
+printf 'fixture A --input="a\\n"\n--input="b\\n"\n@A\n' > "$dir/pass.manifest"
+batch pass.manifest
+check "a batch that passes" "0 2" "$status $(wc -l < "$dir/out")"
+
+printf 'fixture A --input="a\\n"\nfixture A --input="x\\n"\n@A\n@nope\n' > "$dir/fixtures.manifest"
+batch fixtures.manifest
+check "a fixture is declared once" "$dir/fixtures.manifest:2: fixture A is already declared on line 1" "$(line 1 err)"
+check "the first declaration stays" '"output":"a\n\n\nHalting!\n\n"' "$(line 1 out | grep -o '"output":"[^"]*"')"
+check "an unknown fixture" "$dir/fixtures.manifest:4: unknown fixture nope" "$(line 2 err)"
+check "fails its job" '{"job":2,"line":4,"pass":false,"error":"invalid job"}' "$(line 2 out)"
+
+# fgets reads 0x1000 bytes at a time, the rest of the line must not become a job
+{ printf -- '--input="'; head -c 5000 /dev/zero | tr '\0' a; printf '"\n--input="z\\n"\n'; } > "$dir/long.manifest"
+batch long.manifest
+check "an over-long line" "$dir/long.manifest:1: line is longer than 4094 characters" "$(line 1 err)"
+check "is skipped as a whole" '"job":1,"line":2' "$(line 1 out | grep -o '"job":1,"line":2')"
+check "jobs of a manifest with a bad line" "1 1" "$status $(wc -l < "$dir/out")"
+
+printf 'fixture A --input="a\\n"\nfixture A --input="x\\n"\n@A\n' > "$dir/duplicate.manifest"
+batch duplicate.manifest
+check "a rejected line fails the batch" 1 "$status"
+
+exit $fail
@@ -0,0 +1,52 @@
+# shared by the scripts in tests/, which are run from the top of the
+# repository: sh tests/NAME.sh. each prints one line per check and exits 1
+# when any of them failed
+set -e
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+fail=0
+
+# build NAME [CFLAGS...]: compile lc3sim.c to $dir/NAME
+build()
+{
+    name=$1
+    shift
+    ${CC:-gcc} -O2 "$@" -o "$dir/$name" lc3sim.c -lpthread
+}
+
+# check NAME EXPECTED ACTUAL
+check()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        printf 'FAIL %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$3"
+        fail=1
+    fi
+}
+
+# words be|le FILE WORD...: write hex words to FILE in either byte order,
+# .obj files and disk images are big endian
+words()
+{
+    order=$1
+    out=$2
+    shift 2
+    : > "$out"
+    for w in "$@"; do
+        v=$((0x$w))
+        if [ "$order" = be ]; then
+            printf "$(printf '\\%03o\\%03o' $((v >> 8)) $((v & 255)))" >> "$out"
+        else
+            printf "$(printf '\\%03o\\%03o' $((v & 255)) $((v >> 8)))" >> "$out"
+        fi
+    done
+}
+
+# dumps: the memory[...] lines of a run, on one line
+dumps()
+{
+    grep '^memory' | tr '\n' ' '
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+# .obj files and disk images are big endian words, check that they load the
+# same on any host. the second build takes the big endian host path, on a
+# little endian host it has to read byte swapped copies of the same files
+. tests/common.sh
+
+build lc3sim
+build lc3sim-be -DLC3_HOST_BIG_ENDIAN=1
+
+# .ORIG x3000: HALT, then the data words x1234 and xABCD
+small="3000 f025 1234 abcd"
+words be "$dir/small.obj" $small
+words le "$dir/small-swapped.obj" $small
+expect="memory[0x3001]=0x1234 memory[0x3002]=0xabcd "
+out=$("$dir/lc3sim" --silent --dump=0x3001,0x3002 "$dir/small.obj" | dumps)
+check "words are read big endian" "$expect" "$out"
+out=$("$dir/lc3sim-be" --silent --dump=0x3001,0x3002 "$dir/small-swapped.obj" | dumps)
+check "a big endian host reads them in its own order" "$expect" "$out"
+
+# read disk sector 0 into x4000 and poll DSKCR until it is done. the word at
+# x238 is the PSR the OS starts the program with, clearing its top bit runs
+# the program in supervisor mode where the disk registers can be reached
+disk="3000 2008 b00a 2007 b009 2006 b008 a207 07fe f025 0000 4000 0001 fe18 fe1a fe1c"
+words be "$dir/disk.obj" $disk
+words le "$dir/disk-swapped.obj" $disk
+words be "$dir/sector.img" 1234 abcd
+words le "$dir/sector-swapped.img" 1234 abcd
+head -c 508 /dev/zero >> "$dir/sector.img"
+head -c 508 /dev/zero >> "$dir/sector-swapped.img"
+expect="memory[0x4000]=0x1234 memory[0x4001]=0xabcd memory[0x4002]=0 "
+out=$("$dir/lc3sim" --silent --memory=0x238,0x0002 --disk="$dir/sector.img" --dump=0x4000,0x4001,0x4002 \
+      "$dir/disk.obj" | dumps)
+check "disk sectors are read big endian" "$expect" "$out"
+out=$("$dir/lc3sim-be" --silent --memory=0x238,0x0002 --disk="$dir/sector-swapped.img" --dump=0x4000,0x4001,0x4002 \
+      "$dir/disk-swapped.obj" | dumps)
+check "a big endian host reads disk sectors in its own order" "$expect" "$out"
+
+# .ORIG x0000 followed by 0x10000 words covers all of memory, and the load
+# map must show every word of it. it covers the OS, so --strict-load refuses
+# to run it (the limit only matters if it does)
+{ printf '\000\000'; head -c 131070 /dev/zero; printf '\022\064'; } > "$dir/full.obj"
+out=$("$dir/lc3sim" --strict-load --silent --limit=1000 "$dir/full.obj" 2>&1 | head -n 1 | sed 's/ overlaps.*//')
+check "an object can fill all of memory" "$dir/full.obj (x0000-xFFFF)" "$out"
+
+exit $fail
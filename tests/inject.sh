@@ -0,0 +1,17 @@
+#!/bin/sh
+# lc3sim inject resumes faulty runs from checkpoints of the fault free run,
+# a fault nothing ever reads must not change the outcome
+. tests/common.sh
+
+build lc3sim
+
+# count R1 down from 15, then store CNT_CYCLO to x3009 and halt
+words be "$dir/cyc.obj" 3000 5260 126f 127f 03fe a003 3003 f025 0000 fe26 0000
+
+for timing in none fsm; do
+    out=$("$dir/lc3sim" inject "$dir/cyc.obj" --faults=200 --target=mem:0x3400-0x3400 --dump=0x3009 \
+          --timing=$timing | grep '^masked')
+    check "the cycle counter resumes from a checkpoint (--timing=$timing)" "masked: 200 (100.0%)" "$out"
+done
+
+exit $fail
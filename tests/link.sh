@@ -0,0 +1,44 @@
+#!/bin/sh
+# lc3sim link -r turns assembled modules into relocatable ones, the linker
+# then places them and resolves the references between them
+. tests/common.sh
+
+build lc3sim
+
+# sym FILE NAME ADDR...: a symbol table in the lc3as format
+sym()
+{
+    out=$1
+    shift
+    printf '// Symbol table\n// Scope level 0:\n//\tSymbol Name       Page Address\n//\t----------------  ------------\n' > "$out"
+    while [ $# -gt 0 ]; do
+        printf '//\t%-16s  %s\n' "$1" "$2" >> "$out"
+        shift 2
+    done
+}
+
+# R0 = 6, JSR ADDK, ST R0 to RES and halt. ADDK is a placeholder label at the
+# end that stands for the routine in the other module
+words be "$dir/main.obj" 3000 5020 1026 4803 3001 f025 0000 0000
+sym "$dir/main.sym" MAIN 3000 RES 3005 ADDK 3006
+
+# ADDK: R0 += K, with K reached through a pointer so that floating the module
+# has to relocate the pointer. assembled at x4000, linked wherever it fits
+words be "$dir/lib.obj" 4000 2203 6240 1001 c1c0 4005 0007
+sym "$dir/lib.sym" ADDK 4000 PTR 4004 K 4005
+
+out=$("$dir/lc3sim" link -r --import=ADDK "$dir/main.obj")
+check "main imports ADDK" "wrote $dir/main.rel: 7 words, 2 exports, 1 imports, 1 relocations" "$out"
+out=$("$dir/lc3sim" link -r --float "$dir/lib.obj")
+check "the pointer in lib moves with it" "wrote $dir/lib.rel: 6 words, 3 exports, 0 imports, 1 relocations" "$out"
+
+out=$("$dir/lc3sim" link -o "$dir/prog.obj" "$dir/main.rel" "$dir/lib.rel" | tr '\n' ' ')
+check "lib is placed after main" \
+    "$dir/main.rel: x3000-x3006 $dir/lib.rel: x3007-x300C wrote $dir/prog.obj (x3000-x300C) and $dir/prog.sym " "$out"
+out=$("$dir/lc3sim" --silent --dump=0x3005,0x300b "$dir/prog.obj" | dumps)
+check "main calls ADDK across the import" "memory[0x3005]=0xd memory[0x300b]=0x300c " "$out"
+
+out=$("$dir/lc3sim" link -r --import=SQRT "$dir/main.obj" 2>&1 || true)
+check "an import needs a placeholder label" "$dir/main.obj: no label SQRT to import" "$out"
+
+exit $fail